@@ -11,6 +11,7 @@ COMMAND:
   guest           Build xv6 guest OS only
   -h, --help      Show this help message
   debug           Build hypervisor in debug mode (with DEBUG_MODE=1)
+  bench           Build hypervisor with boot time micro benchmarks (with BENCH_MODE=1)
 
 Note: If build.sh failed at first time, run it again!
 
@@ -37,6 +38,14 @@ case "$1" in
         echo ">>>>>> Debug mode hypervisor build completed"
         ;;
 
+    "bench")
+        # 构建带启动阶段性能测试的hypervisor
+        echo ">>>>>> Building hypervisor in bench mode..."
+        make clean
+        make VERBOSE=1 BENCH_MODE=1
+        echo ">>>>>> Bench mode hypervisor build completed"
+        ;;
+
     "")
         # 仅构建hypervisor
         echo ">>>>>> Building hypervisor..."
@@ -221,6 +221,12 @@ typedef uint64 *pagetable_t; // 512 PTEs
 // 10 --   x    RO
 // 11 --  RO    RO
 #define PTE_AP(ap)  (((ap) & 3) << 6)
+// PTE_SH(Shareability)
+// 00 -- non-shareable
+// 10 -- outer shareable
+// 11 -- inner shareable
+#define PTE_SH(sh)  (((sh) & 3) << 8)
+#define PTE_ISH PTE_SH(3)
 #define PTE_U   PTE_AP(1)
 #define PTE_RO  PTE_AP(2)
 #define PTE_URO PTE_AP(3)
@@ -232,14 +238,16 @@ typedef uint64 *pagetable_t; // 512 PTEs
 // index is set by mair_el1
 #define AI_DEVICE_nGnRnE_IDX  0x0
 #define AI_NORMAL_NC_IDX      0x1
+#define AI_NORMAL_WB_IDX      0x2
 
 // memory type
 #define MT_DEVICE_nGnRnE  0x0
 #define MT_NORMAL_NC      0x44
+#define MT_NORMAL_WB      0xff  // inner/outer write-back read/write-allocate
 
 #define PTE_INDX(i) (((i) & 7) << 2)
 #define PTE_DEVICE  PTE_INDX(AI_DEVICE_nGnRnE_IDX)
-#define PTE_NORMAL  PTE_INDX(AI_NORMAL_NC_IDX)
+#define PTE_NORMAL  (PTE_INDX(AI_NORMAL_WB_IDX) | PTE_ISH)
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa)  ((uint64)(pa) & 0xfffffffff000)
@@ -268,3 +276,15 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define TCR_T1SZ(n)   (((n) & 0x3f) << 16)
 #define TCR_TG1(n)    (((n) & 0x3) << 30)
 #define TCR_IPS(n)    (((n) & 0x7) << 32)
+// table walk attributes: 1 -- write-back read/write-allocate, 3 -- inner shareable
+#define TCR_IRGN0(n)  (((n) & 0x3) << 8)
+#define TCR_ORGN0(n)  (((n) & 0x3) << 10)
+#define TCR_SH0(n)    (((n) & 0x3) << 12)
+#define TCR_IRGN1(n)  (((n) & 0x3) << 24)
+#define TCR_ORGN1(n)  (((n) & 0x3) << 26)
+#define TCR_SH1(n)    (((n) & 0x3) << 28)
+
+// system control register
+#define SCTLR_M   (1 << 0)    // mmu enable
+#define SCTLR_C   (1 << 2)    // data cache enable
+#define SCTLR_I   (1 << 12)   // instruction cache enable
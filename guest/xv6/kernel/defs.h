@@ -104,6 +104,9 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 
+// entry.S
+uint64          hvc_call(uint64, uint64, uint64, uint64, uint64);
+
 // swtch.S
 void            swtch(struct context*, struct context*);
 
@@ -30,13 +30,13 @@ entrypgtinit()
 {
   // Phase 1
   for(uint64 va = 0x40000000; va < (uint64)end; va += 2*1024*1024) {
-    l2entrypgt[PX(2,va)] = PA2PTE(va) | PTE_AF | PTE_INDX(AI_NORMAL_NC_IDX) | PTE_VALID;
+    l2entrypgt[PX(2,va)] = PA2PTE(va) | PTE_AF | PTE_NORMAL | PTE_VALID;
     l1entrypgt[PX(1,va)] = PA2PTE(l2entrypgt) | PTE_TABLE | PTE_VALID;
   }
 
   // Phase 2
   for(uint64 va = 0xffffff8040000000; va < (uint64)P2V(end); va += 2*1024*1024) {
-    l2kpgt[PX(2,va)] = PA2PTE(V2P(va)) | PTE_AF | PTE_INDX(AI_NORMAL_NC_IDX) | PTE_VALID;
+    l2kpgt[PX(2,va)] = PA2PTE(V2P(va)) | PTE_AF | PTE_NORMAL | PTE_VALID;
     l1kpgt[PX(1,va)] = PA2PTE(l2kpgt) | PTE_TABLE | PTE_VALID;
   }
 }
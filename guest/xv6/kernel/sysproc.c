@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "vmstat.h"
 
 uint64
 sys_exit(void)
@@ -95,3 +96,38 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// copy up to max hypervisor exit statistics records of vcpu cpu
+// to user buffer addr, return the number of records.
+uint64
+sys_vmstat(void)
+{
+  int cpu, max, n, cap, total = 0;
+  uint64 dst;
+  char *page;
+
+  if(argint(0, &cpu) < 0 || argaddr(1, &dst) < 0 || argint(2, &max) < 0)
+    return -1;
+  if((page = kalloc()) == 0)
+    return -1;
+
+  // the hypervisor writes into one physically contiguous page at a time
+  while(total < max){
+    cap = PGSIZE / sizeof(struct vmstat_rec);
+    if(cap > max - total)
+      cap = max - total;
+    n = (int)hvc_call(VMSTAT_HVC_FID, cpu, V2P(page), cap * sizeof(struct vmstat_rec), total);
+    if(n < 0 ||
+       copyout(myproc()->pagetable, dst + total * sizeof(struct vmstat_rec),
+               page, n * sizeof(struct vmstat_rec)) < 0){
+      total = -1;
+      break;
+    }
+    total += n;
+    if(n < cap)
+      break;
+  }
+
+  kfree(page);
+  return total;
+}
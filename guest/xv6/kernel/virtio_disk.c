@@ -1,7 +1,7 @@
 //
 // driver for qemu's virtio disk device.
 // uses qemu's mmio interface to virtio.
-// qemu presents a "legacy" virtio interface.
+// the modern (virtio 1.x) mmio interface, version 2.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
@@ -20,40 +20,45 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
-static struct disk {
+// one request queue. with VIRTIO_BLK_F_MQ each cpu submits on its
+// own queue, under its own lock.
+struct vqueue {
   // the virtio driver and device mostly communicate through a set of
-  // structures in RAM. pages[] allocates that memory. pages[] is a
-  // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
-
-  // pages[] is divided into three regions (descriptors, avail, and
-  // used), as explained in Section 2.6 of the virtio specification
-  // for the legacy interface.
+  // structures in RAM, the three rings, as explained in Section 2.7 of
+  // the virtio specification.
   // https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf
-  
-  // the first region of pages[] is a set (not a ring) of DMA
+  // the modern interface lets each ring be placed on its own; here
+  // they share the first page of the queue, each on its own cache
+  // lines, so the device never sees a ring cross a page.
+  struct {
+    struct virtq_desc desc[NUM];
+    struct virtq_avail avail __attribute__ ((aligned (64)));
+    struct virtq_used used __attribute__ ((aligned (64)));
+  } rings;
+
+  // the first ring is a set (not a ring) of DMA
   // descriptors, with which the driver tells the device where to read
   // and write individual disk operations. there are NUM descriptors.
   // most commands consist of a "chain" (a linked list) of a couple of
   // these descriptors.
-  // points into pages[].
+  // points into rings.
   struct virtq_desc *desc;
 
   // next is a ring in which the driver writes descriptor numbers
   // that the driver would like the device to process.  it only
   // includes the head descriptor of each chain. the ring has
   // NUM elements.
-  // points into pages[].
+  // points into rings.
   struct virtq_avail *avail;
 
   // finally a ring in which the device writes descriptor numbers that
   // the device has finished processing (just the head of each chain).
   // there are NUM used ring entries.
-  // points into pages[].
+  // points into rings.
   struct virtq_used *used;
 
   // our own book-keeping.
+  int index;       // queue number, what QUEUE_NOTIFY is written
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
@@ -71,92 +76,129 @@ static struct disk {
   
   struct spinlock vdisk_lock;
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+} __attribute__ ((aligned (PGSIZE)));
+
+static struct disk {
+  struct vqueue q[NQ];
+  int nq;          // queues in use
+  int event_idx;   // VIRTIO_RING_F_EVENT_IDX negotiated
+} disk;
+
+static void
+vqueue_init(struct vqueue *vq, int index)
+{
+  initlock(&vq->vdisk_lock, "virtio_disk");
+  vq->index = index;
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = index;
+  if(*R(VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  if(sizeof(vq->rings) > PGSIZE)
+    panic("virtio disk rings too big");
+  memset(&vq->rings, 0, sizeof(vq->rings));
+  vq->desc = vq->rings.desc;
+  vq->avail = &vq->rings.avail;
+  vq->used = &vq->rings.used;
+
+  // tell the device where each ring is.
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = V2P(vq->desc);
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = V2P(vq->desc) >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = V2P(vq->avail);
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = V2P(vq->avail) >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = V2P(vq->used);
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = V2P(vq->used) >> 32;
+
+  // queue is ready.
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int i = 0; i < NUM; i++)
+    vq->free[i] = 1;
+}
 
 void
 virtio_disk_init(void)
 {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 1 ||
+     *R(VIRTIO_MMIO_VERSION) != 2 ||
      *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
      *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
     panic("could not find virtio disk");
   }
   
+  // reset device
+  *R(VIRTIO_MMIO_STATUS) = status;
+
+  // set ACKNOWLEDGE status bit
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
   *R(VIRTIO_MMIO_STATUS) = status;
 
+  // set DRIVER status bit
   status |= VIRTIO_CONFIG_S_DRIVER;
   *R(VIRTIO_MMIO_STATUS) = status;
 
-  // negotiate features
+  // negotiate features, 64 bits of them in two words.
+  *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
   uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+  features |= (uint64)*R(VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+  if(!(features & (1UL << VIRTIO_F_VERSION_1)))
+    panic("virtio disk is legacy only");
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
   features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features >> 32;
+  disk.event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
+  // re-read status to ensure FEATURES_OK is set.
+  status = *R(VIRTIO_MMIO_STATUS);
+  if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
+    panic("virtio disk FEATURES_OK unset");
+
+  // one queue per cpu, as many as the device has.
+  disk.nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ)){
+    disk.nq = *(volatile uint16 *)R(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+    if(disk.nq > NQ)
+      disk.nq = NQ;
+    if(disk.nq < 1)
+      disk.nq = 1;
+  }
+  for(int q = 0; q < disk.nq; q++)
+    vqueue_init(&disk.q[q], q);
+
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
-  *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
-
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  // printf("### disk.pages=%p, disk.pages's pa=%p, pfn=%p\n",
-  //        disk.pages, V2P(disk.pages), V2P(disk.pages) >> PGSHIFT);
-  *R(VIRTIO_MMIO_QUEUE_PFN) = V2P(disk.pages) >> PGSHIFT;
-
-  // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-
-  // printf("sizeof(struct virtq_desc) = %d\nsizeof(struct virtq_avail) = %d\n"
-  //        "sizeof(struct virtq_used) = %d\nsizeof(struct disk) = %d\n",
-  //        sizeof(struct virtq_desc), sizeof(struct virtq_avail),
-  //        sizeof(struct virtq_used), sizeof(struct disk));
-
-  disk.desc = (struct virtq_desc *) disk.pages;
-  disk.avail = (struct virtq_avail *)(disk.pages + NUM*sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *) (disk.pages + PGSIZE);
-
-    // printf("disk.avail = %p\ndisk.desc = %p\ndisk.used = %p\n ",
-    //        *(int *)disk.avail, *(int *)disk.desc, *(int *)disk.used);
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
-
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vqueue *vq)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(vq->free[i]){
+      vq->free[i] = 0;
       return i;
     }
   }
@@ -165,28 +207,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vqueue *vq, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
+  wakeup(&vq->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vqueue *vq, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -197,13 +239,13 @@ free_chain(int i)
 // allocate three descriptors (they need not be contiguous).
 // disk transfers always use three descriptors.
 static int
-alloc3_desc(int *idx)
+alloc3_desc(struct vqueue *vq, int *idx)
 {
   for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+    idx[i] = alloc_desc(vq);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(vq, idx[j]);
       return -1;
     }
   }
@@ -217,7 +259,10 @@ virtio_disk_rw(struct buf *b, int write)
   //        write ? "write" : "read", b->blockno);
   uint64 sector = b->blockno * (BSIZE / 512);
   // char buf[1024];
-  acquire(&disk.vdisk_lock);
+  // submit on this cpu's queue; after a migration another one is
+  // used, which is just as good.
+  struct vqueue *vq = &disk.q[cpuid() % disk.nq];
+  acquire(&vq->vdisk_lock);
 
   // From virtio-v1.0
   // 5.2.6.4 Legacy Interface: Framing Requirements
@@ -229,16 +274,16 @@ virtio_disk_rw(struct buf *b, int write)
   // allocate the three descriptors.
   int idx[3];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(alloc3_desc(vq, idx) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    sleep(&vq->free[0], &vq->vdisk_lock);
   }
 
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+  struct virtio_blk_req *buf0 = &vq->ops[idx[0]];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
@@ -247,65 +292,107 @@ virtio_disk_rw(struct buf *b, int write)
   buf0->reserved = 0;
   buf0->sector = sector;
 
-  disk.desc[idx[0]].addr = V2P(buf0);
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  vq->desc[idx[0]].addr = V2P(buf0);
+  vq->desc[idx[0]].len = sizeof(struct virtio_blk_req);
+  vq->desc[idx[0]].flags = VRING_DESC_F_NEXT;
+  vq->desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = V2P(b->data);
-  disk.desc[idx[1]].len = BSIZE;
+  vq->desc[idx[1]].addr = V2P(b->data);
+  vq->desc[idx[1]].len = BSIZE;
   if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    vq->desc[idx[1]].flags = 0; // device reads b->data
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    vq->desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+  vq->desc[idx[1]].flags |= VRING_DESC_F_NEXT;
+  vq->desc[idx[1]].next = idx[2];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = V2P(&disk.info[idx[0]].status);
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  vq->info[idx[0]].status = 0xff; // device writes 0 on success
+  vq->desc[idx[2]].addr = V2P(&vq->info[idx[0]].status);
+  vq->desc[idx[2]].len = 1;
+  vq->desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
+  vq->desc[idx[2]].next = 0;
 
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
-  disk.info[idx[0]].b = b;
+  vq->info[idx[0]].b = b;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
-  // printf("## <VM>: disk.avail->ring[]=%d\n",
-  //        disk.avail->ring[disk.avail->idx % NUM]);
+  vq->avail->ring[vq->avail->idx % NUM] = idx[0];
+  // printf("## <VM>: vq->avail->ring[]=%d\n",
+  //        vq->avail->ring[vq->avail->idx % NUM]);
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  uint16 old = vq->avail->idx;
+  vq->avail->idx += 1; // not % NUM ...
 
   __sync_synchronize();
 
   /*
   for(int i = 0; i < 0x1000; i++)
-    printf("%x ", disk.pages[i]);
+    printf("%x ", ((char *)&vq->rings)[i]);
     */
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number    virt queue num: 0
+  // a device still working through the ring will see the entry anyway.
+  int notify;
+  if(disk.event_idx)
+    notify = vring_need_event(vq->used->avail_event, vq->avail->idx, old);
+  else
+    notify = !(vq->used->flags & VRING_USED_F_NO_NOTIFY);
+  if(notify)
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = vq->index; // value is queue number
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    sleep(b, &vq->vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  vq->info[idx[0]].b = 0;
+  free_chain(vq, idx[0]);
+
+  release(&vq->vdisk_lock);
+}
+
+// complete what the device finished on one queue.
+static void
+vqueue_intr(struct vqueue *vq)
+{
+  acquire(&vq->vdisk_lock);
+
+  // the device increments vq->used->idx when it
+  // adds an entry to the used ring.
+
+  while(1){
+    while(vq->used_idx != vq->used->idx){
+      __sync_synchronize();
+      int id = vq->used->ring[vq->used_idx % NUM].id;
+
+      if(vq->info[id].status != 0)
+        panic("virtio_disk_intr status");
+
+      struct buf *b = vq->info[id].b;
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
 
-  release(&disk.vdisk_lock);
+      vq->used_idx += 1;
+    }
+    if(!disk.event_idx)
+      break;
+    // interrupt on the next completion only, then look again: one may
+    // have landed before the device saw the new used_event.
+    vq->avail->used_event = vq->used_idx;
+    __sync_synchronize();
+    if(vq->used_idx == vq->used->idx)
+      break;
+  }
+
+  release(&vq->vdisk_lock);
 }
 
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
-
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
@@ -316,22 +403,7 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
-  }
-
-  release(&disk.vdisk_lock);
+  // all queues share the one interrupt line.
+  for(int q = 0; q < disk.nq; q++)
+    vqueue_intr(&disk.q[q]);
 }
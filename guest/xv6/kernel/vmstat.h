@@ -0,0 +1,28 @@
+// Exit statistics of the hypervisor, read with the vendor specific
+// hypervisor service call VMSTAT_HVC_FID (see hyper include/exit_stat.h).
+
+#define VMSTAT_HVC_FID      0xc6000001
+
+#define VMSTAT_HIST_BUCKETS 16
+
+// record kinds
+#define VMSTAT_INFO   0   // id: system counter frequency
+#define VMSTAT_CLASS  1   // id: exit class (fast-wfx, ..., see user/vmstat.c)
+#define VMSTAT_EC     2   // id: ESR_EL2.EC
+#define VMSTAT_IRQ    3   // id: 0
+#define VMSTAT_MMIO   4   // id: IPA base of the device
+#define VMSTAT_PSCI   5   // id: PSCI function id
+#define VMSTAT_HALT   6   // id: halt poll-ok, poll-fail, block
+#define VMSTAT_VGIC   7   // id: 0 LR overflow (ticks = queue depth), 1 LR refill
+
+// latencies are in system counter ticks, hist[n] counts [2^n, 2^(n+1)) ticks
+struct vmstat_rec {
+  uint kind;
+  uint vcpu;
+  uint64 id;
+  uint64 count;
+  uint64 ticks;
+  uint64 min;
+  uint64 max;
+  uint64 hist[VMSTAT_HIST_BUCKETS];
+};
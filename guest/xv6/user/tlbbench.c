@@ -0,0 +1,52 @@
+// TLB-heavy benchmark: touch one word per page over a large heap in a
+// scattered order, so that nearly every access needs a new TLB entry.
+// Compare the run time with the hypervisor's stage2 mapping guest RAM
+// by 4KB pages vs. 2MB blocks.
+//
+// usage: tlbbench [mbytes [rounds]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define PGSIZE 4096
+#define STRIDE 97     // pages, prime so the walk visits every page
+
+int
+main(int argc, char *argv[])
+{
+  int mb = 16, rounds = 64;
+  int npages, i, r, pg, t0, t1;
+  uint64 sum = 0;
+  char *buf;
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+
+  npages = mb * 1024 * 1024 / PGSIZE;
+  buf = sbrk(npages * PGSIZE);
+  if(buf == (char*)-1){
+    fprintf(2, "tlbbench: sbrk %d MB failed\n", mb);
+    exit(1);
+  }
+
+  // fault everything in first, only steady state TLB misses are measured
+  for(i = 0; i < npages; i++)
+    buf[i * PGSIZE] = i;
+
+  t0 = uptime();
+  pg = 0;
+  for(r = 0; r < rounds; r++){
+    for(i = 0; i < npages; i++){
+      sum += *(volatile char*)&buf[pg * PGSIZE];
+      pg = (pg + STRIDE) % npages;
+    }
+  }
+  t1 = uptime();
+
+  printf("tlbbench: %d MB, %d rounds, %d page touches, %d ticks (sum %d)\n",
+         mb, rounds, npages * rounds, t1 - t0, (int)sum);
+  exit(0);
+}
@@ -0,0 +1,118 @@
+// Print the hypervisor's per-vCPU exit statistics.
+//
+// usage: vmstat [-h] [cpu]
+//   -h  also print the log2 latency histograms
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/vmstat.h"
+#include "user/user.h"
+
+#define MAXREC 128
+
+static char *class_name[] = {
+  "fast-wfx", "fast-hvc", "fast-mmio", "wfx", "hvc", "mmio", "other",
+};
+
+static char *halt_name[] = {
+  "poll-ok", "poll-fail", "block",
+};
+
+static struct vmstat_rec recs[MAXREC];
+static uint64 freq_mhz;
+
+static uint64
+ns(uint64 ticks)
+{
+  return freq_mhz ? ticks * 1000 / freq_mhz : ticks;
+}
+
+static void
+printrec(struct vmstat_rec *r, int hist)
+{
+  int i;
+
+  switch(r->kind){
+  case VMSTAT_CLASS:
+    printf("  class %s", r->id < sizeof(class_name)/sizeof(class_name[0]) ? class_name[r->id] : "?");
+    break;
+  case VMSTAT_EC:
+    printf("  ec 0x%x", (int)r->id);
+    break;
+  case VMSTAT_IRQ:
+    printf("  irq");
+    break;
+  case VMSTAT_MMIO:
+    printf("  mmio %p", r->id);
+    break;
+  case VMSTAT_PSCI:
+    printf("  psci 0x%x", (int)r->id);
+    break;
+  case VMSTAT_HALT:
+    printf("  halt %s", r->id < sizeof(halt_name)/sizeof(halt_name[0]) ? halt_name[r->id] : "?");
+    break;
+  case VMSTAT_VGIC:
+    if(r->id == 0){
+      // a queue depth, not a latency
+      printf("  vgic lr-overflow: %l queued, avg depth %l, max depth %l\n",
+             r->count, r->ticks / r->count, r->max);
+      return;
+    }
+    printf("  vgic lr-refill");
+    break;
+  default:
+    return;
+  }
+  printf(": %l exits, avg %l ns, min %l ns, max %l ns\n",
+         r->count, ns(r->ticks / r->count), ns(r->min), ns(r->max));
+
+  if(!hist)
+    return;
+  for(i = 0; i < VMSTAT_HIST_BUCKETS; i++)
+    if(r->hist[i])
+      printf("      %l-%l ns: %l\n", ns(1UL << i), ns(1UL << (i + 1)), r->hist[i]);
+}
+
+static int
+dumpcpu(int cpu, int hist)
+{
+  int i, n;
+
+  n = vmstat(cpu, recs, MAXREC);
+  if(n <= 0)
+    return -1;
+
+  if(recs[0].kind == VMSTAT_INFO)
+    freq_mhz = recs[0].id / 1000000;
+  printf("vcpu %d:\n", cpu);
+  for(i = 1; i < n; i++)
+    printrec(&recs[i], hist);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, cpu = -1, hist = 0;
+
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-h") == 0)
+      hist = 1;
+    else
+      cpu = atoi(argv[i]);
+  }
+
+  if(cpu >= 0){
+    if(dumpcpu(cpu, hist) < 0){
+      fprintf(2, "vmstat: no statistics for vcpu %d\n", cpu);
+      exit(1);
+    }
+    exit(0);
+  }
+
+  for(cpu = 0; cpu < NCPU; cpu++)
+    if(dumpcpu(cpu, hist) < 0)
+      break;
+  exit(0);
+}
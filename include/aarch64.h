@@ -20,6 +20,7 @@
 
 #define isb()     asm volatile("isb" ::: "memory");
 #define dsb(ty)   asm volatile("dsb " #ty);
+#define wfi()     asm volatile("wfi" ::: "memory")
 
 #define HCR_VM    (1 << 0)
 #define HCR_SWIO  (1 << 1)
@@ -32,6 +33,9 @@
 #define HCR_TGE   (1 << 27)
 #define HCR_RW    (1 << 31)
 
+#define CPTR_EL2_RES1     (0x33ff)    /* bits 13:12, 9:0 */
+#define CPTR_EL2_TFP      (1 << 10)   /* trap FP/SIMD of EL0/EL1 (and EL2) */
+
 #define HPFAR_FIPA_MASK   (0xffffffffff0)
 
 #define SPSR_EL2_MODE_EL1   (0b0100)
@@ -53,6 +57,7 @@
 #define ESR_ISS_MASK        (0x1ffffff << ESR_ISS_OFFSET)
 
 
+#define DA_ISS_ISV_MASK     (1 << 24)
 #define DA_ISS_SAS_MASK     (0x3 << 22)
 #define DA_ISS_SAS_OFFSET   (22)
 #define DA_ISS_SRT_MASK     (0x1f << 16)
@@ -75,6 +80,7 @@
 #define ISS_WnR_WRITE       (0b1)
 
 #define ESR_EC_WFx          (0b000001)  // 0x1
+#define ESR_EC_FPSIMD       (0b000111)  // 0x7
 #define ESR_EC_HVC64        (0b010110)  // 0x16
 #define ESR_EC_SMC64        (0b010111)  // 0x17
 #define ESR_EC_SYSRG        (0b011000)  // 0x18
@@ -84,8 +90,24 @@
 #define ESR_EC_DAEL2        (0b100101)  // 0x25
 #define ESR_EC_SPALG        (0b100110)  // 0x26
 
+#define WFx_ISS_TI_WFE      (1 << 0)    /* ESR_EL2.ISS.TI: 0 - WFI, 1 - WFE */
+
+/* ESR_EL2.ISS of a trapped msr/mrs (EC 0x18) */
+#define SYS_ISS_DIR_READ    (1 << 0)    /* 1 - mrs, 0 - msr */
+#define SYS_ISS_RT_MASK     (0x1f << 5)
+#define SYS_ISS_RT_OFFSET   (5)
+#define SYS_ISS_ENC_MASK    (0x3ffc1e)  /* Op0, Op2, Op1, CRn, CRm */
+#define SYS_ISS_ENC(op0, op1, crn, crm, op2) \
+    (((op0) << 20) | ((op2) << 17) | ((op1) << 14) | ((crn) << 10) | ((crm) << 1))
+
+#define ISR_EL1_I           (1 << 7)    /* a physical IRQ is pending */
+
 #define SCTLR_EL1_M         (0b01)
 
+#define SCTLR_EL2_M         (1 << 0)    /* EL2 stage 1 MMU enable */
+#define SCTLR_EL2_C         (1 << 2)    /* data cache enable */
+#define SCTLR_EL2_I         (1 << 12)   /* instruction cache enable */
+
 // 这种方法应该仅在qemu上有效, 对于板子上的mpidr的值, 可能低4位均为0
 // TODO: 修改cpuid的实现方式
 static inline int cpuid() {
@@ -108,6 +130,36 @@ static inline void tlb_flush() {
     isb();
 }
 
+/*
+ * Stage2 TLB maintenance, inner shareable (broadcast to all cpus).
+ * TLBI IPAS2E1IS/VMALLS12E1IS/VMALLE1IS act on the VMID currently in VTTBR_EL2.
+ */
+
+/* stage2 only entries of one IPA page, must be followed by tlbi_stage1_is() */
+static inline void tlbi_ipa_is(u64 ipa) {
+    asm volatile("tlbi ipas2e1is, %0" :: "r"(ipa >> 12) : "memory");
+}
+
+/* stage1 and combined stage1+2 entries of the current VMID */
+static inline void tlbi_stage1_is() {
+    asm volatile("tlbi vmalle1is" ::: "memory");
+}
+
+/* stage1 and combined entries of the current VMID, this pcpu only */
+static inline void tlbi_stage1_local() {
+    asm volatile("tlbi vmalle1" ::: "memory");
+}
+
+/* all entries of the current VMID */
+static inline void tlbi_vmid_is() {
+    asm volatile("tlbi vmalls12e1is" ::: "memory");
+}
+
+/* all EL1&0 entries of every VMID */
+static inline void tlbi_all_vmid_is() {
+    asm volatile("tlbi alle1is" ::: "memory");
+}
+
 static inline u64 vm_va_to_ipa(u64 va, bool is_el0) {
     u64 par;
     if (is_el0) {
@@ -0,0 +1,21 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "types.h"
+
+/*
+ * Boot time micro benchmarks, only built into the boot flow when the
+ * hypervisor is compiled with BENCH_MODE=1 (./build.sh bench).
+ *
+ * Every case returns the total system counter ticks spent on @iters
+ * iterations, bench_run_all() prints the per-iteration cost in ns.
+ */
+struct bench_case {
+    const char  *name;
+    u64         iters;
+    u64         (*fn)(u64 iters);
+};
+
+void bench_run_all(const char *stage);
+
+#endif
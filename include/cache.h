@@ -0,0 +1,17 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "types.h"
+
+/* data cache maintenance by VA (VA == PA in EL2's identity mapping) */
+void dcache_clean_range(u64 va, u64 size);          /* dc cvac:  clean to PoC */
+void dcache_inval_range(u64 va, u64 size);          /* dc ivac:  invalidate to PoC */
+void dcache_flush_range(u64 va, u64 size);          /* dc civac: clean and invalidate to PoC */
+
+/* data cache maintenance by set/way, only safe before caches are enabled */
+void dcache_inval_all(void);
+void dcache_inval_local(void);
+
+void icache_inval_all(void);
+
+#endif
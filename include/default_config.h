@@ -6,9 +6,13 @@
 #define VCPU_MAX        4
 #define NCPU            4
 #define VM_MAX          2
+#define VCPU_POOL_MAX   (VM_MAX * VCPU_MAX)    /* vcpus of all VMs */
 
 #define PCPU_NUM_MAX     32
 
+/* pcpu running the device backends, see iothread.h. -1: in the vcpu's own trap */
+#define IO_PCPU         (PCPU_NUM - 1)
+
 #ifndef PAGE_SIZE
 #define PAGE_SIZE       4096
 #endif
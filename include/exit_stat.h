@@ -0,0 +1,99 @@
+#ifndef EXIT_STAT_H
+#define EXIT_STAT_H
+
+#include "types.h"
+#include "smcc.h"
+
+struct vcpu;
+
+/* exit classes, FAST_* are handled by the fast exit path (see vector.S) */
+enum exit_class {
+    EXIT_FAST_WFX = 0,
+    EXIT_FAST_HVC,
+    EXIT_FAST_MMIO,
+    EXIT_WFX,
+    EXIT_HVC,
+    EXIT_MMIO,
+    EXIT_OTHER,
+    EXIT_CLASS_MAX,
+};
+
+/* log2 buckets of system counter ticks: bucket n counts exits of [2^n, 2^(n+1)) ticks */
+#define EXIT_HIST_BUCKETS   16
+
+#define EXIT_STAT_EC_MAX    64      /* ESR_ELx.EC is 6 bits */
+#define EXIT_STAT_MMIO_MAX  16      /* == MMIO_REGION_MAX */
+#define EXIT_STAT_PSCI_MAX  32      /* PSCI function number, fid & 0x1f */
+
+/* how a trapped WFI ended, see vcpu_halt() and halt_end() in sched.c */
+enum halt_stat {
+    HALT_POLL_OK = 0,   /* a vIRQ showed up while polling; ticks spent polling */
+    HALT_POLL_FAIL,     /* polling window expired; ticks spent polling */
+    HALT_BLOCK,         /* pcpu idled in wfi; ticks spent blocked */
+    HALT_STAT_MAX,
+};
+
+/* LR overflow of the vgic, see vgic_pendq_push() */
+enum vgic_stat {
+    VGIC_PENDQ_DEPTH = 0,   /* a vIRQ was queued; "ticks" is the queue depth then */
+    VGIC_PENDQ_REFILL,      /* a queued vIRQ got an LR; ticks spent in the queue */
+    VGIC_STAT_MAX,
+};
+
+/* latency of one kind of exit, in system counter ticks */
+struct exit_stat {
+    u64 count;
+    u64 ticks;
+    u64 min;
+    u64 max;
+    u64 hist[EXIT_HIST_BUCKETS];
+};
+
+/*
+ * Per vcpu exit statistics. Only the vcpu itself updates them, on its own
+ * pcpu, so no locking; readers (the vmstat hypercall) may see a torn record.
+ */
+struct vcpu_stats {
+    struct exit_stat cls[EXIT_CLASS_MAX];
+    struct exit_stat ec[EXIT_STAT_EC_MAX];
+    struct exit_stat irq;
+    struct exit_stat mmio[EXIT_STAT_MMIO_MAX];     /* indexed like vm->mmio->regions */
+    struct exit_stat psci[EXIT_STAT_PSCI_MAX];
+    struct exit_stat halt[HALT_STAT_MAX];
+    struct exit_stat vgic[VGIC_STAT_MAX];
+    u64 vgic_pendq_drop;    /* vIRQs lost because the queue was full */
+};
+
+/*
+ * Vendor specific hypervisor service call to read the statistics:
+ *   x0 = VMSTAT_HVC_FID, x1 = vcpu id, x2 = IPA of the buffer,
+ *   x3 = buffer size in bytes, x4 = index of the first record
+ * returns x0 = number of struct vmstat_rec written (< 0 on error).
+ * Record 0 is VMSTAT_INFO with the counter frequency in @id, the others
+ * are the non-empty exit_stat entries of the vcpu.
+ */
+#define VMSTAT_HVC_FID      (SMCC64_FID_VND_HYP_SRVC | 0x1)
+
+enum vmstat_kind {
+    VMSTAT_INFO = 0,    /* id: system counter frequency */
+    VMSTAT_CLASS,       /* id: enum exit_class */
+    VMSTAT_EC,          /* id: ESR_EL2.EC */
+    VMSTAT_IRQ,         /* id: 0 */
+    VMSTAT_MMIO,        /* id: IPA base of the device */
+    VMSTAT_PSCI,        /* id: PSCI function id */
+    VMSTAT_HALT,        /* id: enum halt_stat */
+    VMSTAT_VGIC,        /* id: enum vgic_stat */
+};
+
+struct vmstat_rec {
+    u32 kind;
+    u32 vcpu;
+    u64 id;
+    struct exit_stat stat;
+};
+
+void exit_stat_add(struct exit_stat *s, u64 ticks);
+void exit_stat_dump(struct vcpu *vcpu);
+long exit_stat_hvc(struct vcpu *vcpu, u64 vcpuid, u64 ipa, u64 size, u64 first);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "memmap.h"
+#include "aarch64.h"
 
 #define GIC_NSGI     16
 #define GIC_SGI_MAX  15
@@ -16,8 +17,13 @@
 #define is_sgi_ppi(intid) (is_sgi(intid) || is_ppi(intid))
 #define is_spi(intid)     (32 <= (intid))
 
+#define ich_ap0r0_el2 arm_sysreg(4, c12, c8, 0)
+#define ich_ap1r0_el2 arm_sysreg(4, c12, c9, 0)
 #define ich_hcr_el2   arm_sysreg(4, c12, c11, 0)
 #define ich_vtr_el2   arm_sysreg(4, c12, c11, 1)
+#define ich_misr_el2  arm_sysreg(4, c12, c11, 2)
+#define ich_eisr_el2  arm_sysreg(4, c12, c11, 3)
+#define ich_elrsr_el2 arm_sysreg(4, c12, c11, 5)
 #define ich_vmcr_el2  arm_sysreg(4, c12, c11, 7)
 #define ich_lr0_el2   arm_sysreg(4, c12, c12, 0)
 #define ich_lr1_el2   arm_sysreg(4, c12, c12, 1)
@@ -52,16 +58,35 @@
 #define ICC_CTLR_EOImode(m) ((m) << 1)
 
 #define ICC_SGI1R_TargetList(v)   ((v) & 0xffff)
+#define ICC_SGI1R_AFF1(v)         (((v)>>16) & 0xff)
 #define ICC_SGI1R_INTID(v)        (((v)>>24) & 0xf)
+#define ICC_SGI1R_AFF2(v)         (((v)>>32) & 0xff)
 #define ICC_SGI1R_IRM(v)          (((v)>>40) & 0x1)
+#define ICC_SGI1R_RS(v)           (((v)>>44) & 0xf)
+#define ICC_SGI1R_AFF3(v)         (((v)>>48) & 0xff)
 
-#define ICH_HCR_EN  (1<<0)
+/* ESR_EL2.ISS encoding of an EL1 access to ICC_SGI1R_EL1, trapped with HCR_EL2.IMO */
+#define ICC_SGI1R_ISS             SYS_ISS_ENC(3, 0, 12, 11, 5)
+
+#define ICH_HCR_EN    (1<<0)
+#define ICH_HCR_UIE   (1<<1)    /* maintenance irq when at most one LR is valid */
+#define ICH_HCR_NPIE  (1<<3)    /* maintenance irq when no LR is pending */
+
+#define ICH_MISR_EOI  (1<<0)    /* an LR with ICH_LR_EOI was deactivated, see ICH_EISR_EL2 */
+#define ICH_MISR_U    (1<<1)    /* underflow, UIE */
+#define ICH_MISR_NP   (1<<3)    /* no pending, NPIE */
+
+/* maintenance interrupt of the virtual cpu interface (QEMU virt) */
+#define GIC_MAINT_IRQ 25
 
 #define ICH_VMCR_VENG0  (1<<0)
 #define ICH_VMCR_VENG1  (1<<1)
 
 #define ICH_LR_VINTID(n)   ((n) & 0xffffffffL)
 #define ICH_LR_PINTID(n)   (((n) & 0x1fffL) << 32)
+#define ICH_LR_EOI         (1L << 41)   /* maintenance irq on deactivation, HW=0 only */
+#define ICH_LR_PRIORITY(n) (((n) & 0xffL) << 48)
+#define ICH_LR_PRIO(lr)    (((lr) >> 48) & 0xff)
 #define ICH_LR_GROUP(n)    (((n) & 0x1L) << 60)
 #define ICH_LR_HW          (1L << 61)
 #define ICH_LR_STATE(n)    (((n) & 0x3L) << 62)
@@ -215,6 +240,9 @@ static inline void gicr_w64(int cpuid, u32 offset, u32 val) {
 struct gic_state {
     u64 lr[16];
     u64 vmcr_el2;   /* Interrupt Controller Virtual Machine Control Register */
+    /* active priorities of the vcpu, only AP<n>R0 exist with <= 5 bits of virtual priority */
+    u64 ap0r0_el2;
+    u64 ap1r0_el2;
     u32 sre_el1;    /* enable access to GICC system register, which is configured by VM */
 };
 
@@ -236,6 +264,8 @@ void gic_set_target_by_affinity(u32 irq, u8 aff);
 void gic_set_target_by_pe_field(u32 irq, u8 target);
 
 bool gic_has_pending_lr(void);
+u32 gic_lr_mask(void);
+u32 gic_read_elrsr(void);
 u64 gic_read_lr(int n);
 void gic_write_lr(int n, u64 val);
 u64 gic_make_lr(u32 pirq, u32 virq, int group);
@@ -244,8 +274,11 @@ void gic_irq_enable(u32 irq);
 void gic_irq_disable(u32 irq);
 void gic_irq_enable_redist(u32 cpuid, u32 irq);
 
+void gic_save_state(struct gic_state *gic);
 void gic_restore_state(struct gic_state *gic);
 
+void gic_send_sgi(u32 cpu, u32 intid);
+
 void gic_set_pending_irq(u16 irq_id);
 
 #endif
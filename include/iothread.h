@@ -0,0 +1,27 @@
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include "types.h"
+#include "default_config.h"
+
+/*
+ * Device backend work deferred out of the trap that asked for it. Posting
+ * kicks the work's pcpu with IO_WORK_SGI; that pcpu runs the work from its
+ * irq path, preempting its vcpu for a moment or out of its idle loop, with
+ * no lock held. The posting vcpu goes back to the guest at once.
+ */
+#define IO_WORK_SGI     1
+
+struct io_work {
+    void            (*fn)(void *arg);
+    void            *arg;
+    int             pcpu;       /* runs there, < 0: right in io_work_post() */
+    int             queued;     /* on the list, a second post is a no-op */
+    struct io_work  *next;
+};
+
+void io_work_init(struct io_work *work, void (*fn)(void *), void *arg, int pcpu);
+void io_work_post(struct io_work *work);
+void io_work_run(void);
+
+#endif
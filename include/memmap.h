@@ -2,6 +2,7 @@
 #define HYPER_POC_MEMMAP_H
 
 #define UARTBASE        0x09000000
+#define UART_IRQ        33
 #define RTCBASE         0x09010000
 #define GPIOBASE        0x09030000
 #define GICDBASE        0x08000000
@@ -12,6 +13,9 @@
 
 #define VIRTIO0         0x0a000000
 #define VIRTIO0_SIZE    0x10000
+/* virtio-mmio slots of QEMU virt from VIRTIO0 on, slot n raises SPI 16 + n */
+#define VIRTIO_MMIO_SLOTS   32
+#define VIRTIO_MMIO_STRIDE  0x200
 
 #define PCIE_MMIO_BASE       0x10000000
 #define PCIE_HIGH_MMIO_BASE  0x8000000000ULL
@@ -18,20 +18,70 @@ struct mmio_access {
     u64                         pc;         /* PC where VM triggers data abort */
     enum syndrome_access_size   iss_sas;    /* size of the access attempted by the faulting operation */
     u32                         iss_wnr;    /* memory access's direction(write/read) which caused data abort */
+    void                        *ctx;       /* opaque context of the region, see mmio_reg_handler() */
 };
+
+typedef int (*mmio_read_t)(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio);
+typedef int (*mmio_write_t)(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio);
+
+/*
+ * Per register sub-handler of a MMIO region, covering register offsets
+ * [offset, offset+size). Hot registers get their own handler so they skip
+ * the region handler's big switch. A NULL read/write falls back to the
+ * region handler. The handler is still passed the offset within the region.
+ */
+struct mmio_reg {
+    u64           offset;
+    u64           size;
+    mmio_read_t   read;
+    mmio_write_t  write;
+    int           flags;
+};
+
+/*
+ * The handler may run on the fast exit path (see lower_el_sync_fast()):
+ * vcpu->reg is NOT saved there, the handler may only use @offset/@val and
+ * the VM's own state, and must not block or switch vcpus.
+ */
+#define MMIO_REG_FAST   (1 << 0)
   
 struct mmio_info {
-    struct mmio_info *next;
     u64 ipa_base;
     u64 size;
-    int (*read)(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio);
-    int (*write)(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio);
+    mmio_read_t read;
+    mmio_write_t write;
+    void *ctx;      /* passed to the handlers in mmio_access->ctx */
+
+    /* sorted by offset; with @reg_stride != 0 the region is an array of
+     * identical frames (e.g. GICR) and regs are matched on offset % reg_stride */
+    const struct mmio_reg *regs;
+    int nregs;
+    u64 reg_stride;
+};
+
+#define MMIO_REGION_MAX  16
+
+/*
+ * Per VM MMIO dispatch table, sorted by ipa_base and searched by binary
+ * search. Regions are only registered while the VM is being created, the
+ * table is sealed before any vcpu runs and is read without locking.
+ */
+struct mmio_table {
+    struct mmio_info  regions[MMIO_REGION_MAX];
+    int               nregions;
+    int               sealed;
+    int               used;
 };
 
 int mmio_emulate(struct vcpu *vcpu, int reg_idx, struct mmio_access *mmio_access);
+int mmio_emulate_fast(struct vcpu *vcpu, u64 *val, struct mmio_access *mmio_access);
+
+int mmio_reg_handler(struct vm *vm, u64 ipa, u64 size, mmio_read_t read, mmio_write_t write,
+                     void *ctx);
+
+int mmio_reg_subhandlers(struct vm *vm, u64 ipa, const struct mmio_reg *regs, int nregs,
+                         u64 reg_stride);
 
-int mmio_reg_handler(struct vm *vm, u64 ipa, u64 size,
-                       int (*read)(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio),
-                       int (*write)(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio));
+void mmio_seal(struct vm *vm);
 
-#endif
\ No newline at end of file
+#endif
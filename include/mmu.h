@@ -20,14 +20,24 @@
 #define TCR_TBI0(n)   (((n) & 0x1) << 37)
 #define TCR_TBI1(n)   (((n) & 0x1) << 38)
 
+/* TCR_EL2 (non-VHE) differs from TCR_EL1: single TTBR, PS at [18:16] */
+#define TCR_EL2_PS(n)   (((n) & 0x7) << 16)
+#define TCR_EL2_RES1    ((1UL << 31) | (1UL << 23))
+
 #define VTCR_T0SZ(n)  ((n) & 0x3f)
 #define VTCR_SL0(n)   (((n) & 0x3) << 6)
+#define VTCR_IRGN0(n) (((n) & 0x3) << 8)
+#define VTCR_ORGN0(n) (((n) & 0x3) << 10)
 #define VTCR_SH0(n)   (((n) & 0x3) << 12)
 #define VTCR_TG0(n)   (((n) & 0x3) << 14)
 #define VTCR_PS(n)    (((n) & 0x7) << 16)
 #define VTCR_NSW      (1 << 29)
 #define VTCR_NSA      (1 << 30)
 
+/* VTCR_EL2.VS is left 0: 8bit VMID, supported by every implementation */
+#define VMID_BITS       8
+#define VTTBR_VMID(vmid)    (((u64)(vmid) & ((1UL << VMID_BITS) - 1)) << 48)
+
 /*  48bit Virtual Address
  *
  *     48    39 38    30 29    21 20    12 11       0
@@ -40,6 +50,8 @@
 #define OFFSET(va)  ((va) & 0xfff)
 
 #define PTE_PA(pte) ((u64)(pte) & 0xfffffffff000)
+/* lower attributes [11:2] and upper attributes [63:52] of a block/page descriptor */
+#define PTE_ATTR_MASK   (0xfff0000000000ffcUL)
 
 /* lower attribute */
 #define PTE_VALID 1   /* level 0,1,2 descriptor */
@@ -47,6 +59,7 @@
 #define PTE_V 3       /* level 3 descriptor */
 #define PTE_INDX(idx) (((idx) & 7) << 2)
 #define PTE_NORMAL  PTE_INDX(AI_NORMAL_NC_IDX)
+#define PTE_NORMAL_WB PTE_INDX(AI_NORMAL_WB_IDX)
 #define PTE_DEVICE  PTE_INDX(AI_DEVICE_nGnRnE_IDX)
 #define PTE_NS  (1 << 5)
 #define PTE_AP(ap)  (((ap) & 3) << 6)
@@ -54,10 +67,12 @@
 #define PTE_RO  PTE_AP(2)
 #define PTE_URO PTE_AP(3)
 #define PTE_SH(sh)  (((sh) & 3) << 8)
+#define PTE_ISH PTE_SH(3)
 #define PTE_AF  (1 << 10)
 /* upper attribute */
 #define PTE_PXN (1UL << 53)
 #define PTE_UXN (1UL << 54)
+#define PTE_XN  PTE_UXN     /* EL2 translation regime has only one XN bit */
 
 /* stage 2 attribute */
 #define S2PTE_AF  (1 << 10)
@@ -65,29 +80,60 @@
 #define S2PTE_RO  S2PTE_S2AP(1)
 #define S2PTE_WO  S2PTE_S2AP(2)
 #define S2PTE_RW  S2PTE_S2AP(3)
-#define S2PTE_ATTR(attr)  (((attr) & 7) << 2)
-#define S2PTE_NORMAL  S2PTE_ATTR(AI_NORMAL_NC_IDX)
-#define S2PTE_DEVICE  S2PTE_ATTR(AI_DEVICE_nGnRnE_IDX)
+#define S2PTE_SH(sh)  (((sh) & 3) << 8)
+#define S2PTE_ISH S2PTE_SH(3)
+/* stage2 MemAttr[3:0] is encoded in the descriptor itself, MAIR is not used */
+#define S2PTE_MEMATTR(attr)  (((attr) & 0xf) << 2)
+#define S2PTE_NORMAL    (S2PTE_MEMATTR(S2_MEMATTR_NORMAL_WB) | S2PTE_ISH)
+#define S2PTE_UNCACHED  S2PTE_MEMATTR(S2_MEMATTR_NORMAL_NC)
+#define S2PTE_DEVICE    S2PTE_MEMATTR(S2_MEMATTR_DEVICE_nGnRE)
 
 #define PAGE_SIZE  4096    /* 4KB */
 
 #define PAGEROUNDUP(p)  ((p + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
 
+#define BLOCK_SIZE_L1   (1UL << 30)     /* 1GB */
+#define BLOCK_SIZE_L2   (1UL << 21)     /* 2MB */
+
+/* stage2 MemAttr */
+#define S2_MEMATTR_DEVICE_nGnRnE  0x0   /* 0b0000 */
+#define S2_MEMATTR_DEVICE_nGnRE   0x1   /* 0b0001 */
+#define S2_MEMATTR_NORMAL_NC      0x5   /* 0b0101: Outer Non-cacheable, Inner Non-cacheable */
+#define S2_MEMATTR_NORMAL_WB      0xf   /* 0b1111: Outer Write-Back, Inner Write-Back */
+
 /* attr index */
 #define AI_DEVICE_nGnRnE_IDX  0x0
 #define AI_NORMAL_NC_IDX      0x1
-
+#define AI_NORMAL_WB_IDX      0x2
+#define AI_DEVICE_nGnRE_IDX   0x3
 
 /* attr */
 #define AI_DEVICE_nGnRnE  0x0   /* 0b00000000: Device-nGnRnE memory */
 #define AI_NORMAL_NC      0x44  /* 0b01000100: Normal memory, Outer Non-cacheable, Inner Non-cacheable */
+#define AI_NORMAL_WB      0xff  /* 0b11111111: Normal memory, Outer/Inner Write-Back Read/Write-Allocate */
+#define AI_DEVICE_nGnRE   0x04  /* 0b00000100: Device-nGnRE memory */
+
+/* translation table build statistics, see pagemap() */
+struct pagemap_stat {
+    u64 walks;          /* table walks */
+    u64 tables;         /* table pages allocated */
+    u64 pages;          /* level 3 page descriptors */
+    u64 blocks[3];      /* blocks[1]: 1GB, blocks[2]: 2MB block descriptors */
+    u64 splits;         /* blocks split into a next level table */
+};
+
+extern struct pagemap_stat g_pagemap_stat;
 
 u64 *pagewalk(u64 *pgt, u64 va, int need_alloc);
 void pagemap(u64 *pgt, u64 va, u64 pa, u64 size, u64 attr);
 void pageunmap(u64 *pgt, u64 va, u64 size);
+void s2_tlb_flush_range(u64 ipa, u64 size);
 
 u64 ipa2pa(u64 *pgt, u64 ipa);
 
 void stage2_mmu_init(void);
 
+void el2_mmu_init(void);
+void el2_mmu_enable(void);
+
 #endif
\ No newline at end of file
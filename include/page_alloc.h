@@ -30,6 +30,14 @@ int page_allocator_init(unsigned long *bitmap_buf, unsigned long total_pages,
 
 unsigned long alloc_pages(unsigned long nr_pages);
 
+/**
+ * alloc_pages_aligned - 分配 @nr_pages 个连续页, 起始物理地址按 @align 个页对齐
+ * (例如 guest RAM 按 2MB 对齐分配, 以便 stage2 使用 block 映射)
+ *
+ * 返回：起始物理地址，失败返回 -1ULL
+ */
+unsigned long alloc_pages_aligned(unsigned long nr_pages, unsigned long align);
+
 int free_pages(unsigned long phyaddr, unsigned long nr_pages);
 
 unsigned long alloc_page(void);
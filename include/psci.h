@@ -54,7 +54,9 @@
 #define is_psci_fid(_fid)              (is_smc_stdsrvc_fid(_fid) && (((_fid) & PSCI_FID_MASK) == PSCI_FID_VALUE))
 
 long psci_handler(struct vcpu *vcpu, u32 smc_fid, u64 x1, u64 x2, u64 x3);
+long int psci_features_handler(u32 smc_fid);
 
 u64 psci_call(u32 func, u64 cpuid, u64 entry, u64 ctxid);
+u64 psci_pcpu_on(u64 pcpu);
 
 #endif
\ No newline at end of file
@@ -6,8 +6,16 @@
 #define FSIMG_SIZE  1000
 #define BLOCK_SIZE  1024
 
+/* a disk in hypervisor memory, the backing store of one virtio-blk device */
+struct ramdisk {
+    u64 base;
+    u64 size;       /* bytes */
+};
+
 void ramdisk_init(void);
+int ramdisk_create(struct ramdisk *rd);
 
 int ramdisk_rw(u64 blk_num, u64 bufaddr, u16 is_write);
+int ramdisk_access(struct ramdisk *rd, u64 offset, u64 buf_addr, u64 len, u16 is_write);
 
-#endif
\ No newline at end of file
+#endif
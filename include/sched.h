@@ -0,0 +1,30 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "types.h"
+#include "timer.h"
+
+struct vcpu;
+
+/*
+ * Each pcpu has a run queue of the vcpus placed on it. The runnable vcpu with
+ * the lowest weighted run time (vruntime) runs, for at most SCHED_SLICE_NS
+ * while others are waiting. Time slices are cut by the EL2 physical timer,
+ * a pcpu with a single runnable vcpu runs it without any tick.
+ */
+#define SCHED_SLICE_NS          (4 * NS_PER_MS)
+#define SCHED_WEIGHT_DEFAULT    256
+
+/* SGI the pcpus kick each other with when a remote run queue changes */
+#define SCHED_IPI_SGI           0
+
+void sched_init(void);
+void sched_vcpu_attach(struct vcpu *vcpu, u64 affinity, u32 weight);
+void sched_wakeup(struct vcpu *vcpu);
+void sched_ipi(void);
+void sched_check(void);
+void sched_start(void);
+
+void vcpu_halt(struct vcpu *vcpu);
+
+#endif
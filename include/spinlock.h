@@ -45,6 +45,13 @@ static inline void spin_lock(spinlock_t* lock)
         : "memory");
 }
 
+/* held or waited for, only a hint: it may change right after */
+static inline bool spin_is_locked(spinlock_t* lock)
+{
+    return __atomic_load_n(&lock->ticket, __ATOMIC_RELAXED) !=
+           __atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
+
 static inline void spin_unlock(spinlock_t* lock)
 {
     u32 temp;
@@ -2,20 +2,99 @@
 #define TIMER_H
 
 #include "types.h"
+#include "aarch64.h"
+#include "sysreg.h"
 
 #define CNTFRQ_MASK         (0xFFFFFFFFUL)
 
+#define CNTV_CTL_ENABLE   (1<<0)
+#define CNTV_CTL_IMASK    (1<<1)
+#define CNTV_CTL_ISTATUS  (1<<2)
+
+/* EL2 physical timer (CNTHP_*), owned by the hypervisor, drives the scheduler */
+#define HYP_TIMER_IRQ       26
+#define VIRTUAL_TIMER_IRQ   27
+#define PHYSICAL_TIMER_IRQ  30
+
 #define NS_PER_SECOND		(1000000000U)
 #define NS_PER_MS			(1000000UL)
 #define NS_PER_US			(1000U)
 
+typedef void (*timer_fn_t)(void *arg);
+
+/*
+ * One-shot deadline of the hypervisor. Pending timers sit in a min-heap of
+ * the pcpu that armed them, HYP_TIMER_IRQ is programmed for the earliest one
+ * only: no periodic tick. The callback runs on that pcpu from the irq path,
+ * with no lock held.
+ */
+struct timer {
+    u64         expires;    /* syscount */
+    timer_fn_t  fn;
+    void        *arg;
+    int         cpu;        /* pcpu whose heap holds it */
+    int         idx;        /* slot in that heap, -1 when not pending */
+    int         used;       /* slot of the timer_add() pool */
+};
+
+#define TIMER_HEAP_MAX      64  /* pending timers per pcpu */
+#define TIMER_POOL_MAX      16  /* timer_add() ones per pcpu */
+
 void freq_init(void);
-void setup_timer(void);
-void reload_timer(void);
-void enable_timer(void);
-void disable_timer();
 
-u64 nstime_to_count(u64 nstime);
-u64 count_to_time_ns(u64 count);
+void hyp_timer_init(void);
+void timer_interrupt(void);
+
+void timer_setup(struct timer *t, timer_fn_t fn, void *arg);
+void timer_mod(struct timer *t, u64 expires);
+void timer_del(struct timer *t);
+int timer_add(u64 ns, timer_fn_t fn, void *arg);
+
+static inline bool timer_pending(struct timer *t)
+{
+    return __atomic_load_n(&t->idx, __ATOMIC_ACQUIRE) >= 0;
+}
+
+/*
+ * System counter <-> ns conversion, a multiply and a shift with the factors
+ * freq_init() computed: x * mult >> shift. The common time base for the
+ * scheduler, tracing and the exit statistics.
+ */
+struct clocksource {
+    u64 freq;           /* CNTFRQ_EL0 */
+    u32 mult;           /* cycles -> ns */
+    u32 shift;
+    u32 ns_mult;        /* ns -> cycles */
+    u32 ns_shift;
+};
+
+extern struct clocksource g_clocksource;
+
+/* mult < 2^32: one multiply below 2^32, the high half only costs a second one */
+static inline u64 clock_mul_shift(u64 x, u32 mult, u32 shift)
+{
+    u64 v = ((x & 0xffffffffUL) * mult) >> shift;
+
+    if (x >> 32) {
+        v += ((x >> 32) * mult) << (32 - shift);
+    }
+    return v;
+}
+
+static inline u64 count_to_time_ns(u64 count)
+{
+    return clock_mul_shift(count, g_clocksource.mult, g_clocksource.shift);
+}
+
+static inline u64 nstime_to_count(u64 nstime)
+{
+    return clock_mul_shift(nstime, g_clocksource.ns_mult, g_clocksource.ns_shift);
+}
+
+/* @deadline in system counter cycles, no unit conversion on the way */
+static inline bool deadline_reached(u64 deadline)
+{
+    return get_syscount() >= deadline;
+}
 
 #endif
\ No newline at end of file
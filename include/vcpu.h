@@ -5,41 +5,89 @@
 #include "vm.h"
 #include "vgic.h"
 #include "gic.h"
+#include "timer.h"
 #include "aarch64.h"
+#include "exit_stat.h"
+
+struct mmio_info;
+
+/* adaptive halt polling window, see halt_poll_adjust() in sched.c */
+#define WFI_POLL_TIMEOUT_NS         (10000)     /* 0.01 ms, first window after growing from 0 */
+#define WFI_POLL_TIMEOUT_NS_MAX     (500000)    /* 0.5 ms */
 
 enum vcpu_state {
     UNUSED,
     CREATED,
-    READY,
-    RUNNING,
+    READY,      /* runnable, waiting on its pcpu's run queue */
+    RUNNING,    /* loaded on its pcpu */
+    BLOCKED,    /* halted in WFI and switched out, see vcpu_halt() */
 };
 
 struct cpu_features {
     u64 pfr0;
 };
 
+/*
+ * EL1 context of a vcpu, in groups that vcpu_load() compares with what the
+ * pcpu holds: only a group that differs is written back to the hardware.
+ */
+struct el1_ctx {
+    /* EL1_GRP_EXC: changes all the time, differs between any two vcpus */
+    u64 spsr_el1;
+    u64 elr_el1;
+    u64 sp_el0;
+    u64 sp_el1;
+    u64 esr_el1;
+    u64 far_el1;
+    u64 afsr0_el1;
+    u64 afsr1_el1;
+    u64 par_el1;
+    u64 tpidr_el0;
+    u64 tpidrro_el0;
+    u64 tpidr_el1;
+    u64 contextidr_el1;
+    u64 ttbr0_el1;
+
+    /* EL1_GRP_MMU: set up at boot, the same on all vcpus of a VM */
+    u64 ttbr1_el1;
+    u64 tcr_el1;
+    u64 mair_el1;
+    u64 amair_el1;
+    u64 sctlr_el1;
+    u64 vbar_el1;
+    u64 cpacr_el1;
+    u64 csselr_el1;
+    u64 cntkctl_el1;
+
+    /* EL1_GRP_ID: constant, emulated through VMPIDR_EL2/VPIDR_EL2 */
+    u64 mpidr_el1;
+    u64 midr_el1;
+    u64 cntfrq_el0;
+
+    /* virtual timer, always switched: it is stopped while the vcpu is out */
+    u64 cntv_ctl_el0;
+    u64 cntv_cval_el0;
+    u64 cntvoff_el2;    /* vm->cntvoff, the guest can not change it */
+};
+
+/* FP/SIMD registers, switched lazily on the first FP trap, see vcpu_fpsimd_switch() */
+struct fpsimd_state {
+    u64 vregs[64];  /* q0-q31 */
+    u64 fpsr;
+    u64 fpcr;
+} __attribute__((aligned(16)));
+
+void fpsimd_save(struct fpsimd_state *fp);
+void fpsimd_restore(struct fpsimd_state *fp);
+
 struct vcpu {
     struct {
         u64 x[31];
         u64 spsr_el2;
         u64 elr_el2;
     } reg;
-    struct {
-        u64 spsr_el1;
-        u64 elr_el1;
-        u64 mpidr_el1;
-        u64 midr_el1;
-        u64 sp_el0;
-        u64 sp_el1;
-        u64 ttbr0_el1;
-        u64 ttbr1_el1;
-        u64 tcr_el1;
-        u64 vbar_el1;
-        u64 sctlr_el1;
-        u64 cntv_ctl_el0;
-        u64 cntv_tval_el0;
-        u64 cntfrq_el0;
-    } sys;
+    struct el1_ctx sys;
+    struct fpsimd_state fp;
 
     const char *name;
 
@@ -65,6 +113,27 @@ struct vcpu {
     struct vm *vm;
 
     int cpuid;
+
+    /* last MMIO region hit by this vcpu, checked before the VM's table */
+    struct mmio_info *mmio_last;
+    /* region the current exit was dispatched to, NULL if none; see exit_account() */
+    struct mmio_info *mmio_exit;
+
+    /* exit statistics, exit_start is taken on exception entry */
+    u64 exit_start;
+    struct vcpu_stats stats;
+
+    /* current halt polling window in ns, tuned on every blocking WFI */
+    u64 halt_poll_ns;
+    u64 halt_start;     /* syscount when the WFI trapped, 0 when not halted */
+    u64 halt_block;     /* syscount when polling gave up */
+
+    /* scheduling, see sched.c */
+    int pcpu;           /* pcpu whose run queue holds this vcpu */
+    u64 affinity;       /* pcpus this vcpu may be placed on */
+    u32 weight;         /* share of the pcpu, relative to SCHED_WEIGHT_DEFAULT */
+    u64 vruntime;       /* weighted run time, the lowest runnable one runs next */
+    struct timer vtimer;    /* armed with its virtual timer while it is blocked */
 };
 
 struct vcpu *new_vcpu(struct vm *vm, int vcpuid, u64 entrypoint);
@@ -72,7 +141,13 @@ void free_vcpu(struct vcpu *vcpu);
 
 void vcpu_ready(struct vcpu *vcpu);
 
-void enter_vcpu(void);
+void vcpu_load(struct vcpu *vcpu);
+void vcpu_put(struct vcpu *vcpu);
+void vcpu_ctx_switch(struct vcpu *prev, struct vcpu *next);
+void vcpu_fpsimd_init(void);
+void vcpu_fpsimd_switch(struct vcpu *vcpu);
+
+void vcpu_irq_forward(struct vcpu *vcpu);
 
 void vcpu_init(void);
 
@@ -8,28 +8,75 @@
 struct vcpu;
 struct vm;
 
+/* vgic_irq.state */
+#define VGIC_IRQ_PENDING    (1 << 0)
+#define VGIC_IRQ_ACTIVE     (1 << 1)
+
+/*
+ * Every field is a byte of its own, read and written with __atomic_* by any
+ * vcpu of the VM without a lock: no two vcpus contend unless they configure
+ * the same interrupt.
+ *
+ * A hw interrupt is the physical one @pintid passed through, its
+ * pending/active state lives in the physical GIC and the HW-linked LR. An
+ * emulated one (hw == 0) is raised by the hypervisor, see vgic_irq_raise(),
+ * and its state is kept here: set when raised, cleared when its LR is found
+ * empty again (the LRs may be ahead of it meanwhile).
+ */
 struct vgic_irq {
     u8 priority;  /* ipriorityr */
-    u8 target;
-    u8 enabled: 1;
-    u8 igroup: 1;
-    // TODO: u8 state; 维护VM中断的状态, 例如pending, active等
-    // (可以参考bao-hypervisor的实现, vgic_irq中的state可以从lr寄存器中获取)
+    u8 target;    /* itargetsr, a mask of vcpus */
+    u8 enabled;
+    u8 igroup;
+    u8 state;     /* VGIC_IRQ_PENDING | VGIC_IRQ_ACTIVE */
+    u8 level;     /* level-sensitive (GICD_ICFGR 0b00), edge-triggered otherwise */
+    u8 line;      /* input line of a level-sensitive emulated interrupt */
+    u8 hw;
+    u16 pintid;   /* the physical INTID of a hw one */
 };
 
+/* vgic->spis covers every INTID a GICD register can name */
+#define VGIC_SPI_MAX    (1024 - 32)
+
+/* physical SPIs one VM may own */
+#define VGIC_HW_MAX     16
+
 struct vgic {
     int             used;
     int             max_spi_intid;  /* Max SPI INTID */
     int             spi_nums;       /* Supported SPIs' number */
     bool            enable_grp1ns;  /* Enable Non-secure Group 1 interrupts */
     struct vgic_irq *spis;
+    u16             hw_pirq[VGIC_HW_MAX];  /* physical SPIs passed through */
+    int             nhw;
+    /* serializes the physical routing of the VM's SPIs (ITARGETSR/IROUTER) */
     spinlock_t lock;
+    u64 lock_acquired;
+    u64 lock_contended;     /* acquisitions that found the lock taken */
+};
+
+/* depth of the per vcpu queue of vIRQs waiting for a free LR */
+#define VGIC_PENDQ_MAX  32
+
+/* a vIRQ that found no free LR: the LR value to write and when it was queued */
+struct vgic_pend {
+    u64 lr;
+    u64 stamp;
 };
 
 /* vgic cpu interface */
 struct vgic_cpu {
     int used;
+    /* the queue may be filled from other pcpus, everything else below only
+     * changes on the pcpu the vcpu is placed on, still under the lock */
+    spinlock_t lock;
+    int pcpu;       /* where its passthrough SPIs are routed, see vgic_vcpu_load() */
+    int loaded;     /* its LRs are in ICH_LR<n>_EL2 of pcpu, see vgic_loaded() */
     u16 used_lr;
+    /* LR overflow, sorted by ICH_LR_PRIO() (highest priority first, FIFO among
+     * equals); refilled on the UIE/NPIE maintenance interrupt, see vgic_lr_refill() */
+    int pendq_len;
+    struct vgic_pend pendq[VGIC_PENDQ_MAX];
     struct vgic_irq sgis[GIC_NSGI];
     struct vgic_irq ppis[GIC_NPPI];
 };
@@ -38,7 +85,20 @@ void vgic_used_lr_update(struct vcpu *vcpu);
 struct vgic *new_vgic(struct vm *);
 struct vgic_cpu *new_vgic_cpu(int vcpuid);
 int vgic_inject_virq(struct vcpu *vcpu, u32 pirq, u32 virq, int group);
+void vgic_hw_ppi_assert(struct vcpu *vcpu, u32 intid);
 void vgic_restore_state(struct vgic_cpu *vgic);
+bool vgic_has_pending(struct vcpu *vcpu);
+void vgic_vcpu_put(struct vcpu *vcpu);
+void vgic_vcpu_load(struct vcpu *vcpu);
+void vgic_maintenance(struct vcpu *vcpu);
+void vgic_sync(struct vcpu *vcpu);
+void vgic_sgi1r_write(struct vcpu *vcpu, u64 val);
+
+void vgic_irq_emulated(struct vm *vm, u32 intid, bool level);
+void vgic_irq_passthrough(struct vm *vm, u32 pirq, u32 virq);
+int vgic_spi_forward(u32 pirq);
+void vgic_irq_raise(struct vm *vm, u32 intid);
+void vgic_irq_lower(struct vm *vm, u32 intid);
 
 void vgic_init(void);
 
@@ -3,27 +3,42 @@
 
 #include "types.h"
 #include "spinlock.h"
+#include "iothread.h"
+#include "default_config.h"
+#include "ramdisk.h"
 
 struct vm;
+struct vm_virtio;
 
 #define VIRTIO_MMIO_MAGIC_VALUE		    0x000 // 0x74726976, read-only
-#define VIRTIO_MMIO_VERSION		        0x004 // version; 1 is legacy, read-only
+#define VIRTIO_MMIO_VERSION		        0x004 // version; 1 is legacy, 2 is virtio 1.x, read-only
 #define VIRTIO_MMIO_DEVICE_ID		    0x008 // device type; 1 is net, 2 is disk, read-only
 #define VIRTIO_MMIO_VENDOR_ID		    0x00c // 0x554d4551, read-only
 #define VIRTIO_MMIO_DEVICE_FEATURES	    0x010 // Flags representing features the device supports, read-only
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014 // 32-bit word of DEVICE_FEATURES, write-only
 #define VIRTIO_MMIO_DRIVER_FEATURES	    0x020 // write-only
-#define VIRTIO_MMIO_GUEST_PAGE_SIZE	    0x028 // page size for PFN, write-only
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024 // 32-bit word of DRIVER_FEATURES, write-only
 #define VIRTIO_MMIO_QUEUE_SEL		    0x030 // select queue, write-only
 #define VIRTIO_MMIO_QUEUE_NUM_MAX	    0x034 // max size of current queue, read-only
 #define VIRTIO_MMIO_QUEUE_NUM		    0x038 // size of current queue, write-only
-#define VIRTIO_MMIO_QUEUE_ALIGN		    0x03c // used ring alignment, write-only
-#define VIRTIO_MMIO_QUEUE_PFN		    0x040 // physical page number for queue, read/write
 #define VIRTIO_MMIO_QUEUE_READY		    0x044 // ready bit, read/write
 #define VIRTIO_MMIO_QUEUE_NOTIFY	    0x050 // Writing a queue index to this register notifies the device that
                                               // there are new buffers to process in the queue, write-only
 #define VIRTIO_MMIO_INTERRUPT_STATUS    0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	    0x064 // notifies the device that events causing the interrupt have been handled, write-only
 #define VIRTIO_MMIO_STATUS		        0x070 // read/write
+#define VIRTIO_MMIO_QUEUE_DESC_LOW	    0x080 // physical address of the descriptor table, write-only
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH	    0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW	0x090 // physical address of the avail ring, write-only
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH	0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW	0x0a0 // physical address of the used ring, write-only
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH	0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION	0x0fc // changes when the configuration does, read-only
+#define VIRTIO_MMIO_CONFIG		        0x100 // device configuration space, read/write
+
+// VIRTIO_MMIO_INTERRUPT_STATUS bits
+#define VIRTIO_MMIO_INT_VRING       (1 << 0)  // a used ring was updated
+#define VIRTIO_MMIO_INT_CONFIG      (1 << 1)  // the configuration changed
 
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
 #define VIRTIO_CONFIG_S_DRIVER		2
@@ -38,10 +53,7 @@ struct vm;
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
-
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+#define VIRTIO_F_VERSION_1          32  /* virtio 1.x, the only mode of the device */
 
 #define VIRTIO0_IRQ  48
 
@@ -54,12 +66,16 @@ struct virtq_desc {
 
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // buffer is a table of descriptors
+
+#define VRING_AVAIL_F_NO_INTERRUPT  1 // driver: no interrupt on completion
+#define VRING_USED_F_NO_NOTIFY      1 // device: no QUEUE_NOTIFY needed
 
 struct virtq_avail {
-    u16 flags; // always zero
+    u16 flags; // VRING_AVAIL_F_NO_INTERRUPT
     u16 idx;   // driver will write ring[idx] next
-    u16 ring[NUM]; // descriptor numbers of chain heads
-    u16 unused;
+    u16 ring[]; // descriptor numbers of chain heads, QUEUE_NUM of them
+    // then u16 used_event; with EVENT_IDX: interrupt once used idx passes it
 };
 
 struct virtq_used_elem {
@@ -68,33 +84,99 @@ struct virtq_used_elem {
 };
 
 struct virtq_used {
-    u16 flags; // always zero
+    u16 flags; // VRING_USED_F_NO_NOTIFY
     u16 idx;   // device increments when it adds a ring[] entry
-    struct virtq_used_elem ring[NUM];
+    struct virtq_used_elem ring[]; // QUEUE_NUM of them
+    // then u16 avail_event; with EVENT_IDX: notify once avail idx passes it
 };
 
+/* bytes of the rings of a @num entries queue, event fields included */
+#define VRING_DESC_SIZE(num)    ((u64)(num) * sizeof(struct virtq_desc))
+#define VRING_AVAIL_SIZE(num)   (4 + 2 * (u64)(num) + 2)
+#define VRING_USED_SIZE(num)    (4 + sizeof(struct virtq_used_elem) * (u64)(num) + 2)
+
+/*
+ * EVENT_IDX: the other side asked to be told when the index moving from
+ * @old to @new passes @event.
+ */
+static inline bool vring_need_event(u16 event, u16 new, u16 old)
+{
+    return (u16)(new - event - 1) < (u16)(new - old);
+}
+
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
 #define VIRTIO_BLK_T_FLUSH 4
 
+// the one-byte status written at the end of a request
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VIRTIO_BLK_SECTOR_SIZE  512
+
 // the format of the first descriptor in a disk request.
-// to be followed by two more descriptors containing
-// the block, and a one-byte status.
+// to be followed by any number of data descriptors, and
+// a one-byte status.
 struct virtio_blk_req {
     u32 type; // VIRTIO_BLK_T_IN or ..._OUT
     u32 reserved;
     u64 sector;
 };
 
+/* number of request queues with VIRTIO_BLK_F_MQ, one per vcpu of the guest */
+#define VIRTIO_BLK_NQ       4
+
+/* device configuration space, the fields up to num_queues */
+struct virtio_blk_config {
+    u64 capacity;           /* in 512-byte sectors */
+    u32 size_max;
+    u32 seg_max;
+    u16 cylinders;
+    u8  heads;
+    u8  sectors;
+    u32 blk_size;
+    u8  physical_block_exp;
+    u8  alignment_offset;
+    u16 min_io_size;
+    u32 opt_io_size;
+    u8  wce;
+    u8  unused;
+    u16 num_queues;
+} __attribute__((packed));
+
+/* device types, VIRTIO_MMIO_DEVICE_ID */
+#define VIRTIO_ID_BLOCK     2
+
+/* queues of a device at most */
+#define VIRTIO_QUEUE_MAX    VIRTIO_BLK_NQ
+
+/* virtio-mmio devices of all VMs at most */
+#define VIRTIO_DEV_MAX      (VM_MAX * 4)
+
+struct virtio_dev;
+
 struct virt_queue {
     spinlock_t          virtq_lock;
+    u16                 index;
+    struct virtio_dev   *dev;
+    struct io_work      work;           /* serves the queue on its own pcpu */
+    struct vm           *vm;            /* set once the ring is, the backend may run on any pcpu */
     u64                 vring_num;
-    u64                 vring_ipa;
-    u64                 vring_pa;
+    /* where the driver placed each ring, QUEUE_DESC/DRIVER/DEVICE */
+    u64                 desc_ipa;
+    u64                 avail_ipa;
+    u64                 used_ipa;
 
     /* avail_idx will always be incremented, not % vring_num.
      * It's where we assume the next request index is at. */
     u16                 avail_idx;      
+
+    /* EVENT_IDX / flags suppression at work: QUEUE_NOTIFY writes, interrupts
+     * raised and requests served, see virtio_blk_req_handler() */
+    u64                 nr_notify;
+    u64                 nr_irq;
+    u64                 nr_req;
     
     /* point to vring's PA, where are samed with VM's vring */
     struct virtq_desc   *desc;
@@ -102,6 +184,45 @@ struct virt_queue {
     struct virtq_used   *used;
 };
 
-void virtio_mmio_init(struct vm *vm);
+/*
+ * A device type behind the virtio-mmio transport. The transport owns the
+ * registers and the rings, the type serves the requests one chain at a time.
+ */
+struct virtio_dev_ops {
+    const char  *name;
+    u32         device_id;
+    u64         features;           /* offered to the driver */
+    int         nqueues;
+    u32         queue_num_max;
+
+    /* set up the device type state of @dev, < 0 fails its creation; may be NULL */
+    int         (*init)(struct virtio_dev *dev);
+    /* serve the chain at @head of @vq, return the bytes written to the guest */
+    u32         (*handle_req)(struct virt_queue *vq, u16 head);
+    /* @size bytes at @offset of the configuration space */
+    u64         (*config_read)(struct virtio_dev *dev, u64 offset, u64 size);
+};
+
+/* a virtio-mmio device of a VM, in one slot of its virtio-mmio bus */
+struct virtio_dev {
+    struct vm                   *vm;
+    u32                         slot;
+    u32                         irq;
+    const struct virtio_dev_ops *ops;
+    void                        *ctx;   /* device type state */
+    struct ramdisk              disk;   /* backing store of a virtio-blk */
+
+    u64                         driver_features;
+    u32                         device_features_sel;
+    u32                         driver_features_sel;
+    u32                         status;
+    u32                         queue_sel;
+    /* VIRTIO_MMIO_INTERRUPT_STATUS, the level of @irq follows it */
+    u32                         intr_status;
+    struct virt_queue           vqs[VIRTIO_QUEUE_MAX];
+    int                         used;
+};
+
+void virtio_mmio_init(struct vm *vm, struct vm_virtio *devs, int ndevs);
 
 #endif
\ No newline at end of file
@@ -7,9 +7,36 @@
 #include "default_config.h"
 
 struct mmio_access;
-struct mmio_info;
+struct mmio_table;
 struct vcpu;
 
+#define VM_REGION_MAX   8
+
+/* stage2 memory attribute policy of a guest IPA region */
+enum vm_mem_type {
+    VM_MEM_NORMAL = 0,  /* Normal, Inner/Outer Write-Back, Inner Shareable (guest RAM) */
+    VM_MEM_DEVICE,      /* Device-nGnRE, mapped ipa == pa (device pass through) */
+    VM_MEM_UNCACHED,    /* Normal, Inner/Outer Non-cacheable */
+};
+
+struct vm_region {
+    u64               ipa;
+    u64               size;
+    enum vm_mem_type  type;
+};
+
+/* a physical SPI passed through, delivered to the VM as @virq */
+struct vm_irq {
+    u32               pirq;
+    u32               virq;
+};
+
+/* a virtio-mmio device of type @device_id in slot @slot, see virtio.h */
+struct vm_virtio {
+    u32               slot;
+    u32               device_id;
+};
+
 struct vmconfig {
     struct guest  *guest_img;
     struct guest  *fdt_img;
@@ -22,6 +49,23 @@ struct vmconfig {
      * Hypervisor为guest os image建立stage2页表映射时, IPA用的就是该变量！
      */
     u64           entrypoint;   
+
+    /* RAM is VM_MEM_NORMAL by default; @regions adds pass through devices
+     * and may override the type of a part of RAM (e.g. VM_MEM_UNCACHED) */
+    struct vm_region  *regions;
+    int               nregions;
+
+    /* physical SPIs owned by the VM alone, see vgic_irq_passthrough() */
+    struct vm_irq     *irqs;
+    int               nirqs;
+
+    /* emulated virtio-mmio devices */
+    struct vm_virtio  *virtio;
+    int               nvirtio;
+
+    /* scheduling of every vcpu of the VM, see sched.h */
+    u64           cpu_affinity;     /* bitmask of pcpus the vcpus may be placed on, 0: any */
+    u32           sched_weight;     /* share of a pcpu, 0: SCHED_WEIGHT_DEFAULT */
 };
 
 struct vm {
@@ -30,15 +74,31 @@ struct vm {
     struct vcpu       *vcpus[VCPU_MAX];
     u64               *stage2_pt;
     struct vgic       *vgic;
-    struct mmio_info  *mmio_list;
+    struct mmio_table *mmio;    /* MMIO dispatch table, see mmio.h */
     int               used;
     u64               fdt;    /* fdt base address for linux */
+    struct vm_region  regions[VM_REGION_MAX];   /* regions[0] is RAM */
+    int               nregions;
+    u64               vmid;   /* generation << VMID_BITS | vmid, see vm_vttbr() */
+    u64               cntvoff;    /* virtual counter offset, the same on all its vcpus */
+    struct vcpu       *last_vcpu[PCPU_NUM_MAX];  /* last of its vcpus loaded on each pcpu, see vcpu_load() */
 };
 
 void s2_pt_trap(struct vm *vm, u64 ipa, u64 size,
                 int (*read_handler)(struct vcpu *, u64, u64 *, struct mmio_access *),
-                int (*write_handler)(struct vcpu *, u64, u64, struct mmio_access *));
+                int (*write_handler)(struct vcpu *, u64, u64, struct mmio_access *),
+                void *ctx);
 
 void create_vm(struct vmconfig *vmcfg);
 
+enum vm_mem_type vm_mem_type(struct vm *vm, u64 ipa);
+
+u64 vm_vttbr(struct vm *vm);
+void vm_tlb_flush_range(struct vm *vm, u64 ipa, u64 size);
+
+int vm_copy_to_guest(struct vm *vm, u64 ipa, const void *src, u64 size);
+
+void vm_sync_from_guest(struct vm *vm, u64 ipa, u64 pa, u64 size);
+void vm_sync_to_guest(struct vm *vm, u64 ipa, u64 pa, u64 size);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,355 @@
+#include "bench.h"
+#include "types.h"
+#include "vcpu.h"
+#include "mmu.h"
+#include "page_alloc.h"
+#include "ramdisk.h"
+#include "cache.h"
+#include "sysreg.h"
+#include "aarch64.h"
+#include "timer.h"
+#include "lib.h"
+#include "gic.h"
+#include "vgic.h"
+#include "vm.h"
+#include "debug.h"
+
+#define BENCH_IPA_BASE      0x40000000UL
+#define BENCH_PAGES         16
+
+static struct vcpu g_bench_vcpu;
+static struct vcpu g_bench_ctx[2];
+static struct vcpu g_bench_irq_vcpu;
+static struct vgic_cpu g_bench_vgic;
+static struct vm g_bench_vm;
+static volatile u64 g_bench_sink;
+
+extern u32 g_gic_lr_max;
+
+/* an active, purely virtual LR: neither empty nor pending */
+#define BENCH_LR_ACTIVE(vintid) \
+    (ICH_LR_STATE(LR_ACTIVE) | ICH_LR_GROUP(1) | ICH_LR_VINTID(vintid))
+static u64 *g_bench_s2pt;
+static u64 g_bench_buf;
+
+static void bench_prepare(void)
+{
+    if (g_bench_s2pt != NULL) {
+        return;
+    }
+
+    g_bench_s2pt = (u64 *)alloc_page();
+    g_bench_buf = alloc_pages(BENCH_PAGES);
+    if (NULL == g_bench_s2pt || -1ULL == g_bench_buf) {
+        panic("[bench_prepare] no mem");
+    }
+    memset(g_bench_s2pt, 0, PAGE_SIZE);
+    pagemap(g_bench_s2pt, BENCH_IPA_BASE, g_bench_buf, BENCH_PAGES * PAGE_SIZE,
+            S2PTE_NORMAL | S2PTE_RW);
+
+    vcpu_fpsimd_init();
+}
+
+/*
+ * Memory traffic of one guest exit: vm_context_save/vm_context_restore of
+ * the 33 saved registers into struct vcpu, a stage2 walk as done by the
+ * virtio backend, and a page allocator bitmap scan.
+ */
+static u64 bench_exit_path(u64 iters)
+{
+    u64 regs[33] = {0};
+    struct vcpu *vcpu = &g_bench_vcpu;
+    u64 start = get_syscount();
+
+    for (u64 n = 0; n < iters; ++n) {
+        for (int i = 0; i < 31; ++i) {
+            vcpu->reg.x[i] = regs[i] + n;
+        }
+        vcpu->reg.spsr_el2 = regs[31];
+        vcpu->reg.elr_el2 = regs[32] + 4;
+
+        regs[n % 33] = ipa2pa(g_bench_s2pt, BENCH_IPA_BASE + (n % BENCH_PAGES) * PAGE_SIZE);
+
+        u64 page = alloc_page();
+        free_page(page);
+
+        for (int i = 0; i < 31; ++i) {
+            regs[i] = vcpu->reg.x[i];
+        }
+    }
+
+    return get_syscount() - start;
+}
+
+/* ramdisk -> guest buffer block copies, as done for a virtio-blk read */
+static u64 bench_disk_copy(u64 iters)
+{
+    u64 start = get_syscount();
+
+    for (u64 n = 0; n < iters; ++n) {
+        u64 buf = g_bench_buf + (n % (BENCH_PAGES * PAGE_SIZE / BLOCK_SIZE)) * BLOCK_SIZE;
+        ramdisk_rw(n % FSIMG_SIZE, buf, 0);
+        dcache_clean_range(buf, BLOCK_SIZE);
+    }
+
+    return get_syscount() - start;
+}
+
+/*
+ * vcpu switch between two VMs: VTTBR_EL2 write with a global stage2 TLB
+ * flush (untagged) vs. with distinct VMIDs. The cost of refilling the
+ * flushed TLB is paid by the guest on top of this.
+ */
+static u64 bench_switch_flush(u64 iters)
+{
+    u64 start = get_syscount();
+
+    for (u64 n = 0; n < iters; ++n) {
+        write_sysreg(vttbr_el2, PTE_PA(g_bench_s2pt));
+        tlb_flush();
+    }
+
+    u64 ticks = get_syscount() - start;
+    write_sysreg(vttbr_el2, 0);
+    return ticks;
+}
+
+static u64 bench_switch_vmid(u64 iters)
+{
+    u64 start = get_syscount();
+
+    for (u64 n = 0; n < iters; ++n) {
+        write_sysreg(vttbr_el2, VTTBR_VMID(1 + (n & 1)) | PTE_PA(g_bench_s2pt));
+        isb();
+    }
+
+    u64 ticks = get_syscount() - start;
+    write_sysreg(vttbr_el2, 0);
+    return ticks;
+}
+
+/*
+ * EL1 context switch between two vcpus, as done by vcpu_put()/vcpu_load():
+ * "ctx-same-vm" both share the MMU/ID groups (vcpus of one VM), "ctx-full"
+ * differ in TCR_EL1 so every group is written, "ctx-fp" is ctx-full plus the
+ * FP/SIMD switch a vcpu using FP pays on its first FP trap after the load.
+ */
+static u64 bench_ctx_switch(u64 iters, bool full, bool fp)
+{
+    struct vcpu *a = &g_bench_ctx[0];
+    struct vcpu *b = &g_bench_ctx[1];
+    u64 tcr;
+
+    /* take the current hardware state as the context of both */
+    vcpu_ctx_switch(a, a);
+    b->sys = a->sys;
+    read_sysreg(tcr, tcr_el1);
+    b->sys.tcr_el1 = full ? tcr ^ (1UL << 23) : tcr;    /* EPD1 */
+
+    u64 start = get_syscount();
+
+    for (u64 n = 0; n < iters; ++n) {
+        struct vcpu *prev = (n & 1) ? b : a;
+        struct vcpu *next = (n & 1) ? a : b;
+
+        vcpu_ctx_switch(prev, next);
+        if (fp) {
+            vcpu_fpsimd_switch(next);
+        }
+    }
+
+    u64 ticks = get_syscount() - start;
+    vcpu_ctx_switch((iters & 1) ? b : a, a);
+    return ticks;
+}
+
+static u64 bench_ctx_same_vm(u64 iters)
+{
+    return bench_ctx_switch(iters, false, false);
+}
+
+static u64 bench_ctx_full(u64 iters)
+{
+    return bench_ctx_switch(iters, true, false);
+}
+
+static u64 bench_ctx_fp(u64 iters)
+{
+    return bench_ctx_switch(iters, true, true);
+}
+
+/*
+ * "Is a vIRQ pending in the LRs" as asked on every WFI and halt poll, with
+ * one LR in use: reading all the LRs through the gic_read_lr() switch vs.
+ * only those ICH_ELRSR_EL2 reports in use (gic_has_pending_lr()).
+ */
+static u64 bench_lr_scan_all(u64 iters)
+{
+    u64 hit = 0;
+
+    gic_write_lr(0, BENCH_LR_ACTIVE(16));
+    isb();
+
+    u64 start = get_syscount();
+    for (u64 n = 0; n < iters; ++n) {
+        for (int i = 0; i < g_gic_lr_max; ++i) {
+            hit += lr_is_pending(gic_read_lr(i));
+        }
+    }
+    u64 ticks = get_syscount() - start;
+
+    gic_write_lr(0, 0);
+    g_bench_sink = hit;
+    return ticks;
+}
+
+static u64 bench_lr_scan_elrsr(u64 iters)
+{
+    u64 hit = 0;
+
+    gic_write_lr(0, BENCH_LR_ACTIVE(16));
+    isb();
+
+    u64 start = get_syscount();
+    for (u64 n = 0; n < iters; ++n) {
+        hit += gic_has_pending_lr();
+    }
+    u64 ticks = get_syscount() - start;
+
+    gic_write_lr(0, 0);
+    g_bench_sink = hit;
+    return ticks;
+}
+
+/*
+ * LR bookkeeping of one forwarded interrupt (see vcpu_irq_forward()) into a
+ * loaded vcpu holding three other vIRQs: used LR update, lookup of the vINTID,
+ * LR allocation and write. The LR is emptied again outside of the timing.
+ */
+static u64 bench_virq_inject(u64 iters)
+{
+    struct vcpu *vcpu = &g_bench_irq_vcpu;
+    struct vcpu *prev = cur_vcpu();
+    u64 ticks = 0;
+
+    if (g_gic_lr_max < 4) {
+        return 0;
+    }
+    vcpu->vgic = &g_bench_vgic;
+    vcpu->state = RUNNING;
+    /* loaded here: the LRs are the hardware ones, see vgic_loaded() */
+    vcpu->vgic->loaded = 1;
+    write_sysreg(tpidr_el2, vcpu);
+    for (int i = 0; i < 3; ++i) {
+        vcpu->gic.lr[i] = BENCH_LR_ACTIVE(16 + i);
+        gic_write_lr(i, vcpu->gic.lr[i]);
+    }
+    isb();
+
+    for (u64 n = 0; n < iters; ++n) {
+        u64 start = get_syscount();
+        vgic_used_lr_update(vcpu);
+        int ret = vgic_inject_virq(vcpu, 20, 20, 1);
+        ticks += get_syscount() - start;
+
+        if (ret < 0) {
+            break;
+        }
+        gic_write_lr(3, 0);
+        vcpu->gic.lr[3] = 0;
+        isb();
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        gic_write_lr(i, 0);
+    }
+    write_sysreg(tpidr_el2, prev);
+    vcpu->vgic->loaded = 0;
+    vcpu->state = UNUSED;
+    return ticks;
+}
+
+/*
+ * Hypervisor side of a guest IPI between two vcpus of a VM, both loaded on
+ * this pcpu as if it were one (target == sender): the trapped ICC_SGI1R_EL1
+ * write until the vSGI sits in an LR, including retiring the previous one
+ * the guest has completed meanwhile. A target on another pcpu adds the kick
+ * and vgic_sync() there.
+ */
+static u64 bench_sgi_inject(u64 iters)
+{
+    struct vcpu *vcpu = &g_bench_irq_vcpu;
+    struct vcpu *prev = cur_vcpu();
+    u64 ticks = 0;
+
+    g_bench_vm.nvcpu = 1;
+    g_bench_vm.vcpus[0] = vcpu;
+    vcpu->vm = &g_bench_vm;
+    vcpu->vgic = &g_bench_vgic;
+    vcpu->vgic->sgis[1].enabled = 1;
+    vcpu->state = RUNNING;
+    vcpu->vgic->loaded = 1;
+    write_sysreg(tpidr_el2, vcpu);
+
+    for (u64 n = 0; n < iters; ++n) {
+        u64 start = get_syscount();
+        vgic_sgi1r_write(vcpu, ((u64)1 << 24) | 0x1);   /* SGI 1 to Aff0 == 0 */
+        ticks += get_syscount() - start;
+
+        /* the guest takes and deactivates it */
+        gic_write_lr(0, 0);
+        isb();
+    }
+
+    for (int i = 0; i < g_gic_lr_max; ++i) {
+        gic_write_lr(i, 0);
+    }
+    write_sysreg(tpidr_el2, prev);
+    vcpu->vgic->loaded = 0;
+    vcpu->state = UNUSED;
+    return ticks;
+}
+
+/* cycles -> ns -> cycles, as the halt poll and the exit statistics convert */
+static u64 bench_clock_convert(u64 iters)
+{
+    u64 acc = 0;
+
+    u64 start = get_syscount();
+    for (u64 n = 0; n < iters; ++n) {
+        acc += nstime_to_count(count_to_time_ns(start + n));
+    }
+    u64 ticks = get_syscount() - start;
+
+    g_bench_sink = acc;
+    return ticks;
+}
+
+static struct bench_case g_bench_cases[] = {
+    { "exit-path",  10000, bench_exit_path },
+    { "disk-copy",  2000,  bench_disk_copy },
+    { "switch-flush", 10000, bench_switch_flush },
+    { "switch-vmid",  10000, bench_switch_vmid },
+    { "ctx-same-vm",  10000, bench_ctx_same_vm },
+    { "ctx-full",     10000, bench_ctx_full },
+    { "ctx-fp",       10000, bench_ctx_fp },
+    { "lr-scan-all",   10000, bench_lr_scan_all },
+    { "lr-scan-elrsr", 10000, bench_lr_scan_elrsr },
+    { "virq-inject",   10000, bench_virq_inject },
+    { "sgi-inject",    10000, bench_sgi_inject },
+    { "clock-convert", 10000, bench_clock_convert },
+};
+
+void bench_run_all(const char *stage)
+{
+    bench_prepare();
+
+    LOG_TRACE("=====================  BENCH (%s)  =====================\n", stage);
+    for (int i = 0; i < sizeof(g_bench_cases) / sizeof(g_bench_cases[0]); ++i) {
+        struct bench_case *bc = &g_bench_cases[i];
+        u64 ticks = bc->fn(bc->iters);
+        LOG_TRACE(" - %s: %d iters, %d ns/iter\n",
+                  bc->name, bc->iters, count_to_time_ns(ticks) / bc->iters);
+    }
+    LOG_TRACE("=======================================================\n");
+}
@@ -0,0 +1,110 @@
+#include "cache.h"
+#include "aarch64.h"
+
+#define CLIDR_CTYPE(clidr, n)   (((clidr) >> ((n) * 3)) & 0x7)
+#define CLIDR_LOC(clidr)        (((clidr) >> 24) & 0x7)
+#define CLIDR_LOUIS(clidr)      (((clidr) >> 21) & 0x7)
+
+#define CTYPE_DATA              (0b010)     /* >= 0b010: data or unified cache present */
+
+#define CCSIDR_LINESIZE(c)      (((c) & 0x7) + 4)               /* log2(line bytes) */
+#define CCSIDR_WAYS(c)          ((((c) >> 3) & 0x3ff) + 1)
+#define CCSIDR_SETS(c)          ((((c) >> 13) & 0x7fff) + 1)
+
+static inline u64 dcache_line_size(void)
+{
+    u64 ctr;
+    read_sysreg(ctr, ctr_el0);
+    /* CTR_EL0.DminLine: log2 of the number of words in the smallest dcache line */
+    return 4UL << ((ctr >> 16) & 0xf);
+}
+
+#define DCACHE_RANGE_OP(op, va, size)                               \
+    do {                                                            \
+        u64 __line = dcache_line_size();                            \
+        u64 __p = (va) & ~(__line - 1);                             \
+        u64 __end = (va) + (size);                                  \
+        for (; __p < __end; __p += __line) {                        \
+            asm volatile("dc " #op ", %0" :: "r"(__p) : "memory");  \
+        }                                                           \
+        dsb(sy);                                                    \
+    } while (0)
+
+void dcache_clean_range(u64 va, u64 size)
+{
+    DCACHE_RANGE_OP(cvac, va, size);
+}
+
+void dcache_inval_range(u64 va, u64 size)
+{
+    DCACHE_RANGE_OP(ivac, va, size);
+}
+
+void dcache_flush_range(u64 va, u64 size)
+{
+    DCACHE_RANGE_OP(civac, va, size);
+}
+
+/* invalidate one data/unified cache level by set/way */
+static void dcache_inval_level(u32 level)
+{
+    u64 ccsidr;
+
+    write_sysreg(csselr_el1, level << 1);
+    isb();
+    read_sysreg(ccsidr, ccsidr_el1);
+
+    u32 line_shift = CCSIDR_LINESIZE(ccsidr);
+    u32 ways = CCSIDR_WAYS(ccsidr);
+    u32 sets = CCSIDR_SETS(ccsidr);
+    u32 way_shift = (ways > 1) ? __builtin_clz(ways - 1) : 0;
+
+    for (u32 way = 0; way < ways; ++way) {
+        for (u32 set = 0; set < sets; ++set) {
+            u64 sw = ((u64)way << way_shift) | ((u64)set << line_shift) | (level << 1);
+            asm volatile("dc isw, %0" :: "r"(sw) : "memory");
+        }
+    }
+}
+
+static void dcache_inval_levels(u32 nlevels)
+{
+    u64 clidr;
+    read_sysreg(clidr, clidr_el1);
+
+    for (u32 level = 0; level < nlevels; ++level) {
+        if (CLIDR_CTYPE(clidr, level) >= CTYPE_DATA) {
+            dcache_inval_level(level);
+        }
+    }
+    write_sysreg(csselr_el1, 0);
+    dsb(sy);
+    isb();
+}
+
+/* Invalidate every data cache level up to the PoC. Must only be called by the
+ * primary cpu before any cpu has enabled its data cache, otherwise dirty lines
+ * in the shared levels would be thrown away. */
+void dcache_inval_all(void)
+{
+    u64 clidr;
+    read_sysreg(clidr, clidr_el1);
+    dcache_inval_levels(CLIDR_LOC(clidr));
+}
+
+/* Invalidate the private levels (up to the PoU for inner shareable) of the
+ * calling cpu only, used by secondaries which share the outer levels with
+ * cpus that are already running with caches on. */
+void dcache_inval_local(void)
+{
+    u64 clidr;
+    read_sysreg(clidr, clidr_el1);
+    dcache_inval_levels(CLIDR_LOUIS(clidr));
+}
+
+void icache_inval_all(void)
+{
+    asm volatile("ic iallu" ::: "memory");
+    dsb(ish);
+    isb();
+}
@@ -0,0 +1,155 @@
+#include "exit_stat.h"
+#include "vcpu.h"
+#include "vm.h"
+#include "mmio.h"
+#include "timer.h"
+#include "lib.h"
+#include "debug.h"
+
+static const char *exit_class_name[EXIT_CLASS_MAX] = {
+    [EXIT_FAST_WFX]  = "fast-wfx",
+    [EXIT_FAST_HVC]  = "fast-hvc",
+    [EXIT_FAST_MMIO] = "fast-mmio",
+    [EXIT_WFX]       = "wfx",
+    [EXIT_HVC]       = "hvc",
+    [EXIT_MMIO]      = "mmio",
+    [EXIT_OTHER]     = "other",
+};
+
+static const char *halt_stat_name[HALT_STAT_MAX] = {
+    [HALT_POLL_OK]   = "poll-ok",
+    [HALT_POLL_FAIL] = "poll-fail",
+    [HALT_BLOCK]     = "block",
+};
+
+/* only called by the vcpu itself on its own pcpu, no locking */
+void exit_stat_add(struct exit_stat *s, u64 ticks)
+{
+    int b = ticks ? 63 - __builtin_clzll(ticks) : 0;
+
+    if (b >= EXIT_HIST_BUCKETS) {
+        b = EXIT_HIST_BUCKETS - 1;
+    }
+    if (s->count == 0 || ticks < s->min) {
+        s->min = ticks;
+    }
+    if (ticks > s->max) {
+        s->max = ticks;
+    }
+    s->count++;
+    s->ticks += ticks;
+    s->hist[b]++;
+}
+
+void exit_stat_dump(struct vcpu *vcpu)
+{
+    LOG_TRACE("================  vcpu %d exit latency (vm %s)  ================\n",
+              vcpu->cpuid, vcpu->vm->name);
+    for (int i = 0; i < EXIT_CLASS_MAX; ++i) {
+        struct exit_stat *s = &vcpu->stats.cls[i];
+        if (s->count == 0) {
+            continue;
+        }
+        LOG_TRACE(" - %s: %d exits, avg %d ns, min %d ns, max %d ns\n", exit_class_name[i], s->count,
+                  count_to_time_ns(s->ticks) / s->count, count_to_time_ns(s->min),
+                  count_to_time_ns(s->max));
+        for (int b = 0; b < EXIT_HIST_BUCKETS; ++b) {
+            if (s->hist[b]) {
+                LOG_TRACE("     [%d, %d) ticks: %d\n", 1UL << b, 1UL << (b + 1), s->hist[b]);
+            }
+        }
+    }
+    for (int i = 0; i < HALT_STAT_MAX; ++i) {
+        struct exit_stat *s = &vcpu->stats.halt[i];
+        if (s->count == 0) {
+            continue;
+        }
+        LOG_TRACE(" - halt %s: %d times, avg %d ns, max %d ns\n", halt_stat_name[i], s->count,
+                  count_to_time_ns(s->ticks) / s->count, count_to_time_ns(s->max));
+    }
+    LOG_TRACE(" - halt poll window: %d ns\n", vcpu->halt_poll_ns);
+    LOG_TRACE(" - vgic lock (vm): %d acquired, %d contended\n",
+              vcpu->vm->vgic->lock_acquired, vcpu->vm->vgic->lock_contended);
+    if (vcpu->stats.vgic[VGIC_PENDQ_DEPTH].count) {
+        struct exit_stat *d = &vcpu->stats.vgic[VGIC_PENDQ_DEPTH];
+        struct exit_stat *r = &vcpu->stats.vgic[VGIC_PENDQ_REFILL];
+        LOG_TRACE(" - vgic LR overflow: %d queued, max depth %d, %d dropped\n",
+                  d->count, d->max, vcpu->stats.vgic_pendq_drop);
+        if (r->count) {
+            LOG_TRACE(" - vgic LR refill: %d times, avg %d ns, max %d ns\n", r->count,
+                      count_to_time_ns(r->ticks) / r->count, count_to_time_ns(r->max));
+        }
+    }
+    LOG_TRACE("=================================================================\n");
+}
+
+/* emit record @idx of @vcpu into @rec, 0 if @idx is past the last record */
+static int vmstat_rec_get(struct vcpu *vcpu, u64 idx, struct vmstat_rec *rec)
+{
+    struct vcpu_stats *st = &vcpu->stats;
+    struct mmio_table *tbl = vcpu->vm->mmio;
+    u64 n = 0;
+
+#define VMSTAT_EMIT(_kind, _id, _stat)                  \
+    do {                                                \
+        if ((_stat)->count != 0 && n++ == idx) {        \
+            rec->kind = (_kind);                        \
+            rec->id = (_id);                            \
+            rec->stat = *(_stat);                       \
+            return 1;                                   \
+        }                                               \
+    } while (0)
+
+    rec->vcpu = vcpu->cpuid;
+    if (n++ == idx) {
+        rec->kind = VMSTAT_INFO;
+        rec->id = g_clocksource.freq;
+        memset(&rec->stat, 0, sizeof(rec->stat));
+        return 1;
+    }
+    for (int i = 0; i < EXIT_CLASS_MAX; ++i) {
+        VMSTAT_EMIT(VMSTAT_CLASS, i, &st->cls[i]);
+    }
+    for (int i = 0; i < EXIT_STAT_EC_MAX; ++i) {
+        VMSTAT_EMIT(VMSTAT_EC, i, &st->ec[i]);
+    }
+    VMSTAT_EMIT(VMSTAT_IRQ, 0, &st->irq);
+    for (int i = 0; tbl && i < tbl->nregions && i < EXIT_STAT_MMIO_MAX; ++i) {
+        VMSTAT_EMIT(VMSTAT_MMIO, tbl->regions[i].ipa_base, &st->mmio[i]);
+    }
+    for (int i = 0; i < EXIT_STAT_PSCI_MAX; ++i) {
+        VMSTAT_EMIT(VMSTAT_PSCI, SMCC32_FID_STD_SRVC | i, &st->psci[i]);
+    }
+    for (int i = 0; i < HALT_STAT_MAX; ++i) {
+        VMSTAT_EMIT(VMSTAT_HALT, i, &st->halt[i]);
+    }
+    for (int i = 0; i < VGIC_STAT_MAX; ++i) {
+        VMSTAT_EMIT(VMSTAT_VGIC, i, &st->vgic[i]);
+    }
+#undef VMSTAT_EMIT
+
+    return 0;
+}
+
+/* VMSTAT_HVC_FID: copy the statistics of vcpu @vcpuid to guest buffer @ipa */
+long exit_stat_hvc(struct vcpu *vcpu, u64 vcpuid, u64 ipa, u64 size, u64 first)
+{
+    struct vm *vm = vcpu->vm;
+    struct vmstat_rec rec;
+    long n = 0;
+
+    if (vcpuid >= vm->nvcpu || NULL == vm->vcpus[vcpuid]) {
+        return -1;
+    }
+
+    for (; (n + 1) * sizeof(rec) <= size; ++n) {
+        if (!vmstat_rec_get(vm->vcpus[vcpuid], first + n, &rec)) {
+            break;
+        }
+        if (vm_copy_to_guest(vm, ipa + n * sizeof(rec), &rec, sizeof(rec)) < 0) {
+            return -1;
+        }
+    }
+
+    return n;
+}
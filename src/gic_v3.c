@@ -197,6 +197,8 @@ static void init_gich_v3()
     /* enable virtual CPU interface operation;
      * virtual CPU interface will be allowed to send virtual interrupts and maintenance interrupts */
     write_sysreg(ich_hcr_el2, ICH_HCR_EN);
+    /* UIE/NPIE are set per vcpu by the vgic when its LRs overflow */
+    gic_irq_enable(GIC_MAINT_IRQ);
 
     /* fetch the number of implemented List registers */
     g_gic_lr_max = gic_v3_get_listregs();
@@ -208,6 +210,8 @@ void vm_gic_state_init(struct gic_state *gic_state)
     for (int i = 0; i < g_gic_lr_max; i++) {
         gic_state->lr[i] = 0;
     }
+    gic_state->ap0r0_el2 = 0;
+    gic_state->ap1r0_el2 = 0;
     read_sysreg(gic_state->vmcr_el2, ich_vmcr_el2);
 }
 
@@ -393,14 +397,30 @@ int gic_max_spi(void)
     return max_spi_intid > 1019 ? 1019 : max_spi_intid;
 }
 
+/* one bit per implemented list register */
+u32 gic_lr_mask(void)
+{
+    return (1U << g_gic_lr_max) - 1;
+}
+
+/* ICH_ELRSR_EL2: bit n set if LR n holds no valid interrupt */
+u32 gic_read_elrsr(void)
+{
+    u64 elrsr;
+
+    read_sysreg(elrsr, ich_elrsr_el2);
+    return (u32)elrsr & gic_lr_mask();
+}
+
+/* only the LRs that ICH_ELRSR_EL2 reports in use are read */
 bool gic_has_pending_lr(void)
 {
-    u64 lr = 0;
-    
-    for (int i = 0; i < g_gic_lr_max; i++) {
-        lr = gic_read_lr(i);
-    
-        if (lr_is_pending(lr)) {
+    u32 used = ~gic_read_elrsr() & gic_lr_mask();
+
+    while (used) {
+        int n = __builtin_ctz(used);
+        used &= used - 1;
+        if (lr_is_pending(gic_read_lr(n))) {
             return true;
         }
     }
@@ -556,17 +576,91 @@ static void gic_restore_lr(struct gic_state *gic)
     }
 }
 
+static void gic_save_lr(struct gic_state *gic)
+{
+    switch (g_gic_lr_max-1) {
+    case 15:
+        read_sysreg(gic->lr[15], ich_lr15_el2);
+        __fallthrough;
+    case 14:
+        read_sysreg(gic->lr[14], ich_lr14_el2);
+        __fallthrough;
+    case 13:
+        read_sysreg(gic->lr[13], ich_lr13_el2);
+        __fallthrough;
+    case 12:
+        read_sysreg(gic->lr[12], ich_lr12_el2);
+        __fallthrough;
+    case 11:
+        read_sysreg(gic->lr[11], ich_lr11_el2);
+        __fallthrough;
+    case 10:
+        read_sysreg(gic->lr[10], ich_lr10_el2);
+        __fallthrough;
+    case 9:
+        read_sysreg(gic->lr[9], ich_lr9_el2);
+        __fallthrough;
+    case 8:
+        read_sysreg(gic->lr[8], ich_lr8_el2);
+        __fallthrough;
+    case 7:
+        read_sysreg(gic->lr[7], ich_lr7_el2);
+        __fallthrough;
+    case 6:
+        read_sysreg(gic->lr[6], ich_lr6_el2);
+        __fallthrough;
+    case 5:
+        read_sysreg(gic->lr[5], ich_lr5_el2);
+        __fallthrough;
+    case 4:
+        read_sysreg(gic->lr[4], ich_lr4_el2);
+        __fallthrough;
+    case 3:
+        read_sysreg(gic->lr[3], ich_lr3_el2);
+        __fallthrough;
+    case 2:
+        read_sysreg(gic->lr[2], ich_lr2_el2);
+        __fallthrough;
+    case 1:
+        read_sysreg(gic->lr[1], ich_lr1_el2);
+        __fallthrough;
+    case 0:
+        read_sysreg(gic->lr[0], ich_lr0_el2);
+        __fallthrough;
+    }
+}
+
+void gic_save_state(struct gic_state *gic)
+{
+    read_sysreg(gic->vmcr_el2, ich_vmcr_el2);
+    read_sysreg(gic->ap0r0_el2, ich_ap0r0_el2);
+    read_sysreg(gic->ap1r0_el2, ich_ap1r0_el2);
+    gic_save_lr(gic);
+}
+
 void gic_restore_state(struct gic_state *gic)
 {
     u64 sre_el1 = 0;
     read_sysreg(sre_el1, icc_sre_el1);
     
     write_sysreg(ich_vmcr_el2, gic->vmcr_el2);
+    write_sysreg(ich_ap0r0_el2, gic->ap0r0_el2);
+    write_sysreg(ich_ap1r0_el2, gic->ap1r0_el2);
     write_sysreg(icc_sre_el1, (sre_el1 | gic->sre_el1));
     gic_restore_lr(gic);
 }
 
 
+/* send SGI @intid to pcpu @cpu, Aff0 is the cpu index (see cpuid()) */
+void gic_send_sgi(u32 cpu, u32 intid)
+{
+    u64 val = ((u64)(intid & 0xf) << 24) | ICC_SGI1R_TargetList(1UL << cpu);
+
+    dsb(ish);
+    write_sysreg(icc_sgi1r_el1, val);
+    isb();
+}
+
 void gic_set_pending_irq(u16 irq_id)
 {
     gicd_w(GICD_ISPENDR((u32)irq_id / 32U), (1U << (irq_id % 32U)));
@@ -10,8 +10,12 @@
 #include "mmu.h"
 #include "vgic.h"
 #include "vcpu.h"
+#include "sched.h"
+#include "psci.h"
 #include "guest.h"
 #include "ramdisk.h"
+#include "virtio.h"
+#include "bench.h"
 #include "debug.h"
 
 void hyp_vector_table();
@@ -21,7 +25,6 @@ void hyp_vector_table();
 #define BITMAP_SIZE     ((RAM_PAGE_NUM + BIT_PER_LONG - 1) / BIT_PER_LONG)
 
 #define TEST_EL2_SYNC_EXCEPTION 0
-#define UART_IRQ    33
 
 extern char ram_start[];
 extern char txt_start[];
@@ -52,6 +55,18 @@ static void test_el2_sync_exception()
 // extern struct guest guest_hello[];
 extern struct guest guest_xv6[];
 
+static struct vm_region xv6_regions[] = {
+    { .ipa = UARTBASE, .size = PAGE_SIZE, .type = VM_MEM_DEVICE },     /* uart pass through */
+};
+
+static struct vm_irq xv6_irqs[] = {
+    { .pirq = UART_IRQ, .virq = UART_IRQ },     /* console of the uart pass through */
+};
+
+static struct vm_virtio xv6_virtio[] = {
+    { .slot = 0, .device_id = VIRTIO_ID_BLOCK },    /* root disk, VIRTIO0 */
+};
+
 struct vmconfig xv6_vmcfg = {
     // .guest_img = &guest_hello[GUEST_IMAGE],
     .guest_img = &guest_xv6[GUEST_IMAGE],
@@ -60,6 +75,14 @@ struct vmconfig xv6_vmcfg = {
     .nvcpu = 4,
     .ram_size = 128*1024*1024,  /* 128M; Same with PHYSTOP in xv6 memlayout.h */
     .entrypoint = 0x40000000,   /* xv6's beginning phys addr, same with xv6's kernel.ld */
+    .regions = xv6_regions,
+    .nregions = sizeof(xv6_regions) / sizeof(xv6_regions[0]),
+    .irqs = xv6_irqs,
+    .nirqs = sizeof(xv6_irqs) / sizeof(xv6_irqs[0]),
+    .virtio = xv6_virtio,
+    .nvirtio = sizeof(xv6_virtio) / sizeof(xv6_virtio[0]),
+    .cpu_affinity = 0,          /* any pcpu */
+    .sched_weight = SCHED_WEIGHT_DEFAULT,
 };
 
 void enable_uart_irq_el2()
@@ -134,19 +157,36 @@ int vmm_init_primary(void)
 
     freq_init();
 
-    // setup_timer();  /* EL2下的timer还有些问题待调试, tick中断来了之后reload后下次再也进不去irq handler了 */
+    sched_init();
+
+    ramdisk_init();
+
+#if BENCH_MODE
+    bench_run_all("el2 mmu off");
+#endif
+
+    el2_mmu_init();
+
+#if BENCH_MODE
+    bench_run_all("el2 mmu on");
+#endif
 
     enable_uart_irq_el2();
 
     hcr_setup();
 
-    stage2_mmu_init();
+    vcpu_fpsimd_init();
 
-    ramdisk_init();
+    stage2_mmu_init();
 
     create_vm(&xv6_vmcfg);
 
-    enter_vcpu();
+    /* every pcpu runs the scheduler, the vcpus are spread over their run queues */
+    for (int i = 1; i < PCPU_NUM; ++i) {
+        psci_pcpu_on(i);
+    }
+
+    sched_start();
 
     /****************** Following is self debug ******************/
     daif_info();
@@ -177,6 +217,9 @@ int vmm_init_secondary(void)
 {
     // TODO: 根据mpidr设置从核的cpuid
     u64 sp;
+
+    el2_mmu_enable();
+
     asm volatile("mov %0, sp" : "=r"(sp));
     LOG_INFO("[vmm_init_secondary]: cpu=%d sp: 0x%x\n", cpuid(), sp);
 
@@ -187,9 +230,11 @@ int vmm_init_secondary(void)
 
     hcr_setup();
 
+    vcpu_fpsimd_init();
+
     stage2_mmu_init();
 
-    enter_vcpu();
+    sched_start();
 
     panic("[vmm_init_secondary]: should not be here!\n");
     return -1;
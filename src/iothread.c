@@ -0,0 +1,82 @@
+#include "iothread.h"
+#include "gic.h"
+#include "spinlock.h"
+#include "aarch64.h"
+
+/* FIFO of the work posted to a pcpu */
+struct io_queue {
+    spinlock_t      lock;
+    struct io_work  *head;
+    struct io_work  *tail;
+};
+
+static struct io_queue g_io_queue[PCPU_NUM_MAX];
+
+void io_work_init(struct io_work *work, void (*fn)(void *), void *arg, int pcpu)
+{
+    work->fn = fn;
+    work->arg = arg;
+    work->pcpu = pcpu;
+    work->queued = 0;
+    work->next = NULL;
+}
+
+/*
+ * Queue @work for its pcpu, from any pcpu. Work posted while it runs is
+ * queued again and runs once more, nothing posted is lost.
+ */
+void io_work_post(struct io_work *work)
+{
+    struct io_queue *q;
+    bool kick = false;
+
+    if (work->pcpu < 0) {
+        work->fn(work->arg);
+        return;
+    }
+
+    q = &g_io_queue[work->pcpu];
+    spin_lock(&q->lock);
+    if (!work->queued) {
+        work->queued = 1;
+        work->next = NULL;
+        if (q->tail) {
+            q->tail->next = work;
+        } else {
+            q->head = work;
+        }
+        q->tail = work;
+        kick = true;
+    }
+    spin_unlock(&q->lock);
+
+    /* on that pcpu itself it is taken as soon as the vcpu is entered again */
+    if (kick) {
+        gic_send_sgi(work->pcpu, IO_WORK_SGI);
+    }
+}
+
+/* IO_WORK_SGI: run everything posted to this pcpu so far */
+void io_work_run(void)
+{
+    struct io_queue *q = &g_io_queue[cpuid()];
+    struct io_work *work;
+
+    for (;;) {
+        spin_lock(&q->lock);
+        work = q->head;
+        if (work) {
+            q->head = work->next;
+            if (NULL == q->head) {
+                q->tail = NULL;
+            }
+            work->queued = 0;
+        }
+        spin_unlock(&q->lock);
+
+        if (NULL == work) {
+            break;
+        }
+        work->fn(work->arg);
+    }
+}
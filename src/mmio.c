@@ -5,39 +5,133 @@
 #include "mmio.h"
 #include "debug.h"
 
-#define MMIO_INFO_MAX  64
-
-struct mmio_info g_mmio_info[MMIO_INFO_MAX];
+static struct mmio_table g_mmio_tables[VM_MAX];
 spinlock_t g_mmio_lock = SPINLOCK_INITVAL;
 
-static struct mmio_info *alloc_mmio_info(struct mmio_info *prev)
+static struct mmio_table *mmio_table_get(struct vm *vm)
 {
+    if (NULL != vm->mmio) {
+        return vm->mmio;
+    }
+
     spin_lock(&g_mmio_lock);
-    for (int i = 0; i < MMIO_INFO_MAX; i++) {
-        if (g_mmio_info[i].size == 0) {
-            g_mmio_info[i].size = 1;
-            g_mmio_info[i].next = prev;
-            spin_unlock(&g_mmio_lock);
-            return &g_mmio_info[i];
+    for (int i = 0; i < VM_MAX; i++) {
+        if (g_mmio_tables[i].used == 0) {
+            g_mmio_tables[i].used = 1;
+            vm->mmio = &g_mmio_tables[i];
+            break;
         }
     }
     spin_unlock(&g_mmio_lock);
+
+    return vm->mmio;
+}
+
+/* region containing @ipa, NULL if none */
+static struct mmio_info *mmio_lookup(struct mmio_table *tbl, u64 ipa)
+{
+    int lo = 0, hi = tbl->nregions - 1;
+
+    /* last region with ipa_base <= ipa */
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (tbl->regions[mid].ipa_base <= ipa) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    if (hi < 0) {
+        return NULL;
+    }
+    struct mmio_info *mmio = &tbl->regions[hi];
+    return (ipa < mmio->ipa_base + mmio->size) ? mmio : NULL;
+}
+
+/* sub-handler of register @offset in @mmio, NULL if none */
+static const struct mmio_reg *mmio_reg_lookup(struct mmio_info *mmio, u64 offset)
+{
+    int lo = 0, hi = mmio->nregs - 1;
+
+    if (mmio->reg_stride) {
+        offset %= mmio->reg_stride;
+    }
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const struct mmio_reg *r = &mmio->regs[mid];
+        if (offset < r->offset) {
+            hi = mid - 1;
+        } else if (offset >= r->offset + r->size) {
+            lo = mid + 1;
+        } else {
+            return r;
+        }
+    }
     return NULL;
 }
 
-int mmio_emulate(struct vcpu *vcpu, int reg_idx, struct mmio_access *mmio_access)
+/* region of @ipa for @vcpu, per vcpu last hit cache first: device accesses
+ * come in bursts on the same region */
+static struct mmio_info *mmio_find(struct vcpu *vcpu, u64 ipa)
 {
-    struct mmio_info *mmio = vcpu->vm->mmio_list;
-    if (NULL == mmio) {
-        LOG_INFO("[mmio_emulate]: mmio list of vcpu(id=%d, vm=%s) is empty\n",
-               vcpu->cpuid, vcpu->vm->name);
-        return -1;
+    struct mmio_info *mmio = vcpu->mmio_last;
+
+    if (NULL != mmio && mmio->ipa_base <= ipa && ipa < mmio->ipa_base + mmio->size) {
+        return mmio;
+    }
+    if (NULL == vcpu->vm->mmio) {
+        return NULL;
+    }
+    mmio = mmio_lookup(vcpu->vm->mmio, ipa);
+    if (NULL != mmio) {
+        vcpu->mmio_last = mmio;
+    }
+    return mmio;
+}
+
+/*
+ * Fast exit path: only registers with a MMIO_REG_FAST sub-handler are
+ * emulated, @val points to the guest register value.
+ * Returns 1 if emulated, 0 if the access has to take the full exit path.
+ */
+int mmio_emulate_fast(struct vcpu *vcpu, u64 *val, struct mmio_access *mmio_access)
+{
+    struct mmio_info *mmio = mmio_find(vcpu, mmio_access->ipa);
+    if (NULL == mmio || mmio->nregs == 0) {
+        return 0;
+    }
+
+    u64 offset = mmio_access->ipa - mmio->ipa_base;
+    const struct mmio_reg *r = mmio_reg_lookup(mmio, offset);
+    if (NULL == r || !(r->flags & MMIO_REG_FAST)) {
+        return 0;
+    }
+    mmio_access->ctx = mmio->ctx;
+    vcpu->mmio_exit = mmio;
+
+    if (mmio_access->iss_wnr && NULL != r->write) {
+        return r->write(vcpu, offset, *val, mmio_access) == 0;
+    } else if (!mmio_access->iss_wnr && NULL != r->read) {
+        return r->read(vcpu, offset, val, mmio_access) == 0;
     }
+    return 0;
+}
 
+int mmio_emulate(struct vcpu *vcpu, int reg_idx, struct mmio_access *mmio_access)
+{
     u64 ipa = mmio_access->ipa;
     u64 *reg = NULL;
     u64 val = 0;
 
+    struct mmio_info *mmio = mmio_find(vcpu, ipa);
+    if (NULL == mmio) {
+        LOG_WARN("[mmio_emulate]: there is no mmio region that can match ipa(%x), vcpu(id=%d, vm=%s)\n",
+                 ipa, vcpu->cpuid, vcpu->vm->name);
+        return -1;
+    }
+
     if (reg_idx == 31) {
         val = 0;
     } else {
@@ -45,42 +139,99 @@ int mmio_emulate(struct vcpu *vcpu, int reg_idx, struct mmio_access *mmio_access
         val = *reg;
     }
 
-    while (mmio) {
-        if (mmio->ipa_base <= ipa && ipa < mmio->ipa_base+mmio->size) {
-            if (mmio_access->iss_wnr && NULL != mmio->write) {
-                return mmio->write(vcpu, ipa - mmio->ipa_base, val, mmio_access);
-            } else if (!mmio_access->iss_wnr && NULL != mmio->read) {
-                return mmio->read(vcpu, ipa - mmio->ipa_base, reg, mmio_access);
-            } else {
-                LOG_WARN("[mmio_emulate]: invalid\n");
-                return -1;
-            }
+    u64 offset = ipa - mmio->ipa_base;
+    mmio_access->ctx = mmio->ctx;
+    vcpu->mmio_exit = mmio;
+    mmio_read_t read = mmio->read;
+    mmio_write_t write = mmio->write;
+
+    if (mmio->nregs) {
+        const struct mmio_reg *r = mmio_reg_lookup(mmio, offset);
+        if (NULL != r) {
+            read = r->read ? r->read : read;
+            write = r->write ? r->write : write;
         }
-        mmio = mmio->next;
     }
 
-    LOG_WARN("[mmio_emulate]: there is no mmio region that can match ipa(%x)\n", ipa);
+    if (mmio_access->iss_wnr && NULL != write) {
+        return write(vcpu, offset, val, mmio_access);
+    } else if (!mmio_access->iss_wnr && NULL != read) {
+        return read(vcpu, offset, reg, mmio_access);
+    }
+
+    LOG_WARN("[mmio_emulate]: invalid\n");
     return -1;
 }
 
-int mmio_reg_handler(struct vm *vm, u64 ipa, u64 size,
-    int (*read)(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio),
-    int (*write)(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio))
+int mmio_reg_handler(struct vm *vm, u64 ipa, u64 size, mmio_read_t read, mmio_write_t write,
+                     void *ctx)
 {
     if (NULL == vm || size <= 0) {
         return -1;
     }
 
-    struct mmio_info *mmio_new = alloc_mmio_info(vm->mmio_list);
-    if (NULL == mmio_new) {
+    struct mmio_table *tbl = mmio_table_get(vm);
+    if (NULL == tbl || tbl->sealed || tbl->nregions >= MMIO_REGION_MAX) {
+        return -1;
+    }
+
+    /* keep the table sorted, overlapping regions are refused */
+    int pos = tbl->nregions;
+    while (pos > 0 && tbl->regions[pos - 1].ipa_base > ipa) {
+        pos--;
+    }
+    if ((pos > 0 && tbl->regions[pos - 1].ipa_base + tbl->regions[pos - 1].size > ipa) ||
+        (pos < tbl->nregions && ipa + size > tbl->regions[pos].ipa_base)) {
+        LOG_WARN("[mmio_reg_handler]: region(ipa=%p, size=%p) overlaps\n", ipa, size);
         return -1;
     }
-    vm->mmio_list = mmio_new;
+    for (int i = tbl->nregions; i > pos; i--) {
+        tbl->regions[i] = tbl->regions[i - 1];
+    }
 
+    struct mmio_info *mmio_new = &tbl->regions[pos];
     mmio_new->ipa_base = ipa;
     mmio_new->size = size;
     mmio_new->read = read;
     mmio_new->write = write;
+    mmio_new->ctx = ctx;
+    mmio_new->regs = NULL;
+    mmio_new->nregs = 0;
+    mmio_new->reg_stride = 0;
+    tbl->nregions++;
+
+    return 0;
+}
+
+/* attach register sub-handlers (sorted by offset) to the region registered at @ipa */
+int mmio_reg_subhandlers(struct vm *vm, u64 ipa, const struct mmio_reg *regs, int nregs,
+                         u64 reg_stride)
+{
+    if (NULL == vm || NULL == vm->mmio || vm->mmio->sealed) {
+        return -1;
+    }
+
+    struct mmio_info *mmio = mmio_lookup(vm->mmio, ipa);
+    if (NULL == mmio || mmio->ipa_base != ipa) {
+        return -1;
+    }
 
+    for (int i = 1; i < nregs; i++) {
+        if (regs[i].offset < regs[i - 1].offset + regs[i - 1].size) {
+            panic("[mmio_reg_subhandlers] regs not sorted");
+        }
+    }
+
+    mmio->regs = regs;
+    mmio->nregs = nregs;
+    mmio->reg_stride = reg_stride;
     return 0;
-}
\ No newline at end of file
+}
+
+/* no more regions after this, the vcpus of @vm may read the table without locking */
+void mmio_seal(struct vm *vm)
+{
+    if (NULL != vm->mmio) {
+        vm->mmio->sealed = 1;
+    }
+}
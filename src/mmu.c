@@ -2,11 +2,75 @@
 #include "page_alloc.h"
 #include "lib.h"
 #include "aarch64.h"
+#include "memmap.h"
+#include "cache.h"
 #include "debug.h"
 
-u64 *pagewalk(u64 *pgt, u64 va, int need_alloc) {
-    for(int level = 0; level < 3; level++) {
+/* EL2 stage 1 identity page table, shared by all cpus */
+static u64 *g_el2_pgt;
+
+struct pagemap_stat g_pagemap_stat;
+
+/* size mapped by one entry at @level */
+#define LEVEL_SIZE(level)   (1UL << (39 - (level) * 9))
+
+static inline int pte_is_block(u64 pte, int level)
+{
+    return level < 3 && (pte & PTE_VALID) && !(pte & PTE_TABLE);
+}
+
+/*
+ * Replace the level @level block descriptor *@pte, which maps @va, with a
+ * next level table mapping the same range with the same attributes.
+ * break-before-make: the block is invalidated and the TLBs flushed before the
+ * table is installed. Only stage2 tables are ever split, the owning VM's VMID
+ * must be loaded in VTTBR_EL2 (see vm_tlb_flush_range()).
+ */
+static void split_block(u64 *pte, int level)
+{
+    u64 *tbl = (u64 *)alloc_page();
+    if (!tbl)
+        panic("nomem");
+
+    u64 pa = PTE_PA(*pte);
+    u64 attr = *pte & PTE_ATTR_MASK;
+    u64 type = (level + 1 == 3) ? PTE_V : PTE_VALID;
+    u64 size = LEVEL_SIZE(level + 1);
+
+    for (u64 i = 0; i < PAGE_SIZE / sizeof(u64); ++i) {
+        tbl[i] = (pa + i * size) | attr | type;
+    }
+
+    *pte = 0;
+    dsb(ishst);
+    tlbi_vmid_is();
+    dsb(ish);
+    *pte = PTE_PA(tbl) | PTE_TABLE | PTE_VALID;
+    dsb(ishst);
+
+    g_pagemap_stat.tables++;
+    g_pagemap_stat.splits++;
+}
+
+/*
+ * walk down to the entry of @va at @target_level.
+ * need_alloc: missing tables are allocated and blocks above @target_level
+ *             are split;
+ * otherwise:  NULL if @va is unmapped, the block entry if @va is mapped by a
+ *             block above @target_level.
+ */
+static u64 *__pagewalk(u64 *pgt, u64 va, int target_level, int need_alloc) {
+    g_pagemap_stat.walks++;
+
+    for(int level = 0; level < target_level; level++) {
         u64 *pte = &pgt[PIDX(level, va)];
+
+        if (pte_is_block(*pte, level)) {
+            if (!need_alloc) {
+                return pte;
+            }
+            split_block(pte, level);
+        }
   
         if ( (*pte & PTE_VALID) && (*pte & PTE_TABLE) ) {
             pgt = (u64 *)PTE_PA(*pte);
@@ -14,16 +78,45 @@ u64 *pagewalk(u64 *pgt, u64 va, int need_alloc) {
             pgt = (u64 *)alloc_page();
             if (!pgt)
                 panic("nomem");
+            memset(pgt, 0, PAGE_SIZE);
   
             *pte = PTE_PA(pgt) | PTE_TABLE | PTE_VALID;
+            g_pagemap_stat.tables++;
         } else {
             /* pte already beed unmapped */
             return NULL;
         }
     }  
-    return &pgt[PIDX(3, va)];
+    return &pgt[PIDX(target_level, va)];
+}
+
+/* find the leaf (block or page) entry mapping @va and its level, NULL if unmapped */
+static u64 *__pagewalk_leaf(u64 *pgt, u64 va, int *level) {
+    for(int l = 0; l < 3; l++) {
+        u64 pte = pgt[PIDX(l, va)];
+
+        if (!(pte & PTE_VALID)) {
+            return NULL;
+        }
+        if (!(pte & PTE_TABLE)) {
+            *level = l;
+            return &pgt[PIDX(l, va)];
+        }
+        pgt = (u64 *)PTE_PA(pte);
+    }
+    *level = 3;
+    return (pgt[PIDX(3, va)] & PTE_VALID) ? &pgt[PIDX(3, va)] : NULL;
+}
+
+u64 *pagewalk(u64 *pgt, u64 va, int need_alloc) {
+    return __pagewalk(pgt, va, 3, need_alloc);
 }
   
+/*
+ * Map [va, va+size) to [pa, pa+size). Level 1 (1GB) and level 2 (2MB) block
+ * descriptors are used wherever va, pa and the remaining size are aligned,
+ * 4KB pages otherwise.
+ */
 void pagemap(u64 *pgt, u64 va, u64 pa, u64 size, u64 attr) {
     if (va % PAGE_SIZE != 0 || pa % PAGE_SIZE != 0 || size % PAGE_SIZE != 0) {
         panic("invalid pagemap");
@@ -31,42 +124,170 @@ void pagemap(u64 *pgt, u64 va, u64 pa, u64 size, u64 attr) {
 
     // LOG_INFO("[pagemap]: va = %p, pa = %p, size = %p\n", va, pa, size);
   
-    for(u64 p = 0; p < size; p += PAGE_SIZE, va += PAGE_SIZE, pa += PAGE_SIZE) {
-        u64 *pte = pagewalk(pgt, va, 1);
-        if(*pte & PTE_AF) {
+    while (size > 0) {
+        int level = 3;
+        u64 *pte;
+
+        for (int l = 1; l < 3; ++l) {
+            u64 bsize = LEVEL_SIZE(l);
+            if (va % bsize == 0 && pa % bsize == 0 && size >= bsize) {
+                level = l;
+                break;
+            }
+        }
+
+        pte = __pagewalk(pgt, va, level, 1);
+        if(*pte & PTE_VALID) {
             LOG_ERR("*pte = %p\n", *pte);
             panic("[pagemap]: this entry has been used");
         }
   
-        *pte = PTE_PA(pa) | S2PTE_AF | attr | PTE_V;
+        if (level == 3) {
+            *pte = PTE_PA(pa) | S2PTE_AF | attr | PTE_V;
+            g_pagemap_stat.pages++;
+        } else {
+            *pte = PTE_PA(pa) | S2PTE_AF | attr | PTE_VALID;
+            g_pagemap_stat.blocks[level]++;
+        }
+
+        va += LEVEL_SIZE(level);
+        pa += LEVEL_SIZE(level);
+        size -= LEVEL_SIZE(level);
     }
 }
   
+static bool table_is_empty(u64 *tbl)
+{
+    for (u64 i = 0; i < PAGE_SIZE / sizeof(u64); ++i) {
+        if (tbl[i] & PTE_VALID) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* number of pages above which flushing the whole VMID is cheaper */
+#define TLBI_IPA_MAX_PAGES  64
+
+/*
+ * Invalidate the stage2 TLB entries of [ipa, ipa+size) of the VMID loaded in
+ * VTTBR_EL2, on all cpus. TLBI by IPA only drops stage2-only entries,
+ * combined stage1+2 entries of the VMID must go too, hence the trailing
+ * VMALLE1IS.
+ */
+void s2_tlb_flush_range(u64 ipa, u64 size)
+{
+    dsb(ishst);
+    if (size / PAGE_SIZE > TLBI_IPA_MAX_PAGES) {
+        tlbi_vmid_is();
+    } else {
+        for (u64 off = 0; off < size; off += PAGE_SIZE) {
+            tlbi_ipa_is(ipa + off);
+        }
+        dsb(ish);
+        tlbi_stage1_is();
+    }
+    dsb(ish);
+}
+
+/* one leaf and the 3 tables above it at most */
+#define UNMAP_BATCH_MAX     32
+
+/* pages unlinked by pageunmap(), freed once no TLB nor walk can reach them */
+struct unmap_batch {
+    int n;
+    u64 pa[UNMAP_BATCH_MAX];
+    u64 npages[UNMAP_BATCH_MAX];
+};
+
+static void unmap_batch_add(struct unmap_batch *b, u64 pa, u64 npages)
+{
+    b->pa[b->n] = pa;
+    b->npages[b->n] = npages;
+    b->n++;
+}
+
+static void unmap_batch_free(struct unmap_batch *b, u64 ipa, u64 size)
+{
+    if (0 == b->n) {
+        return;
+    }
+    s2_tlb_flush_range(ipa, size);
+    for (int i = 0; i < b->n; ++i) {
+        free_pages(b->pa[i], b->npages[i]);
+    }
+    b->n = 0;
+}
+
+/*
+ * The level @level entry of @va was just cleared: unlink the tables left
+ * empty above it, so that the range can be mapped again with blocks.
+ */
+static void prune_tables(u64 *pgt, u64 va, int level, struct unmap_batch *b)
+{
+    for (int l = level - 1; l >= 0; --l) {
+        u64 *pte = __pagewalk(pgt, va, l, 0);
+        if (NULL == pte || !(*pte & PTE_VALID) || !(*pte & PTE_TABLE)) {
+            return;
+        }
+        u64 *tbl = (u64 *)PTE_PA(*pte);
+        if (!table_is_empty(tbl)) {
+            return;
+        }
+        *pte = 0;
+        unmap_batch_add(b, (u64)tbl, 1);
+    }
+}
+
+/*
+ * unmap and free [va, va+size), blocks only partly covered are split first
+ * and tables left empty are freed. Only stage2 tables are ever unmapped, the
+ * owning VM's VMID must be loaded in VTTBR_EL2: the pages are freed only
+ * after the TLBs of all cpus dropped them.
+ */
 void pageunmap(u64 *pgt, u64 va, u64 size) {
     if(va % PAGE_SIZE != 0 || size % PAGE_SIZE != 0)
         panic("invalid pageunmap");
   
-    for(u64 p = 0; p < size; p += PAGE_SIZE, va += PAGE_SIZE) {
-        u64 *pte = pagewalk(pgt, va, 0);
-        if(*pte == 0)
+    struct unmap_batch batch = { .n = 0 };
+    u64 start = va;
+    u64 end = va + size;
+    while (va < end) {
+        int level;
+        u64 *pte = __pagewalk_leaf(pgt, va, &level);
+        if(pte == NULL)
             panic("unmapped");
+
+        u64 bsize = LEVEL_SIZE(level);
+        if (level < 3 && (va % bsize != 0 || end - va < bsize)) {
+            split_block(pte, level);
+            continue;
+        }
   
-        u64 pa = PTE_PA(*pte);
-        free_page(pa);
+        unmap_batch_add(&batch, PTE_PA(*pte), bsize / PAGE_SIZE);
         *pte = 0;
+        prune_tables(pgt, va, level, &batch);
+        va += bsize;
+        if (batch.n > UNMAP_BATCH_MAX - 4) {
+            unmap_batch_free(&batch, start, va - start);
+            start = va;
+        }
     }
+    unmap_batch_free(&batch, start, va - start);
 }
 
 u64 ipa2pa(u64 *pgt, u64 ipa)
 {
+    int level;
+
     if (NULL == pgt) {
         return 0;
     }
-    u64 *pte = pagewalk(pgt, ipa, 0);
+    u64 *pte = __pagewalk_leaf(pgt, ipa, &level);
     if(!pte) {
         return 0;
     }
-    u32 off = ipa & (PAGE_SIZE - 1);
+    u64 off = ipa & (LEVEL_SIZE(level) - 1);
   
     return PTE_PA(*pte) + off;
 }
@@ -89,14 +310,85 @@ void stage2_mmu_init(void)
     read_sysreg(mmf, id_aa64mmfr0_el1);
     LOG_INFO("id_aa64mmfr0_el1.parange = %p\n", mmf & 0xf);
 
-    u64 vtcr = VTCR_T0SZ(20) | VTCR_SH0(0) | VTCR_SL0(2) |
+    /* stage2 table walks are inner shareable write-back, so they snoop the
+     * hypervisor's cached writes to the stage2 table */
+    u64 vtcr = VTCR_T0SZ(20) | VTCR_SH0(3) | VTCR_SL0(2) |
+               VTCR_IRGN0(1) | VTCR_ORGN0(1) |
                VTCR_TG0(0) | VTCR_NSW | VTCR_NSA | VTCR_PS(4);
     write_sysreg(vtcr_el2, vtcr);
     LOG_INFO("vtcr = %p\n", vtcr);
+  
+    isb();
 
-    /* 设置两种内存属性（DEVICE_nGnRnE、NORMAL_NC）到mair_el2中 */
-    u64 mair = (AI_DEVICE_nGnRnE << (8 * AI_DEVICE_nGnRnE_IDX)) | (AI_NORMAL_NC << (8 * AI_NORMAL_NC_IDX));
+    /* TLB content is unknown after reset, VMIDs are not flushed on switch */
+    asm volatile("tlbi alle1");
+    dsb(nsh);
+    isb();
+}
+
+/*
+ * Build the EL2 identity page table and turn on EL2's MMU and caches on the
+ * primary cpu. Without it every hypervisor access (vcpu context save, page
+ * walks, bitmap scans, ramdisk copies) is a non-cacheable access.
+ *
+ * - whole physical RAM (hypervisor image + page pool + guest RAM): Normal WB
+ * - GICD/GICR/UART/virtio: Device-nGnRnE, execute never
+ */
+void el2_mmu_init(void)
+{
+    g_el2_pgt = (u64 *)alloc_page();
+    if (NULL == g_el2_pgt) {
+        panic("[el2_mmu_init] no mem");
+    }
+    memset(g_el2_pgt, 0, PAGE_SIZE);
+
+    pagemap(g_el2_pgt, VMMBASE, VMMBASE, PHYSIZE,
+            PTE_NORMAL_WB | PTE_ISH | PTE_AP(1));
+
+    u64 dev_attr = PTE_DEVICE | PTE_AP(1) | PTE_XN;
+    pagemap(g_el2_pgt, GICDBASE, GICDBASE, GICDSIZE, dev_attr);
+    pagemap(g_el2_pgt, GICRBASE, GICRBASE, GICRSIZE, dev_attr);
+    pagemap(g_el2_pgt, UARTBASE, UARTBASE, PAGE_SIZE, dev_attr);
+    pagemap(g_el2_pgt, VIRTIO0, VIRTIO0, VIRTIO0_SIZE, dev_attr);
+
+    /* No cpu has its data cache on yet, so nothing dirty can be lost */
+    dcache_inval_all();
+
+    el2_mmu_enable();
+
+    LOG_INFO("[el2_mmu_init]: el2 pgt=%p, mmu and caches enabled\n", g_el2_pgt);
+}
+
+/* Turn on EL2's MMU with the table built by el2_mmu_init(), called on every cpu */
+void el2_mmu_enable(void)
+{
+    u64 mmf, sctlr;
+
+    if (cpuid() != 0) {
+        dcache_inval_local();
+    }
+
+    u64 mair = (AI_DEVICE_nGnRnE << (8 * AI_DEVICE_nGnRnE_IDX)) |
+               (AI_NORMAL_NC << (8 * AI_NORMAL_NC_IDX)) |
+               (AI_NORMAL_WB << (8 * AI_NORMAL_WB_IDX)) |
+               (AI_DEVICE_nGnRE << (8 * AI_DEVICE_nGnRE_IDX));
     write_sysreg(mair_el2, mair);
-  
+
+    /* PS: 52bit PA(0b110) needs 64KB granule or LPA2, cap to 48bit */
+    read_sysreg(mmf, id_aa64mmfr0_el1);
+    u64 parange = (mmf & 0xf) > 5 ? 5 : (mmf & 0xf);
+    u64 tcr = TCR_EL2_RES1 | TCR_T0SZ(16) | TCR_IRGN0(1) | TCR_ORGN0(1) |
+              TCR_SH0(3) | TCR_TG0(0) | TCR_EL2_PS(parange);
+    write_sysreg(tcr_el2, tcr);
+    write_sysreg(ttbr0_el2, g_el2_pgt);
+    isb();
+
+    asm volatile("tlbi alle2");
+    dsb(ish);
+    isb();
+
+    read_sysreg(sctlr, sctlr_el2);
+    sctlr |= SCTLR_EL2_M | SCTLR_EL2_C | SCTLR_EL2_I;
+    write_sysreg(sctlr_el2, sctlr);
     isb();
 }
@@ -43,10 +43,11 @@ int page_allocator_init(unsigned long *bitmap_buf, unsigned long total_pages, un
 /**
  * __find_free_range - 在位图中查找连续空闲页
  * @nr_pages: 需要的连续页数
+ * @align: 起始物理页帧号需要按 @align 个页对齐
  *
  * 返回：找到的起始页号，失败返回 -1ULL
  */
-static pfn_t __find_free_range(unsigned long nr_pages)
+static pfn_t __find_free_range(unsigned long nr_pages, unsigned long align)
 {
     pfn_t start = 0;
     unsigned long cnt = 0;
@@ -56,6 +57,9 @@ static pfn_t __find_free_range(unsigned long nr_pages)
     for (pfn_t i = g_allocator.last_alloc; i < total; i++) {
         if (!test_bit(g_allocator.bitmap, i)) {
             if (cnt == 0) {
+                if ((g_allocator.base_pfn + i) % align != 0) {
+                    continue;
+                }
                 start = i;
             }
             if (++cnt >= nr_pages) {
@@ -66,10 +70,14 @@ static pfn_t __find_free_range(unsigned long nr_pages)
         }
     }
 
-    /* 回绕到起始位置继续搜索 */
+    /* 回绕到起始位置继续搜索, 跨越回绕点的区间并不连续 */
+    cnt = 0;
     for (pfn_t i = 0; i < g_allocator.last_alloc; i++) {
         if (!test_bit(g_allocator.bitmap, i)) {
             if (cnt == 0) {
+                if ((g_allocator.base_pfn + i) % align != 0) {
+                    continue;
+                }
                 start = i;
             }
             if (++cnt >= nr_pages) {
@@ -84,17 +92,17 @@ static pfn_t __find_free_range(unsigned long nr_pages)
 }
 
 
-unsigned long alloc_pages(unsigned long nr_pages)
+unsigned long alloc_pages_aligned(unsigned long nr_pages, unsigned long align)
 {
     pfn_t start_page;
 
-    if (nr_pages == 0 || nr_pages > g_allocator.total_pages) {
+    if (nr_pages == 0 || nr_pages > g_allocator.total_pages || align == 0) {
         return -1ULL;
     }
 
     spin_lock(&g_allocator.lock);
     
-    start_page = __find_free_range(nr_pages);
+    start_page = __find_free_range(nr_pages, align);
     if (start_page == -1ULL) {
         spin_unlock(&g_allocator.lock);
         return -1ULL;
@@ -141,6 +149,11 @@ int free_pages(unsigned long phyaddr, unsigned long nr_pages)
     return 0;
 }
 
+unsigned long alloc_pages(unsigned long nr_pages)
+{
+    return alloc_pages_aligned(nr_pages, 1);
+}
+
 unsigned long alloc_page(void)
 {
     return alloc_pages(1);
@@ -1,26 +1,46 @@
 #include "psci.h"
+#include "cache.h"
 #include "debug.h"
 
 extern void _start(void);
+extern char txt_start[];
+extern char ram_start[];
 
+/* power on physical cpu @pcpu into the hypervisor's secondary entry */
+u64 psci_pcpu_on(u64 pcpu)
+{
+    /* The target cpu starts with its MMU and caches off, push everything it
+     * reads before el2_mmu_enable() (stacks table, vcpus, page table base)
+     * out of our cache. */
+    dcache_clean_range((u64)txt_start, (u64)ram_start - (u64)txt_start);
+
+    return psci_call(PSCI_CPU_ON, pcpu, (u64)_start, 0);
+}
+
+/* the pcpus are all up already, the vcpu only becomes runnable on its run queue */
 static long int psci_cpu_on(struct vcpu *vcpu, u64 x1, u64 x2, u64 x3)
 {
     u64 target_cpu = x1;
     u64 entry_addr = x2;
 
-    LOG_INFO("[psci_cpu_on]: Bring up cpu %d, entry_addr=%p\n", target_cpu, entry_addr);
+    LOG_INFO("[psci_cpu_on]: Bring up vcpu %d, entry_addr=%p\n", target_cpu, entry_addr);
 
-    // TODO: need add vcpu to pcpu, if support more than one vm!
+    if (target_cpu >= vcpu->vm->nvcpu || NULL == vcpu->vm->vcpus[target_cpu]) {
+        return PSCI_E_INVALID_PARAMS;
+    }
     struct vcpu *target = vcpu->vm->vcpus[target_cpu];
+    if (target->state != CREATED) {
+        return PSCI_E_ALREADY_ON;
+    }
 
     target->reg.elr_el2 = entry_addr;
 
     vcpu_ready(target);
 
-    return psci_call(PSCI_CPU_ON, target_cpu, (u64)_start, 0);
+    return PSCI_E_SUCCESS;
 }
 
-static long int psci_features_handler(u32 smc_fid)
+long int psci_features_handler(u32 smc_fid)
 {
     long int ret = PSCI_E_NOT_SUPPORTED;
 
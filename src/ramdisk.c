@@ -1,9 +1,11 @@
 #include "ramdisk.h"
+#include "page_alloc.h"
+#include "default_config.h"
 #include "lib.h"
 #include "debug.h"
 
-static u64 ramdisk_start;
-static u64 ramdisk_size;
+/* the embedded fs image, the initial content of every disk */
+static struct ramdisk g_fsimg;
 
 extern char _binary_guest_xv6_fs_img_start[];
 extern char _binary_guest_xv6_fs_img_size[];
@@ -11,31 +13,59 @@ extern char _binary_guest_xv6_fs_img_end[];
 
 void ramdisk_init(void)
 {
-    ramdisk_start = (u64)_binary_guest_xv6_fs_img_start;
-    ramdisk_size = (u64)_binary_guest_xv6_fs_img_size;
+    g_fsimg.base = (u64)_binary_guest_xv6_fs_img_start;
+    g_fsimg.size = (u64)_binary_guest_xv6_fs_img_size;
 }
 
-int ramdisk_rw(u64 blk_num, u64 buf_addr, u16 is_write)
+/* a private copy of the fs image into @rd, -1 if there is no image or no memory */
+int ramdisk_create(struct ramdisk *rd)
 {
-    /* TODO:
-     * Need lock or not ??? (upper app ensure the coherence)
-     *
-     * Maybe unnecessary to lock, because virtio_blk_process_desc has already
-     * been protected by g_vq.virtq_lock in virtio_blk_req_handler.
-     */
-    if (blk_num >= FSIMG_SIZE) {
-        LOG_ERR("[ramdisk_rw] ERROR !!! invalid blockno(%d)\n", blk_num);
+    u64 npages = (g_fsimg.size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    if (0 == g_fsimg.size) {
+        LOG_ERR("[ramdisk_create] ERROR !!! no disk image\n");
+        return -1;
+    }
+    rd->base = alloc_pages(npages);
+    if (-1ULL == rd->base) {
+        LOG_ERR("[ramdisk_create] ERROR !!! no memory for %d pages\n", npages);
         return -1;
     }
+    rd->size = g_fsimg.size;
+    memcpy((void *)rd->base, (void *)g_fsimg.base, rd->size);
+    return 0;
+}
 
-    // TODO: check whether buf_addr is valid ?
+/*
+ * Copy @len bytes between @rd at byte @offset and @buf_addr. No lock:
+ * the queues of a device are served on different pcpus at the same time,
+ * only the requests of one queue are ordered, by its lock. As on a real disk
+ * the driver must not have overlapping writes (or a read overlapping a
+ * write) in flight, the bytes they share are undefined if it does.
+ */
+int ramdisk_access(struct ramdisk *rd, u64 offset, u64 buf_addr, u64 len, u16 is_write)
+{
+    if (offset > rd->size || len > rd->size - offset) {
+        LOG_ERR("[ramdisk_access] ERROR !!! invalid range offset(%p) len(%d)\n", offset, len);
+        return -1;
+    }
 
-    u8 *disk_addr = (u8*)(ramdisk_start + blk_num * BLOCK_SIZE);
+    u8 *disk_addr = (u8*)(rd->base + offset);
     if (is_write) {
-        memmove(disk_addr, (void*)buf_addr, BLOCK_SIZE);
+        memmove(disk_addr, (void*)buf_addr, len);
     } else {
-        memmove((void*)buf_addr, disk_addr, BLOCK_SIZE);
+        memmove((void*)buf_addr, disk_addr, len);
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+/* block @blk_num of the embedded image itself, no device involved */
+int ramdisk_rw(u64 blk_num, u64 buf_addr, u16 is_write)
+{
+    if (blk_num >= FSIMG_SIZE) {
+        LOG_ERR("[ramdisk_rw] ERROR !!! invalid blockno(%d)\n", blk_num);
+        return -1;
+    }
+    return ramdisk_access(&g_fsimg, blk_num * BLOCK_SIZE, buf_addr, BLOCK_SIZE, is_write);
+}
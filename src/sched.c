@@ -0,0 +1,400 @@
+#include "sched.h"
+#include "vcpu.h"
+#include "vm.h"
+#include "vgic.h"
+#include "gic.h"
+#include "timer.h"
+#include "sysreg.h"
+#include "spinlock.h"
+#include "aarch64.h"
+#include "exit_stat.h"
+#include "iothread.h"
+#include "debug.h"
+
+void eret_vm(void);
+
+struct pcpu_rq {
+    spinlock_t  lock;
+    struct vcpu *vcpus[VCPU_POOL_MAX];  /* vcpus placed on this pcpu */
+    int         nvcpu;
+    struct vcpu *curr;          /* loaded vcpu, NULL while idle */
+    struct vcpu *last;          /* last loaded vcpu, takes the irqs that arrive while idle */
+    u64         slice_start;    /* syscount when curr was last accounted */
+    u64         min_vruntime;   /* monotonic, floor for waking vcpus */
+    int         need_resched;   /* set by wakeups, the slice timer and SCHED_IPI_SGI */
+    struct timer slice_timer;   /* end of curr's slice, armed while others wait */
+    int         online;         /* pcpu entered sched_start() */
+    u64         nr_switch;
+};
+
+static struct pcpu_rq g_rq[PCPU_NUM_MAX];
+static spinlock_t g_sched_lock;     /* vcpu placement */
+static u64 g_slice_ticks;
+
+static inline struct pcpu_rq *this_rq(void)
+{
+    return &g_rq[cpuid()];
+}
+
+static inline bool vcpu_runnable(struct vcpu *vcpu)
+{
+    return vcpu->state == READY || vcpu->state == RUNNING;
+}
+
+void sched_init(void)
+{
+    spinlock_init(&g_sched_lock);
+    for (int i = 0; i < PCPU_NUM_MAX; ++i) {
+        spinlock_init(&g_rq[i].lock);
+    }
+    g_slice_ticks = nstime_to_count(SCHED_SLICE_NS);
+}
+
+/* a blocked vcpu is woken by its own timer when its virtual timer expires */
+static void vtimer_fn(void *arg)
+{
+    sched_wakeup(arg);
+}
+
+/* place @vcpu on the least loaded pcpu of @affinity (0: any pcpu) */
+void sched_vcpu_attach(struct vcpu *vcpu, u64 affinity, u32 weight)
+{
+    struct pcpu_rq *rq;
+    int best = -1;
+
+    if (0 == affinity) {
+        affinity = (1UL << PCPU_NUM) - 1;
+    }
+
+    spin_lock(&g_sched_lock);
+    for (int i = 0; i < PCPU_NUM; ++i) {
+        if ((affinity & (1UL << i)) && (best < 0 || g_rq[i].nvcpu < g_rq[best].nvcpu)) {
+            best = i;
+        }
+    }
+    if (best < 0 || g_rq[best].nvcpu == VCPU_POOL_MAX) {
+        panic("[sched_vcpu_attach]: no pcpu for vcpu %d, affinity=0x%x\n", vcpu->cpuid, affinity);
+    }
+
+    rq = &g_rq[best];
+    spin_lock(&rq->lock);
+    vcpu->pcpu = best;
+    vcpu->affinity = affinity;
+    vcpu->weight = weight ? weight : SCHED_WEIGHT_DEFAULT;
+    vcpu->vruntime = rq->min_vruntime;
+    timer_setup(&vcpu->vtimer, vtimer_fn, vcpu);
+    rq->vcpus[rq->nvcpu++] = vcpu;
+    spin_unlock(&rq->lock);
+    spin_unlock(&g_sched_lock);
+
+    LOG_INFO("[sched]: vm %s vcpu %d -> pcpu %d, weight %d\n",
+             vcpu->vm->name, vcpu->cpuid, best, vcpu->weight);
+}
+
+/* deadline of the virtual timer of a vcpu that is not loaded, in physical counts */
+static u64 vtimer_deadline(struct vcpu *vcpu)
+{
+    u64 ctl = vcpu->sys.cntv_ctl_el0;
+
+    if (!(ctl & CNTV_CTL_ENABLE) || (ctl & CNTV_CTL_IMASK)) {
+        return ~0UL;
+    }
+    return vcpu->sys.cntv_cval_el0 + vcpu->sys.cntvoff_el2;
+}
+
+static void sched_wakeup_locked(struct pcpu_rq *rq, struct vcpu *vcpu)
+{
+    if (vcpu->state != BLOCKED && vcpu->state != CREATED) {
+        return;
+    }
+    /* a long sleeper gets at most one slice of credit, it can not monopolise the pcpu */
+    if (rq->min_vruntime > g_slice_ticks && vcpu->vruntime < rq->min_vruntime - g_slice_ticks) {
+        vcpu->vruntime = rq->min_vruntime - g_slice_ticks;
+    }
+    vcpu->state = READY;
+    rq->need_resched = 1;
+}
+
+void sched_wakeup(struct vcpu *vcpu)
+{
+    struct pcpu_rq *rq = &g_rq[vcpu->pcpu];
+
+    spin_lock(&rq->lock);
+    sched_wakeup_locked(rq, vcpu);
+    spin_unlock(&rq->lock);
+
+    if (vcpu->pcpu != cpuid() && rq->online) {
+        gic_send_sgi(vcpu->pcpu, SCHED_IPI_SGI);
+    }
+}
+
+/* SCHED_IPI_SGI: the run queue of this pcpu needs a look */
+void sched_ipi(void)
+{
+    this_rq()->need_resched = 1;
+}
+
+/* charge the run time since the last accounting to curr */
+static void sched_account(struct pcpu_rq *rq, u64 now)
+{
+    struct vcpu *curr = rq->curr;
+    u64 min = ~0UL;
+
+    if (curr) {
+        curr->vruntime += (now - rq->slice_start) * SCHED_WEIGHT_DEFAULT / curr->weight;
+    }
+    rq->slice_start = now;
+
+    for (int i = 0; i < rq->nvcpu; ++i) {
+        if (vcpu_runnable(rq->vcpus[i]) && rq->vcpus[i]->vruntime < min) {
+            min = rq->vcpus[i]->vruntime;
+        }
+    }
+    if (min != ~0UL && min > rq->min_vruntime) {
+        rq->min_vruntime = min;
+    }
+}
+
+/* lowest vruntime wins, curr keeps the pcpu on a tie; wakes blocked vcpus that are due */
+static struct vcpu *pick_next(struct pcpu_rq *rq, u64 now)
+{
+    struct vcpu *next = NULL;
+
+    if (rq->curr && vcpu_runnable(rq->curr)) {
+        next = rq->curr;
+    }
+    for (int i = 0; i < rq->nvcpu; ++i) {
+        struct vcpu *v = rq->vcpus[i];
+        if (v->state == BLOCKED && (vgic_has_pending(v) || vtimer_deadline(v) <= now)) {
+            sched_wakeup_locked(rq, v);
+        }
+        if (v->state == READY && (NULL == next || v->vruntime < next->vruntime)) {
+            next = v;
+        }
+    }
+    return next;
+}
+
+static void slice_timer_fn(void *arg)
+{
+    struct pcpu_rq *rq = arg;
+    rq->need_resched = 1;
+}
+
+/* end of curr's slice, only if someone is waiting for the pcpu */
+static void sched_arm_timer(struct pcpu_rq *rq)
+{
+    int waiting = 0;
+
+    for (int i = 0; i < rq->nvcpu; ++i) {
+        if (rq->vcpus[i]->state == READY) {
+            waiting++;
+        }
+    }
+    if (rq->curr && waiting) {
+        timer_mod(&rq->slice_timer, rq->slice_start + g_slice_ticks);
+    } else {
+        timer_del(&rq->slice_timer);
+    }
+}
+
+/* nothing to run: wait for an irq with the run queue unlocked */
+static struct vcpu *sched_idle(struct pcpu_rq *rq)
+{
+    struct vcpu *next;
+
+    rq->curr = NULL;
+    while (NULL == (next = pick_next(rq, get_syscount()))) {
+        sched_arm_timer(rq);
+        spin_unlock(&rq->lock);
+        dsb(sy);
+        wfi();
+        vcpu_irq_forward(rq->last);
+        spin_lock(&rq->lock);
+    }
+    return next;
+}
+
+static void halt_end(struct vcpu *vcpu);
+
+/*
+ * Pick the vcpu to run next on this pcpu and load it, going idle if there is
+ * none. Called with rq->lock held at the end of an exit: the exception return
+ * (eret_vm) then enters whatever vcpu tpidr_el2 points to.
+ */
+static void __schedule(struct pcpu_rq *rq)
+{
+    struct vcpu *prev = rq->curr;
+    struct vcpu *next;
+    u64 now = get_syscount();
+    bool saved = false;
+
+    rq->need_resched = 0;
+    sched_account(rq, now);
+
+    /* pick_next() judges a blocked vcpu by its saved LRs and timer */
+    if (prev && prev->state == BLOCKED) {
+        vcpu_put(prev);
+        saved = true;
+        if (vtimer_deadline(prev) != ~0UL) {
+            timer_mod(&prev->vtimer, vtimer_deadline(prev));
+        }
+    }
+    next = pick_next(rq, now);
+
+    if (next != prev || saved) {
+        if (prev && !saved) {
+            vcpu_put(prev);
+            prev->state = READY;
+        }
+        if (NULL == next) {
+            next = sched_idle(rq);
+            rq->slice_start = get_syscount();
+        }
+        timer_del(&next->vtimer);
+        vcpu_load(next);
+        rq->curr = next;
+        rq->last = next;
+        rq->nr_switch++;
+    }
+
+    if (next->halt_start) {
+        halt_end(next);
+    }
+    sched_arm_timer(rq);
+}
+
+/* act on need_resched at the end of an exit */
+void sched_check(void)
+{
+    struct pcpu_rq *rq = this_rq();
+
+    if (!rq->need_resched) {
+        return;
+    }
+    spin_lock(&rq->lock);
+    __schedule(rq);
+    spin_unlock(&rq->lock);
+}
+
+/* first entry of a pcpu into the guests, never returns */
+void sched_start(void)
+{
+    struct pcpu_rq *rq = this_rq();
+    struct vcpu *next;
+
+    hyp_timer_init();
+    timer_setup(&rq->slice_timer, slice_timer_fn, rq);
+    gic_irq_enable(SCHED_IPI_SGI);
+    gic_irq_enable(IO_WORK_SGI);
+
+    spin_lock(&rq->lock);
+    rq->online = 1;
+    next = sched_idle(rq);
+    rq->slice_start = get_syscount();
+    timer_del(&next->vtimer);
+    vcpu_load(next);
+    rq->curr = next;
+    rq->last = next;
+    sched_arm_timer(rq);
+    spin_unlock(&rq->lock);
+
+    LOG_TRACE("enter vm(%s)'s vcpu %d on pcpu %d\n", next->vm->name, next->cpuid, cpuid());
+
+    eret_vm();
+}
+
+/* grow/shrink the polling window after a halt that had to block for @block_ns */
+static void halt_poll_adjust(struct vcpu *vcpu, u64 block_ns)
+{
+    u64 poll_ns = vcpu->halt_poll_ns;
+
+    if (block_ns > WFI_POLL_TIMEOUT_NS_MAX) {
+        /* long idle, polling only burnt the pcpu */
+        poll_ns /= 2;
+        if (poll_ns < WFI_POLL_TIMEOUT_NS) {
+            poll_ns = 0;
+        }
+    } else if (poll_ns < block_ns) {
+        /* short idle, a bigger window would have caught the wakeup */
+        poll_ns = poll_ns ? poll_ns * 2 : WFI_POLL_TIMEOUT_NS;
+        if (poll_ns > WFI_POLL_TIMEOUT_NS_MAX) {
+            poll_ns = WFI_POLL_TIMEOUT_NS_MAX;
+        }
+    }
+
+    vcpu->halt_poll_ns = poll_ns;
+}
+
+/* @vcpu is about to run again after a halt that blocked */
+static void halt_end(struct vcpu *vcpu)
+{
+    u64 now = get_syscount();
+
+    exit_stat_add(&vcpu->stats.halt[HALT_BLOCK], now - vcpu->halt_block);
+    halt_poll_adjust(vcpu, count_to_time_ns(now - vcpu->halt_start));
+    vcpu->halt_start = 0;
+}
+
+/* a physical irq is pending at EL2 (PSTATE.I is masked in the exit path) */
+static inline bool pirq_pending(void)
+{
+    u64 isr;
+    read_sysreg(isr, isr_el1);
+    return (isr & ISR_EL1_I) != 0;
+}
+
+static bool rq_has_waiting(struct pcpu_rq *rq)
+{
+    for (int i = 0; i < rq->nvcpu; ++i) {
+        if (rq->vcpus[i]->state == READY) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * WFI of the loaded @vcpu: poll for vcpu->halt_poll_ns, then give the pcpu to
+ * another runnable vcpu, or idle it in wfi until a vIRQ arrives. PSTATE.I
+ * stays masked at EL2: a physical IRQ still ends the wfi and is forwarded
+ * here exactly like lower_el_irq_handler() would have done.
+ */
+void vcpu_halt(struct vcpu *vcpu)
+{
+    struct pcpu_rq *rq = this_rq();
+    u64 now, end;
+
+    vcpu->halt_start = get_syscount();
+    end = vcpu->halt_start + nstime_to_count(vcpu->halt_poll_ns);
+    while (!deadline_reached(end) && !rq->need_resched) {
+        if (pirq_pending()) {
+            vcpu_irq_forward(vcpu);
+        }
+        if (gic_has_pending_lr()) {
+            exit_stat_add(&vcpu->stats.halt[HALT_POLL_OK], get_syscount() - vcpu->halt_start);
+            vcpu->halt_start = 0;
+            return;
+        }
+    }
+    now = get_syscount();
+    if (vcpu->halt_poll_ns) {
+        exit_stat_add(&vcpu->stats.halt[HALT_POLL_FAIL], now - vcpu->halt_start);
+    }
+    vcpu->halt_block = now;
+
+    while (!gic_has_pending_lr()) {
+        if (rq->need_resched || rq_has_waiting(rq)) {
+            spin_lock(&rq->lock);
+            vcpu->state = BLOCKED;
+            __schedule(rq);
+            spin_unlock(&rq->lock);
+            return;
+        }
+        dsb(sy);
+        wfi();
+        vcpu_irq_forward(vcpu);
+    }
+
+    halt_end(vcpu);
+}
@@ -2,111 +2,271 @@
 #include "aarch64.h"
 #include "gic.h"
 #include "types.h"
+#include "sysreg.h"
+#include "spinlock.h"
+#include "default_config.h"
 #include "debug.h"
 
-#define PHYSICAL_TIMER_IRQ  30
-#define VIRTUAL_TIMER_IRQ   27
+struct clocksource g_clocksource;
 
-#define CNTV_CTL_ENABLE   (1<<0)
-#define CNTV_CTL_IMASK    (1<<1)
-#define CNTV_CTL_ISTATUS  (1<<2)
+/*
+ * mult/shift with x * mult >> shift == x * @to / @from, the largest shift
+ * that keeps mult below 2^32. @to must fit in 32 bits.
+ */
+static void clock_calc_mult_shift(u64 from, u64 to, u32 *mult, u32 *shift)
+{
+    u32 sft = 32;
+    u64 m;
+
+    for (;;) {
+        m = ((to << sft) + from / 2) / from;
+        if (m >> 32 == 0 || sft == 0) {
+            break;
+        }
+        sft--;
+    }
+    *mult = (u32)m;
+    *shift = sft;
+}
+
+/* EL2 physical timer of a pcpu and the timers waiting for it */
+struct timer_base {
+    spinlock_t      lock;
+    struct timer    *heap[TIMER_HEAP_MAX];  /* min-heap on expires */
+    int             n;
+    u64             armed;      /* CNTHP_CVAL_EL2, ~0 while the timer is off */
+    struct timer    pool[TIMER_POOL_MAX];
+};
 
-static u64 g_freq;
+static struct timer_base g_timer_base[PCPU_NUM_MAX];
 
-static u64 do_muldiv64(u64 a, u32 b, u32 c)
+static inline struct timer_base *this_base(void)
 {
-	union {
-		u64 ll;
-		struct {
-			u32 low, high;
-		} l;
-	} u, res;
-	u64 rl, rh;
+    return &g_timer_base[cpuid()];
+}
 
-	u.ll = a;
-	rl = (u64)u.l.low * (u64)b;
-	rh = (u64)u.l.high * (u64)b;
-	rh += (rl >> 32);
+/* fire HYP_TIMER_IRQ once the system counter reaches @cval */
+static void hyp_timer_arm(u64 cval)
+{
+    write_sysreg(cnthp_cval_el2, cval);
+    write_sysreg(cnthp_ctl_el2, CNTV_CTL_ENABLE);
+    isb();
+}
 
-	res.l.high = (u32)(rh / c);
+/* the timer interrupt is level sensitive, disabling the timer also deasserts it */
+static void hyp_timer_cancel(void)
+{
+    write_sysreg(cnthp_ctl_el2, 0);
+    isb();
+}
 
-	rh = (rh % c) << 32;
-	rl = rl & 0xffffffffUL;
-	res.l.low = (u32)((rh + rl) / c);
+/* per pcpu, the timer stays disarmed until the first timer_mod() */
+void hyp_timer_init(void)
+{
+    struct timer_base *base = this_base();
 
-	return res.ll;
+    spinlock_init(&base->lock);
+    base->n = 0;
+    base->armed = ~0UL;
+    hyp_timer_cancel();
+    gic_irq_enable(HYP_TIMER_IRQ);
 }
 
-/** 
- * @brief: do the caculation abort (a*b)/c 
- */
-static u64 muldiv64(u64 a, u32 b, u32 c)
+static void heap_set(struct timer_base *base, int i, struct timer *t)
 {
-	u64 ret;
+    base->heap[i] = t;
+    __atomic_store_n(&t->idx, i, __ATOMIC_RELEASE);
+}
 
-	if (c != 0U) {
-		ret = do_muldiv64(a, b, c);
-	} else {
-		LOG_WARN("[muldiv64]: Warning c=0, return 0\n");
-		ret = 0UL;
-	}
+static void heap_sift_up(struct timer_base *base, int i)
+{
+    struct timer *t = base->heap[i];
 
-	return ret;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (base->heap[parent]->expires <= t->expires) {
+            break;
+        }
+        heap_set(base, i, base->heap[parent]);
+        i = parent;
+    }
+    heap_set(base, i, t);
 }
 
-/** 
- * @brief: Convert nanosecond time to system count
- */
-u64 nstime_to_count(u64 nstime)
+static void heap_sift_down(struct timer_base *base, int i)
 {
-	return muldiv64(nstime, g_freq, NS_PER_SECOND);
+    struct timer *t = base->heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= base->n) {
+            break;
+        }
+        if (child + 1 < base->n && base->heap[child + 1]->expires < base->heap[child]->expires) {
+            child++;
+        }
+        if (t->expires <= base->heap[child]->expires) {
+            break;
+        }
+        heap_set(base, i, base->heap[child]);
+        i = child;
+    }
+    heap_set(base, i, t);
 }
 
-/** 
- * @brief: Convert system count to nanosecond time
- */
-u64 count_to_time_ns(u64 count)
+static void heap_remove(struct timer_base *base, struct timer *t)
 {
-	return muldiv64(count, NS_PER_SECOND, g_freq);
+    int i = t->idx;
+    struct timer *last = base->heap[--base->n];
+
+    __atomic_store_n(&t->idx, -1, __ATOMIC_RELEASE);
+    if (last == t) {
+        return;
+    }
+    heap_set(base, i, last);
+    heap_sift_up(base, i);
+    heap_sift_down(base, last->idx);
 }
 
-void enable_timer() {
-  	u64 c;
-  	read_sysreg(c, cntp_ctl_el0);
-  	c |= CNTV_CTL_ENABLE;
-  	c &= ~CNTV_CTL_IMASK;
-  	write_sysreg(cntp_ctl_el0, c);
+/* program the EL2 timer of this pcpu for its earliest timer, with base->lock held */
+static void timer_reprogram(struct timer_base *base)
+{
+    u64 next = base->n ? base->heap[0]->expires : ~0UL;
+
+    if (next == base->armed) {
+        return;
+    }
+    if (next == ~0UL) {
+        hyp_timer_cancel();
+    } else {
+        hyp_timer_arm(next);
+    }
+    base->armed = next;
 }
 
-void disable_timer() {
-    u64 c;
-  	read_sysreg(c, cntp_ctl_el0);
-  	c &= ~CNTV_CTL_ENABLE;
-  	c |= CNTV_CTL_IMASK;
-  	write_sysreg(cntp_ctl_el0, c);
+void timer_setup(struct timer *t, timer_fn_t fn, void *arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+    t->cpu = 0;
+    t->idx = -1;
+    t->used = 0;
 }
 
-void reload_timer() {
-    write_sysreg(cntp_tval_el0, g_freq/10000);    // 0.1毫秒 (100微秒)
-    // write_sysreg(cntp_tval_el0, g_freq/100);
+/*
+ * Fire @t at syscount @expires on this pcpu, moving it if it is pending
+ * already. Re-arming a pending timer of this pcpu is a sift in the heap.
+ */
+void timer_mod(struct timer *t, u64 expires)
+{
+    struct timer_base *base = this_base();
+
+    if (timer_pending(t) && t->cpu != cpuid()) {
+        timer_del(t);
+    }
+
+    spin_lock(&base->lock);
+    if (timer_pending(t)) {
+        t->expires = expires;
+        heap_sift_up(base, t->idx);
+        heap_sift_down(base, t->idx);
+    } else {
+        if (base->n == TIMER_HEAP_MAX) {
+            spin_unlock(&base->lock);
+            panic("[timer_mod] timer heap full");
+        }
+        t->expires = expires;
+        t->cpu = cpuid();
+        heap_set(base, base->n, t);
+        heap_sift_up(base, base->n++);
+    }
+    timer_reprogram(base);
+    spin_unlock(&base->lock);
 }
 
-// Use physical timer instead of virtual timer
-void setup_timer()
+/*
+ * From any pcpu. Another pcpu's EL2 timer can not be reprogrammed from here,
+ * it may still fire once for nothing.
+ */
+void timer_del(struct timer *t)
 {
-    // enable tick irq
-    gic_irq_enable(PHYSICAL_TIMER_IRQ);
-    // gic_irq_enable(VIRTUAL_TIMER_IRQ);
+    struct timer_base *base;
 
-    read_sysreg(g_freq, cntfrq_el0);
-    LOG_TRACE("[setup_timer]: g_freq=%u\n", g_freq);
-    disable_timer();
-    reload_timer();
-    enable_timer();
+    if (!timer_pending(t)) {
+        return;
+    }
+    base = &g_timer_base[t->cpu];
+    spin_lock(&base->lock);
+    if (timer_pending(t)) {
+        heap_remove(base, t);
+        if (base == this_base()) {
+            timer_reprogram(base);
+        }
+    }
+    spin_unlock(&base->lock);
+}
+
+/* call @fn(@arg) once, @ns from now on this pcpu. -1 if the pool is exhausted */
+int timer_add(u64 ns, timer_fn_t fn, void *arg)
+{
+    struct timer_base *base = this_base();
+    struct timer *t = NULL;
+
+    spin_lock(&base->lock);
+    for (int i = 0; i < TIMER_POOL_MAX; ++i) {
+        if (!base->pool[i].used) {
+            t = &base->pool[i];
+            timer_setup(t, fn, arg);
+            t->used = 1;
+            break;
+        }
+    }
+    spin_unlock(&base->lock);
+
+    if (NULL == t) {
+        LOG_WARN("[timer_add] no free timer on pcpu %d\n", cpuid());
+        return -1;
+    }
+    timer_mod(t, get_syscount() + nstime_to_count(ns));
+    return 0;
+}
+
+/* HYP_TIMER_IRQ: run the expired timers of this pcpu and re-arm for the next one */
+void timer_interrupt(void)
+{
+    struct timer_base *base = this_base();
+
+    spin_lock(&base->lock);
+    /* the interrupt stays asserted until CVAL moves or the timer is off */
+    hyp_timer_cancel();
+    base->armed = ~0UL;
+
+    while (base->n && deadline_reached(base->heap[0]->expires)) {
+        struct timer *t = base->heap[0];
+        timer_fn_t fn = t->fn;
+        void *arg = t->arg;
+
+        heap_remove(base, t);
+        t->used = 0;
+        spin_unlock(&base->lock);
+        fn(arg);
+        spin_lock(&base->lock);
+    }
+    timer_reprogram(base);
+    spin_unlock(&base->lock);
 }
 
 void freq_init(void)
 {
-    read_sysreg(g_freq, cntfrq_el0);
-    g_freq = g_freq & CNTFRQ_MASK;
-}
\ No newline at end of file
+    struct clocksource *cs = &g_clocksource;
+
+    read_sysreg(cs->freq, cntfrq_el0);
+    cs->freq = cs->freq & CNTFRQ_MASK;
+    if (0 == cs->freq) {
+        panic("[freq_init] CNTFRQ_EL0 is not set");
+    }
+    clock_calc_mult_shift(cs->freq, NS_PER_SECOND, &cs->mult, &cs->shift);
+    clock_calc_mult_shift(NS_PER_SECOND, cs->freq, &cs->ns_mult, &cs->ns_shift);
+    LOG_INFO("[freq_init] counter %d Hz, cycles->ns %d >> %d, ns->cycles %d >> %d\n",
+             cs->freq, cs->mult, cs->shift, cs->ns_mult, cs->ns_shift);
+}
@@ -10,11 +10,11 @@
 #include "mmio.h"
 #include "smcc.h"
 #include "psci.h"
+#include "exit_stat.h"
+#include "sched.h"
+#include "iothread.h"
 #include "debug.h"
 
-#define WFI_POLL_TIMEOUT_NS         (10000)     /* 0.01 ms */
-#define WFI_POLL_TIMEOUT_NS_MAX     (500000)    /* 0.5 ms */
-
 void el2_sync_handler(void)
 {
     u64 far, elr, esr, spsr;
@@ -28,10 +28,6 @@ void el2_sync_handler(void)
         ;
 }
 
-#define PHYSICAL_TIMER_IRQ  30
-#define VIRTUAL_TIMER_IRQ   27
-#define UART_IRQ    33
-
 void el2_irq_handler(void)
 {
     u64 irq = 0;
@@ -50,14 +46,11 @@ void el2_irq_handler(void)
         LOG_TRACE("Before clear uart interrupt, uart interrupt status: %d\n", uart_get_interrupt_status());
         clear_uart_interrupt();
         LOG_TRACE("After clear uart interrupt, uart interrupt status: %d\n", uart_get_interrupt_status());
-    } else if (irq == PHYSICAL_TIMER_IRQ) {
-        LOG_TRACE("disable phy timer\n");
-        disable_timer();
-        reload_timer();
-        enable_timer();
-        LOG_TRACE("reload timer done\n");
+    } else if (irq == HYP_TIMER_IRQ) {
+        timer_interrupt();
     }
-    write_sysreg(icc_eoir1_el1, irq);
+    /* EOImode is 1: the priority drop alone would leave the irq active for good */
+    gic_host_eoi(irq, 1);
 }
 
 static void data_abort_iss_dump(u64 iss, u64 il)
@@ -133,19 +126,29 @@ void advance_pc(struct vcpu *vcpu)
     vcpu->reg.elr_el2 += 4;
 }
 
+/*
+ * WFI halts the vcpu until a vIRQ arrives, see vcpu_halt(); the pc is advanced
+ * first as the vcpu may be switched out and resumed by a later exit.
+ * WFE is only a hint (the guest may be waiting for an event we cannot see),
+ * so it just returns to the guest.
+ */
 static int wfx_emulate_handler(struct vcpu *vcpu, u64 esr)
 {
-    u64 cur_time, end_time;
-    end_time = count_to_time_ns(get_syscount()) + WFI_POLL_TIMEOUT_NS;
-    do {
-        if (gic_has_pending_lr() == true) {
-            LOG_TRACE("[wfx_emulate_handler]: vcpu has pending lr\n");
-            break;
-        }
-        cur_time = count_to_time_ns(get_syscount());
-    } while (cur_time < end_time);
-
     advance_pc(vcpu);
+
+    if (!(esr & WFx_ISS_TI_WFE)) {
+        vcpu_halt(vcpu);
+    }
+    return 0;
+}
+
+/*
+ * First FP/SIMD access of the vcpu since it was loaded, while the pcpu holds
+ * another vcpu's registers: switch them now and retry the instruction.
+ */
+static int fpsimd_trap_handler(struct vcpu *vcpu, u64 esr)
+{
+    vcpu_fpsimd_switch(vcpu);
     return 0;
 }
 
@@ -166,6 +169,24 @@ static long standard_service_call(struct vcpu *vcpu)
     return ret;
 }
 
+static long vendor_hyp_service_call(struct vcpu *vcpu)
+{
+    long ret = SMCC_E_NOT_SUPPORTED;
+    unsigned long fid = vcpu->reg.x[0];
+
+    switch (fid) {
+        case VMSTAT_HVC_FID:
+            ret = exit_stat_hvc(vcpu, vcpu->reg.x[1], vcpu->reg.x[2],
+                                vcpu->reg.x[3], vcpu->reg.x[4]);
+            break;
+        default:
+            LOG_WARN("Unknown vendor hypervisor service fid 0x%x\n", fid);
+            break;
+    }
+
+    return ret;
+}
+
 static int syscall_handler(struct vcpu *vcpu)
 {
     unsigned long fid = vcpu->reg.x[0];
@@ -175,12 +196,17 @@ static int syscall_handler(struct vcpu *vcpu)
         case SMCC64_FID_STD_SRVC:
             ret = standard_service_call(vcpu);
             break;
+        case SMCC64_FID_VND_HYP_SRVC:
+            ret = vendor_hyp_service_call(vcpu);
+            break;
         default:
             panic("Unknown/Unsupported system monitor call fid 0x%x", fid);
     }
 
+    /* ret is the call's result for the guest (e.g. PSCI_VERSION, a record
+     * count), not a status of the trap handler */
     vcpu->reg.x[0] = (unsigned long)ret;
-    return ret;
+    return 0;
 }
 
 static int hvc_handler(struct vcpu *vcpu, u64 esr)
@@ -205,6 +231,34 @@ static int smc_handler(struct vcpu *vcpu, u64 esr)
     return ret;
 }
 
+/*
+ * Trapped msr/mrs. HCR_EL2.IMO routes the guest's ICC_SGI1R_EL1 writes here,
+ * the virtual cpu interface can not send SGIs by itself.
+ */
+static int sysreg_trap_handler(struct vcpu *vcpu, u64 esr)
+{
+    u64 iss = (esr & ESR_ISS_MASK) >> ESR_ISS_OFFSET;
+    u32 rt = (iss & SYS_ISS_RT_MASK) >> SYS_ISS_RT_OFFSET;
+
+    switch (iss & SYS_ISS_ENC_MASK) {
+        case ICC_SGI1R_ISS:
+            /* write-only, a read is UNDEFINED and reads 0 here */
+            if (iss & SYS_ISS_DIR_READ) {
+                if (rt != 31) {
+                    vcpu->reg.x[rt] = 0;
+                }
+            } else {
+                vgic_sgi1r_write(vcpu, (rt == 31) ? 0 : vcpu->reg.x[rt]);
+            }
+            break;
+        default:
+            LOG_WARN("Trapped msr/mrs, iss=0x%x. (Not supported yet)\n", iss);
+            return -1;
+    }
+    advance_pc(vcpu);
+    return 0;
+}
+
 typedef int (*sync_trap_handler_t)(struct vcpu *vcpu, u64 esr);
 
 sync_trap_handler_t get_sync_trap_handler(u64 esr)
@@ -214,18 +268,19 @@ sync_trap_handler_t get_sync_trap_handler(u64 esr)
 
     switch (ec) {
         case ESR_EC_WFx:
-            LOG_INFO("Trap guestos's wfi/wfe instruction.\n");
             handler = wfx_emulate_handler;
             break;
+        case ESR_EC_FPSIMD:
+            handler = fpsimd_trap_handler;
+            break;
         case ESR_EC_HVC64:
-            LOG_INFO("Guest OS invoke hvc instruction\n");
             handler = hvc_handler;
             break;
         case ESR_EC_SMC64:
             LOG_WARN("SMC64. (Not supported yet)\n");
             break;
         case ESR_EC_SYSRG:
-            LOG_WARN("Trapped msr/mrs or system instruction. (Not supported yet)\n");
+            handler = sysreg_trap_handler;
             break;
         case ESR_EC_IALEL:
             LOG_WARN("Instruction Abort from a lower Exception level. (Not supported yet)\n");
@@ -234,7 +289,6 @@ sync_trap_handler_t get_sync_trap_handler(u64 esr)
             LOG_WARN("PC alignment fault exception. (Not supported yet)\n");
             break;
         case ESR_EC_DALEL:
-            LOG_INFO("Data Abort from a lower Exception level.\n");
             handler = data_abort_handler;
             break;
         case ESR_EC_DAEL2:
@@ -252,12 +306,141 @@ sync_trap_handler_t get_sync_trap_handler(u64 esr)
 }
 
 
+/* account one sync exit, @fid is the guest's x0 on entry (function id of hvc/smc) */
+static void exit_account(struct vcpu *vcpu, enum exit_class cls, u64 esr, u64 fid, u64 ticks)
+{
+    struct vcpu_stats *st = &vcpu->stats;
+    u64 ec = (esr & ESR_EC_MASK) >> ESR_EC_OFFSET;
+
+    exit_stat_add(&st->cls[cls], ticks);
+    exit_stat_add(&st->ec[ec], ticks);
+
+    if (ec == ESR_EC_DALEL && NULL != vcpu->mmio_exit) {
+        exit_stat_add(&st->mmio[vcpu->mmio_exit - vcpu->vm->mmio->regions], ticks);
+    } else if ((ec == ESR_EC_HVC64 || ec == ESR_EC_SMC64) && is_psci_fid((u32)fid)) {
+        exit_stat_add(&st->psci[fid & (EXIT_STAT_PSCI_MAX - 1)], ticks);
+    }
+    vcpu->mmio_exit = NULL;
+}
+
+/* the fast path frame: x0..x18, then x30 */
+#define FAST_FRAME_X30  19
+
+static u64 *fast_frame_reg(u64 *regs, u32 idx)
+{
+    if (idx <= 18) {
+        return &regs[idx];
+    }
+    return (idx == 30) ? &regs[FAST_FRAME_X30] : NULL;
+}
+
+/*
+ * Fast exit path, called from vector.S with only the caller-saved registers
+ * stacked: @regs[0..18] = x0..x18, @regs[19] = x30. vcpu->reg is NOT saved.
+ *
+ * Exits whose emulation is trivial are finished here:
+ * - WFI/WFE while a virtual interrupt is already pending in a LR: the
+ *   instruction completes at once, no need to poll or sleep;
+ * - HVC PSCI_VERSION / PSCI_FEATURES;
+ * - MMIO accesses of registers with a MMIO_REG_FAST sub-handler (constant
+ *   GICD/virtio identification registers).
+ *
+ * Returns 0 if the exit was handled and the guest can be resumed with eret,
+ * 1 to take the full exit path (vm_context_save + lower_el_sync_handler).
+ */
+int lower_el_sync_fast(u64 *regs)
+{
+    u64 start = get_syscount();
+    struct vcpu *vcpu = cur_vcpu();
+    u64 esr, elr;
+    u64 fid = regs[0];
+    enum exit_class cls;
+
+    read_sysreg(esr, esr_el2);
+
+    switch ((esr & ESR_EC_MASK) >> ESR_EC_OFFSET) {
+        case ESR_EC_WFx:
+            if (!gic_has_pending_lr()) {
+                goto slow;
+            }
+            read_sysreg(elr, elr_el2);
+            write_sysreg(elr_el2, elr + 4);
+            cls = EXIT_FAST_WFX;
+            break;
+        case ESR_EC_HVC64:
+            /* pc has already been advanced by hvc */
+            if ((u32)regs[0] == PSCI_VERSION) {
+                regs[0] = PSCI_VERSION_0_2;
+            } else if ((u32)regs[0] == PSCI_FEATURES) {
+                regs[0] = (u64)psci_features_handler((u32)regs[1]);
+            } else {
+                goto slow;
+            }
+            cls = EXIT_FAST_HVC;
+            break;
+        case ESR_EC_DALEL:
+        {
+            u64 iss = (esr & ESR_ISS_MASK) >> ESR_ISS_OFFSET;
+            u64 far, hpfar, zero = 0;
+
+            if (!(iss & DA_ISS_ISV_MASK) || (iss & DA_ISS_FnV_MASK)) {
+                goto slow;
+            }
+            u32 srt = (iss & DA_ISS_SRT_MASK) >> DA_ISS_SRT_OFFSET;
+            u64 *val = (srt == 31) ? &zero : fast_frame_reg(regs, srt);
+            if (NULL == val) {
+                goto slow;      /* x19..x29 are not stacked on the fast path */
+            }
+
+            read_sysreg(far, far_el2);
+            read_sysreg(hpfar, hpfar_el2);
+            read_sysreg(elr, elr_el2);
+            struct mmio_access mmio_access = {
+                .ipa     = ((hpfar & HPFAR_FIPA_MASK) << 8) | (far & (PAGE_SIZE-1)),
+                .pc      = elr,
+                .iss_sas = (iss & DA_ISS_SAS_MASK) >> DA_ISS_SAS_OFFSET,
+                .iss_wnr = (iss & DA_ISS_WnR_MASK) >> DA_ISS_WnR_OFFSET,
+            };
+            if (!mmio_emulate_fast(vcpu, val, &mmio_access)) {
+                goto slow;
+            }
+            write_sysreg(elr_el2, elr + 4);
+            cls = EXIT_FAST_MMIO;
+            break;
+        }
+        default:
+            goto slow;
+    }
+
+    exit_account(vcpu, cls, esr, fid, get_syscount() - start);
+    return 0;
+
+slow:
+    vcpu->exit_start = start;
+    return 1;
+}
+
+static enum exit_class exit_class_of(u64 esr)
+{
+    switch ((esr & ESR_EC_MASK) >> ESR_EC_OFFSET) {
+        case ESR_EC_WFx:
+            return EXIT_WFX;
+        case ESR_EC_HVC64:
+            return EXIT_HVC;
+        case ESR_EC_DALEL:
+            return EXIT_MMIO;
+        default:
+            return EXIT_OTHER;
+    }
+}
+
 void lower_el_sync_handler(void)
 {
     int ret = -1;
     u64 esr_el2 = 0;
     sync_trap_handler_t sync_trap_handler = NULL;
     struct vcpu *vcpu = cur_vcpu();
+    u64 fid = vcpu->reg.x[0];
     
     read_sysreg(esr_el2, esr_el2);
     
@@ -279,16 +462,109 @@ void lower_el_sync_handler(void)
         panic("ERROR: invalid/unsupported exception class\n");
     }
 
+    exit_account(vcpu, exit_class_of(esr_el2), esr_el2, fid, get_syscount() - vcpu->exit_start);
+#if BENCH_MODE
+    if ((vcpu->stats.cls[EXIT_WFX].count & 0xffff) == 0 && exit_class_of(esr_el2) == EXIT_WFX) {
+        exit_stat_dump(vcpu);
+    }
+#endif
+
+    /* e.g. PSCI CPU_ON woke a vcpu placed on this pcpu */
+    sched_check();
+
     return;
 }
 
-void lower_el_irq_handler()
+/*
+ * Acknowledge the highest priority physical irq, if any, and inject it into
+ * the vcpu it belongs to: the owner of an SPI (see vgic_spi_forward()), @vcpu
+ * for a PPI. @vcpu need not be loaded (an idle pcpu passes the last vcpu it
+ * ran, or NULL). The hypervisor's own interrupts are consumed here.
+ */
+void vcpu_irq_forward(struct vcpu *vcpu)
 {
+    u64 start = get_syscount();
     u32 pirq = 0;
     u32 virq = 0;
     u32 iar = 0;
-    u64 mpidr = 0;
     int group = 1;
+
+    iar = gic_read_iar();
+    pirq = iar & 0xffffff;
+    if (pirq >= 1020) {
+        /* spurious, e.g. the wfi in vcpu_halt() woke up for nothing */
+        return;
+    }
+    virq = pirq;
+
+    if (pirq == GIC_MAINT_IRQ) {
+        vgic_maintenance(vcpu);
+        gic_host_eoi(pirq, group);
+        return;
+    }
+
+    if (is_spi(pirq)) {
+        /* to the vcpu of the VM owning it, whichever vcpu was interrupted */
+        gic_guest_eoi(pirq, group);
+        if (vgic_spi_forward(pirq) < 0) {
+            LOG_WARN("[vcpu_irq_forward] SPI %d belongs to no VM, disabled\n", pirq);
+            gic_irq_disable(pirq);
+            gic_deactive_irq(pirq);
+        }
+        if (NULL != vcpu) {
+            exit_stat_add(&vcpu->stats.irq, get_syscount() - start);
+        }
+        return;
+    }
+
+    if (pirq == HYP_TIMER_IRQ) {
+        /* the callbacks ask for a reschedule themselves */
+        timer_interrupt();
+        gic_host_eoi(pirq, group);
+        return;
+    }
+
+    if (pirq == IO_WORK_SGI) {
+        /* deactivated first: work posted meanwhile kicks this pcpu again */
+        gic_host_eoi(pirq, group);
+        io_work_run();
+        return;
+    }
+
+    if (pirq == SCHED_IPI_SGI || NULL == vcpu) {
+        /* the kick may come with vIRQs queued by another pcpu */
+        vgic_sync(vcpu);
+        gic_host_eoi(pirq, group);
+        sched_ipi();
+        return;
+    }
+
+    if (is_sgi(pirq)) {
+        /* guest SGIs never touch the physical GIC, see vgic_sgi1r_write() */
+        LOG_WARN("[vcpu_irq_forward] unexpected physical SGI %d, pcpu=%d\n", pirq, cpuid());
+        gic_host_eoi(pirq, group);
+        return;
+    }
+
+    /* a PPI other than the hypervisor's belongs to the vcpu loaded here */
+    vgic_used_lr_update(vcpu);
+
+    gic_guest_eoi(pirq, group);
+
+    vgic_inject_virq(vcpu, pirq, virq, group);
+
+    isb();
+
+    if (!vcpu_running(vcpu)) {
+        sched_wakeup(vcpu);
+    }
+
+    exit_stat_add(&vcpu->stats.irq, get_syscount() - start);
+}
+
+void lower_el_irq_handler()
+{
+    u64 mpidr = 0;
     struct vcpu *vcpu = cur_vcpu();
     read_sysreg(mpidr, mpidr_el1);
 
@@ -300,19 +576,9 @@ void lower_el_irq_handler()
     // vm_reg_dump();
     // LOG_INFO("\n");
 
-    vgic_used_lr_update(vcpu);
+    vcpu_irq_forward(vcpu);
 
-    iar = gic_read_iar();
-    pirq = iar & 0xffffff;
-    virq = pirq;
-
-    /* TODO: check whether the coming irq belong to VM */
-
-    gic_guest_eoi(pirq, group);
-
-    vgic_inject_virq(vcpu, pirq, virq, group);
-
-    isb();
+    sched_check();
 
     // LOG_INFO("========= Exit [lower_el_irq_handler]: vcpu->cpuid=%d, pcpu=%d\n",
     //        vcpu->cpuid, mpidr & 0xffffff);
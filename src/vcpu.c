@@ -2,14 +2,13 @@
 #include "vm.h"
 #include "aarch64.h"
 #include "spinlock.h"
+#include "sched.h"
+#include "sysreg.h"
 #include "debug.h"
 
-static struct vcpu vcpus[VCPU_MAX];
+static struct vcpu vcpus[VCPU_POOL_MAX];
 static spinlock_t g_vcpus_lock;
 
-void eret_vm(void);
-static void save_sysreg(struct vcpu *vcpu);
-static void restore_sysreg(struct vcpu *vcpu);
 
 void vcpu_init(void)
 {
@@ -18,7 +17,7 @@ void vcpu_init(void)
 
 static struct vcpu *vcpu_alloc() {
     spin_lock(&g_vcpus_lock);
-    for (int i = 0; i < VCPU_MAX; i++) {
+    for (int i = 0; i < VCPU_POOL_MAX; i++) {
         if(vcpus[i].state == UNUSED) {
             vcpus[i].state = CREATED;
             spin_unlock(&g_vcpus_lock);
@@ -48,6 +47,9 @@ struct vcpu *new_vcpu(struct vm *vm, int vcpuid, u64 entrypoint)
     vcpu->sys.midr_el1   = 0x410fd081; // Cortex-A72
     vcpu->sys.sctlr_el1  = 0x30C50830;
     vcpu->sys.cntfrq_el0 = 62500000;
+    vcpu->sys.cntvoff_el2 = vm->cntvoff;
+
+    vcpu->halt_poll_ns = WFI_POLL_TIMEOUT_NS;
 
     /* TODO: init fdt address for guest os */
 
@@ -65,86 +67,248 @@ void free_vcpu(struct vcpu *vcpu)
 
 }
 
+/* make @vcpu runnable on its pcpu */
 void vcpu_ready(struct vcpu *vcpu)
 {
-    vcpu->state = READY;
+    sched_wakeup(vcpu);
 }
 
-static void switch_to_vcpu(struct vcpu *vcpu)
+/*
+ * Per pcpu view of the EL1 context in the hardware: g_el1_hw points at the
+ * struct el1_ctx the registers were last saved to (or restored from), so a
+ * group whose values are unchanged there need not be written again.
+ * g_fp_owner is the vcpu whose FP/SIMD registers are live on the pcpu.
+ */
+static const struct el1_ctx *g_el1_hw[PCPU_NUM_MAX];
+static struct vcpu *g_fp_owner[PCPU_NUM_MAX];
+static bool g_fp_trap[PCPU_NUM_MAX];
+
+static inline bool el1_grp_dirty(const u64 *hw, const u64 *ctx, int n)
 {
-    write_sysreg(tpidr_el2, vcpu);
+    for (int i = 0; i < n; ++i) {
+        if (hw[i] != ctx[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* group of struct el1_ctx from member @first up to and including @last */
+#define EL1_GRP_DIRTY(hw, ctx, first, last)                                     \
+    el1_grp_dirty(&(hw)->first, &(ctx)->first,                                  \
+                  (offsetof(struct el1_ctx, last) - offsetof(struct el1_ctx, first)) / sizeof(u64) + 1)
 
-    if (cpuid() != vcpu->cpuid) {
-        panic("vcpu cpuid mismatch");
+static void save_sysreg(struct vcpu *vcpu)
+{
+    struct el1_ctx *ctx = &vcpu->sys;
+
+    /* EL1_GRP_EXC */
+    read_sysreg(ctx->spsr_el1, spsr_el1);
+    read_sysreg(ctx->elr_el1, elr_el1);
+    read_sysreg(ctx->sp_el0, sp_el0);
+    read_sysreg(ctx->sp_el1, sp_el1);
+    read_sysreg(ctx->esr_el1, esr_el1);
+    read_sysreg(ctx->far_el1, far_el1);
+    read_sysreg(ctx->afsr0_el1, afsr0_el1);
+    read_sysreg(ctx->afsr1_el1, afsr1_el1);
+    read_sysreg(ctx->par_el1, par_el1);
+    read_sysreg(ctx->tpidr_el0, tpidr_el0);
+    read_sysreg(ctx->tpidrro_el0, tpidrro_el0);
+    read_sysreg(ctx->tpidr_el1, tpidr_el1);
+    read_sysreg(ctx->contextidr_el1, contextidr_el1);
+    read_sysreg(ctx->ttbr0_el1, ttbr0_el1);
+
+    /* EL1_GRP_MMU, the guest writes them without trapping, always read back */
+    read_sysreg(ctx->ttbr1_el1, ttbr1_el1);
+    read_sysreg(ctx->tcr_el1, tcr_el1);
+    read_sysreg(ctx->mair_el1, mair_el1);
+    read_sysreg(ctx->amair_el1, amair_el1);
+    read_sysreg(ctx->sctlr_el1, sctlr_el1);
+    read_sysreg(ctx->vbar_el1, vbar_el1);
+    read_sysreg(ctx->cpacr_el1, cpacr_el1);
+    read_sysreg(ctx->csselr_el1, csselr_el1);
+    read_sysreg(ctx->cntkctl_el1, cntkctl_el1);
+
+    /* EL1_GRP_ID is constant */
+
+    read_sysreg(ctx->cntv_ctl_el0, cntv_ctl_el0);
+    read_sysreg(ctx->cntv_cval_el0, cntv_cval_el0);
+
+    g_el1_hw[cpuid()] = ctx;
+}
+
+static void restore_sysreg(struct vcpu *vcpu)
+{
+    const struct el1_ctx *ctx = &vcpu->sys;
+    const struct el1_ctx *hw = g_el1_hw[cpuid()];
+
+    if (hw != ctx) {
+        write_sysreg(spsr_el1, ctx->spsr_el1);
+        write_sysreg(elr_el1, ctx->elr_el1);
+        write_sysreg(sp_el0, ctx->sp_el0);
+        write_sysreg(sp_el1, ctx->sp_el1);
+        write_sysreg(esr_el1, ctx->esr_el1);
+        write_sysreg(far_el1, ctx->far_el1);
+        write_sysreg(afsr0_el1, ctx->afsr0_el1);
+        write_sysreg(afsr1_el1, ctx->afsr1_el1);
+        write_sysreg(par_el1, ctx->par_el1);
+        write_sysreg(tpidr_el0, ctx->tpidr_el0);
+        write_sysreg(tpidrro_el0, ctx->tpidrro_el0);
+        write_sysreg(tpidr_el1, ctx->tpidr_el1);
+        write_sysreg(contextidr_el1, ctx->contextidr_el1);
+        write_sysreg(ttbr0_el1, ctx->ttbr0_el1);
     }
 
-    vcpu->state = RUNNING;
+    if (NULL == hw || (hw != ctx && EL1_GRP_DIRTY(hw, ctx, ttbr1_el1, cntkctl_el1))) {
+        write_sysreg(ttbr1_el1, ctx->ttbr1_el1);
+        write_sysreg(tcr_el1, ctx->tcr_el1);
+        write_sysreg(mair_el1, ctx->mair_el1);
+        write_sysreg(amair_el1, ctx->amair_el1);
+        write_sysreg(sctlr_el1, ctx->sctlr_el1);
+        write_sysreg(vbar_el1, ctx->vbar_el1);
+        write_sysreg(cpacr_el1, ctx->cpacr_el1);
+        write_sysreg(csselr_el1, ctx->csselr_el1);
+        write_sysreg(cntkctl_el1, ctx->cntkctl_el1);
+    }
 
-    write_sysreg(vttbr_el2, vcpu->vm->stage2_pt);
-    tlb_flush();
+    if (NULL == hw || (hw != ctx && EL1_GRP_DIRTY(hw, ctx, mpidr_el1, cntfrq_el0))) {
+        /* Emulate the MPIDR_EL1 and MIDR_EL1 register */
+        write_sysreg(vmpidr_el2, ctx->mpidr_el1);
+        write_sysreg(vpidr_el2, ctx->midr_el1);
+        write_sysreg(cntfrq_el0, ctx->cntfrq_el0);
+    }
 
-    restore_sysreg(vcpu);
-    gic_restore_state(&vcpu->gic);
+    /* the offset first: CVAL is compared against the offset virtual count */
+    if (NULL == hw || hw->cntvoff_el2 != ctx->cntvoff_el2) {
+        write_sysreg(cntvoff_el2, ctx->cntvoff_el2);
+    }
+    write_sysreg(cntv_cval_el0, ctx->cntv_cval_el0);
+    write_sysreg(cntv_ctl_el0, ctx->cntv_ctl_el0);
+
+    g_el1_hw[cpuid()] = ctx;
+}
+
+static void fpsimd_trap_set(bool trap)
+{
+    int cpu = cpuid();
+
+    if (g_fp_trap[cpu] == trap) {
+        return;
+    }
+    write_sysreg(cptr_el2, CPTR_EL2_RES1 | (trap ? CPTR_EL2_TFP : 0));
     isb();
+    g_fp_trap[cpu] = trap;
+}
 
-#if DEBUG_MODE
-    vcpu_dump(vcpu);
-#endif
+/* per pcpu: FP/SIMD traps on, no vcpu owns the registers yet */
+void vcpu_fpsimd_init(void)
+{
+    int cpu = cpuid();
 
-    eret_vm();
+    g_fp_owner[cpu] = NULL;
+    g_fp_trap[cpu] = true;
+    write_sysreg(cptr_el2, CPTR_EL2_RES1 | CPTR_EL2_TFP);
+    isb();
 }
 
-void enter_vcpu()
+/*
+ * ESR_EC_FPSIMD: the loaded @vcpu touched FP/SIMD while another vcpu's
+ * registers are live. Swap the 32 V registers and stop trapping until the
+ * pcpu loads some other vcpu.
+ */
+void vcpu_fpsimd_switch(struct vcpu *vcpu)
 {
-    int id = cpuid();
-    struct vcpu *vcpu = &vcpus[id];
+    int cpu = cpuid();
+    struct vcpu *owner = g_fp_owner[cpu];
 
-    if (vcpu->state != READY) {
-        panic("vcpu not ready");
+    /* CPTR_EL2.TFP traps EL2's own FP/SIMD accesses too */
+    fpsimd_trap_set(false);
+    if (owner == vcpu) {
+        return;
+    }
+    if (owner) {
+        fpsimd_save(&owner->fp);
     }
+    fpsimd_restore(&vcpu->fp);
+    g_fp_owner[cpu] = vcpu;
+}
+
+/* EL1 context only: what vcpu_put()/vcpu_load() switch besides stage2 and the vgic */
+void vcpu_ctx_switch(struct vcpu *prev, struct vcpu *next)
+{
+    if (prev) {
+        save_sysreg(prev);
+    }
+    restore_sysreg(next);
+    /* the FP/SIMD registers stay where they are until someone else uses them */
+    fpsimd_trap_set(g_fp_owner[cpuid()] != next);
+}
 
-    LOG_TRACE("enter vm(%s)'s vcpu %d\n", vcpu->vm->name, id);
+/*
+ * The virtual timer of @vcpu expired while it was out: inject its PPI now
+ * instead of taking the physical one right after the entry.
+ */
+static void vtimer_load(struct vcpu *vcpu)
+{
+    u64 ctl = vcpu->sys.cntv_ctl_el0;
 
-    switch_to_vcpu(vcpu);
+    if (!(ctl & CNTV_CTL_ENABLE) || (ctl & CNTV_CTL_IMASK)) {
+        return;
+    }
+    if (!deadline_reached(vcpu->sys.cntv_cval_el0 + vcpu->sys.cntvoff_el2)) {
+        return;
+    }
+    vgic_hw_ppi_assert(vcpu, VIRTUAL_TIMER_IRQ);
 }
 
-static void save_sysreg(struct vcpu *vcpu)
+/*
+ * Load @vcpu on this pcpu. Only the EL1/EL2 system state is switched here,
+ * the general purpose registers are restored from vcpu->reg by eret_vm.
+ */
+void vcpu_load(struct vcpu *vcpu)
 {
-    read_sysreg(vcpu->sys.spsr_el1, spsr_el1);
-    read_sysreg(vcpu->sys.elr_el1, elr_el1);
-    read_sysreg(vcpu->sys.mpidr_el1, mpidr_el1);
-    read_sysreg(vcpu->sys.midr_el1, midr_el1);
-    read_sysreg(vcpu->sys.sp_el0, sp_el0);
-    read_sysreg(vcpu->sys.sp_el1, sp_el1);
-    read_sysreg(vcpu->sys.ttbr0_el1, ttbr0_el1);
-    read_sysreg(vcpu->sys.ttbr1_el1, ttbr1_el1);
-    read_sysreg(vcpu->sys.tcr_el1, tcr_el1);
-    read_sysreg(vcpu->sys.vbar_el1, vbar_el1);
-    read_sysreg(vcpu->sys.sctlr_el1, sctlr_el1);
-    read_sysreg(vcpu->sys.cntv_ctl_el0, cntv_ctl_el0);
-    read_sysreg(vcpu->sys.cntv_tval_el0, cntv_tval_el0);
+    struct vcpu **last = &vcpu->vm->last_vcpu[cpuid()];
+
+    write_sysreg(tpidr_el2, vcpu);
+
+    /* VMID tagged: entries of other VMs stay in the TLB, no flush needed */
+    write_sysreg(vttbr_el2, vm_vttbr(vcpu->vm));
+
+    /*
+     * but the vcpus of one VM share its VMID, and the guest may use the same
+     * ASID (or global mappings) on all of them: the stage1 entries another
+     * vcpu of the VM left on this pcpu would translate for this one.
+     */
+    if (*last != vcpu) {
+        if (NULL != *last) {
+            isb();
+            tlbi_stage1_local();
+            dsb(nsh);
+            isb();
+        }
+        *last = vcpu;
+    }
+
+    vcpu_ctx_switch(NULL, vcpu);
+    vgic_vcpu_load(vcpu);
+    /* after the vgic: its LRs are the hardware ones now, the PPI keeps its HW link */
+    vtimer_load(vcpu);
+    vcpu->state = RUNNING;
+    isb();
+
+#if DEBUG_MODE
+    vcpu_dump(vcpu);
+#endif
 }
 
-/* restore_sysreg will only be invoked when entering the VM on the first time */
-static void restore_sysreg(struct vcpu *vcpu)
+/* save the state of the loaded @vcpu, the caller decides its next state */
+void vcpu_put(struct vcpu *vcpu)
 {
-    write_sysreg(spsr_el1, vcpu->sys.spsr_el1);
-    write_sysreg(elr_el1, vcpu->sys.elr_el1);
-    
-    /* Emulate the MPIDR_EL1 and MIDR_EL1 register */
-    write_sysreg(vmpidr_el2, vcpu->sys.mpidr_el1);
-    write_sysreg(vpidr_el2, vcpu->sys.midr_el1);
-
-    write_sysreg(sp_el0, vcpu->sys.sp_el0);
-    write_sysreg(sp_el1, vcpu->sys.sp_el1);
-    write_sysreg(ttbr0_el1, vcpu->sys.ttbr0_el1);
-    write_sysreg(ttbr1_el1, vcpu->sys.ttbr1_el1);
-    write_sysreg(tcr_el1, vcpu->sys.tcr_el1);
-    write_sysreg(vbar_el1, vcpu->sys.vbar_el1);
-    write_sysreg(sctlr_el1, vcpu->sys.sctlr_el1);
-    write_sysreg(cntv_ctl_el0, vcpu->sys.cntv_ctl_el0);
-    write_sysreg(cntv_tval_el0, vcpu->sys.cntv_tval_el0);
-    write_sysreg(cntfrq_el0, vcpu->sys.cntfrq_el0);
+    save_sysreg(vcpu);
+    /* stop its virtual timer, the scheduler watches the deadline while it is out */
+    write_sysreg(cntv_ctl_el0, 0);
+    vgic_vcpu_put(vcpu);
+    isb();
 }
 
 void vcpu_dump(struct vcpu *vcpu)
@@ -170,4 +334,8 @@ void vcpu_dump(struct vcpu *vcpu)
            vcpu->sys.ttbr0_el1, vcpu->sys.ttbr1_el1, vcpu->sys.tcr_el1);
     LOG_TRACE("vbar_el1  %18p  sctlr_el1 %18p  cntv_ctl_el0 %18p\n",
            vcpu->sys.vbar_el1, vcpu->sys.sctlr_el1, vcpu->sys.cntv_ctl_el0);
+    LOG_TRACE("mair_el1  %18p  esr_el1   %18p  far_el1      %18p\n",
+           vcpu->sys.mair_el1, vcpu->sys.esr_el1, vcpu->sys.far_el1);
+    LOG_TRACE("tpidr_el1 %18p  tpidr_el0 %18p  cntkctl_el1  %18p\n",
+           vcpu->sys.tpidr_el1, vcpu->sys.tpidr_el0, vcpu->sys.cntkctl_el1);
 }
\ No newline at end of file
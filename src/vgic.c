@@ -4,15 +4,51 @@
 #include "page_alloc.h"
 #include "gic.h"
 #include "types.h"
+#include "mmio.h"
+#include "timer.h"
+#include "sysreg.h"
+#include "sched.h"
+#include "lib.h"
 #include "debug.h"
 
 extern u32 g_gic_lr_max;
 
 static struct vgic g_vgic[VM_MAX];
-static struct vgic_cpu g_vgic_cpu[VCPU_MAX];
-static spinlock_t g_vgic_lock;
+static struct vgic_cpu g_vgic_cpu[VCPU_POOL_MAX];
 static spinlock_t g_vgic_cpu_lock;
 
+/*
+ * Owner of each physical SPI, indexed by pINTID - 32. Written while VMs are
+ * created and on guest re-targeting, read lock-free by vgic_spi_forward().
+ */
+struct vgic_route {
+    struct vm   *vm;        /* NULL: no VM, the SPI stays disabled */
+    struct vcpu *vcpu;      /* vcpu it is delivered to, the SPI is routed to its pcpu */
+    u32         virq;       /* INTID in the VM */
+};
+static struct vgic_route g_vgic_route[VGIC_SPI_MAX];
+static spinlock_t g_vgic_route_lock;
+
+/* read-modify-writes of the shared physical distributor registers */
+static spinlock_t g_vgic_gicd_lock;
+
+#define vgic_irq_rd(irq, f)     __atomic_load_n(&(irq)->f, __ATOMIC_ACQUIRE)
+#define vgic_irq_wr(irq, f, v)  __atomic_store_n(&(irq)->f, (v), __ATOMIC_RELEASE)
+
+static void vgic_lock(struct vgic *vgic)
+{
+    if (spin_is_locked(&vgic->lock)) {
+        __atomic_add_fetch(&vgic->lock_contended, 1, __ATOMIC_RELAXED);
+    }
+    spin_lock(&vgic->lock);
+    vgic->lock_acquired++;
+}
+
+static void vgic_unlock(struct vgic *vgic)
+{
+    spin_unlock(&vgic->lock);
+}
+
 static struct vgic *vgic_alloc()
 {
     spin_lock(&g_vgic_cpu_lock);
@@ -31,7 +67,7 @@ static struct vgic *vgic_alloc()
 static struct vgic_cpu *vgic_cpu_alloc()
 {
     spin_lock(&g_vgic_cpu_lock);
-    for (int i = 0; i < VCPU_MAX; ++i) {
+    for (int i = 0; i < VCPU_POOL_MAX; ++i) {
         if (g_vgic_cpu[i].used == 0) {
             g_vgic_cpu[i].used = 1;
             spin_unlock(&g_vgic_cpu_lock);
@@ -42,29 +78,74 @@ static struct vgic_cpu *vgic_cpu_alloc()
     return NULL;
 }
 
+/* iterate @n over the set bits of the LR bitmap @mask, lowest first */
+#define for_each_lr(n, mask)                                                    \
+    for (u32 __lrs = (mask); __lrs && ((n) = __builtin_ctz(__lrs), 1); __lrs &= __lrs - 1)
+
 static int vgic_lr_alloc(struct vgic_cpu *vgic_cpu)
 {
-    for (int i = 0; i < g_gic_lr_max; ++i) {
-        if (!(vgic_cpu->used_lr & (1 << i))) {
-            vgic_cpu->used_lr |= (1 << i);
-            return i;
-        }
+    u32 free = ~vgic_cpu->used_lr & gic_lr_mask();
+
+    if (0 == free) {
+        return -1;
     }
-    LOG_WARN("[vgic_lr_alloc]: WARNING!! No available LR\n");
-    return -1;
+    int n = __builtin_ctz(free);
+    vgic_cpu->used_lr |= 1U << n;
+    return n;
 }
 
-void vgic_used_lr_update(struct vcpu *vcpu)
+/* PPIs the hypervisor keeps for itself, never switched with the vcpus */
+#define VGIC_HYP_PPI_MASK   ((1U << HYP_TIMER_IRQ) | (1U << GIC_MAINT_IRQ))
+
+/* the bits of the 32 irqs from @intid the guest may see, PPIs of the hypervisor are RAZ/WI */
+static inline u32 vgic_guest_mask(int intid)
+{
+    return intid ? ~0U : ~VGIC_HYP_PPI_MASK;
+}
+
+/*
+ * True if the virtual cpu interface of @vcpu is the one of this pcpu, from
+ * vgic_vcpu_load() until its LRs are saved by vgic_vcpu_put(). Not the same
+ * as vcpu_running(): a halting vcpu is BLOCKED before it is put.
+ */
+static inline bool vgic_loaded(struct vcpu *vcpu)
+{
+    return vcpu == cur_vcpu() && vcpu->vgic->loaded;
+}
+
+/*
+ * The LRs of a loaded vcpu live in ICH_LR<n>_EL2, otherwise in vcpu->gic.
+ * While it is loaded vcpu->gic.lr[] is a shadow of what was written: only
+ * the state bits change behind our back, so a vINTID is looked up in the
+ * shadow and only the LR found is read for its state.
+ */
+static u64 vgic_lr_read(struct vcpu *vcpu, int n)
+{
+    return vgic_loaded(vcpu) ? gic_read_lr(n) : vcpu->gic.lr[n];
+}
+
+static void vgic_lr_write(struct vcpu *vcpu, int n, u64 lr)
+{
+    vcpu->gic.lr[n] = lr;
+    if (vgic_loaded(vcpu)) {
+        gic_write_lr(n, lr);
+    }
+}
+
+/* bitmap of the LRs holding no interrupt, ICH_ELRSR_EL2 for a loaded vcpu */
+static u32 vgic_lr_empty(struct vcpu *vcpu)
 {
-    struct vgic_cpu *vgic_cpu = vcpu->vgic;
+    u32 empty = 0;
+
+    if (vgic_loaded(vcpu)) {
+        return gic_read_elrsr();
+    }
     for (int i = 0; i < g_gic_lr_max; ++i) {
-        if (vgic_cpu->used_lr & (1 << i)) {
-            u64 lr = gic_read_lr(i);
-            if (lr_is_inactive(lr)) {
-                vgic_cpu->used_lr &= ~(1 << i);
-            }
+        if (lr_is_inactive(vcpu->gic.lr[i])) {
+            empty |= 1U << i;
         }
     }
+    return empty;
 }
 
 static struct vgic_irq *vgic_irq_get(struct vcpu *vcpu, int intid)
@@ -82,6 +163,123 @@ static struct vgic_irq *vgic_irq_get(struct vcpu *vcpu, int intid)
     return NULL;
 }
 
+/* the used LR holding @virq, -1 if none */
+static int vgic_lr_find(struct vcpu *vcpu, u32 virq)
+{
+    int i;
+
+    for_each_lr(i, vcpu->vgic->used_lr) {
+        if ((u32)ICH_LR_VINTID(vcpu->gic.lr[i]) == virq) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* the LR value an emulated interrupt is injected with, never linked to a pINTID */
+static u64 vgic_emul_lr(struct vgic_irq *irq, u32 intid)
+{
+    u64 lr = ICH_LR_STATE(LR_PENDING) | ICH_LR_GROUP(1) | ICH_LR_VINTID(intid) |
+             ICH_LR_PRIORITY(vgic_irq_rd(irq, priority));
+
+    /* a level interrupt is sampled again once the guest deactivates it */
+    if (vgic_irq_rd(irq, level)) {
+        lr |= ICH_LR_EOI;
+    }
+    return lr;
+}
+
+static bool vgic_pendq_has(struct vgic_cpu *vgic, u32 virq)
+{
+    for (int i = 0; i < vgic->pendq_len; ++i) {
+        if ((u32)ICH_LR_VINTID(vgic->pendq[i].lr) == virq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * LR @n of an emulated interrupt went empty: the guest has deactivated it.
+ * Its state goes with it unless it is pending again in the queue, a level
+ * interrupt whose line is still up is pending again at once and takes the
+ * same LR. Returns true if LR @n is in use again.
+ */
+static bool vgic_lr_retire(struct vcpu *vcpu, int n)
+{
+    u32 virq = ICH_LR_VINTID(vcpu->gic.lr[n]);
+    struct vgic_irq *irq = vgic_irq_get(vcpu, virq);
+
+    if (NULL == irq || vgic_irq_rd(irq, hw)) {
+        return false;
+    }
+    if (vgic_irq_rd(irq, level) && vgic_irq_rd(irq, line)) {
+        __atomic_store_n(&irq->state, VGIC_IRQ_PENDING, __ATOMIC_RELEASE);
+        vgic_lr_write(vcpu, n, vgic_emul_lr(irq, virq));
+        return true;
+    }
+    if (vgic_pendq_has(vcpu->vgic, virq)) {
+        __atomic_and_fetch(&irq->state, ~VGIC_IRQ_ACTIVE, __ATOMIC_ACQ_REL);
+    } else {
+        __atomic_store_n(&irq->state, 0, __ATOMIC_RELEASE);
+    }
+    /* an LR with ICH_LR_EOI keeps its ICH_EISR_EL2 bit until written */
+    vgic_lr_write(vcpu, n, 0);
+    return false;
+}
+
+static void __vgic_used_lr_update(struct vcpu *vcpu)
+{
+    struct vgic_cpu *vgic = vcpu->vgic;
+    u32 empty = vgic_lr_empty(vcpu);
+    u32 used = ~empty & gic_lr_mask();
+    int n;
+
+    /* only a software LR can belong to an emulated interrupt */
+    for_each_lr(n, vgic->used_lr & empty) {
+        if (!(vcpu->gic.lr[n] & ICH_LR_HW) && vgic_lr_retire(vcpu, n)) {
+            used |= 1U << n;
+        }
+    }
+    vgic->used_lr = used;
+}
+
+void vgic_used_lr_update(struct vcpu *vcpu)
+{
+    spin_lock(&vcpu->vgic->lock);
+    __vgic_used_lr_update(vcpu);
+    spin_unlock(&vcpu->vgic->lock);
+}
+
+/*
+ * The 32 vgic_irq behind a register with one bit per interrupt, @intid is a
+ * multiple of 32. Block 0 is SGIs + PPIs of the vcpu, the others are SPIs,
+ * contiguous in vgic->spis.
+ */
+struct vgic_irq_blk {
+    struct vgic_irq *lo;    /* bits 0-15 */
+    struct vgic_irq *hi;    /* bits 16-31 */
+};
+
+static inline struct vgic_irq_blk vgic_irq_blk_get(struct vcpu *vcpu, int intid)
+{
+    struct vgic_irq_blk blk;
+
+    if (intid == 0) {
+        blk.lo = vcpu->vgic->sgis;
+        blk.hi = vcpu->vgic->ppis;
+    } else {
+        blk.lo = vgic_irq_get(vcpu, intid);
+        blk.hi = blk.lo + 16;
+    }
+    return blk;
+}
+
+static inline struct vgic_irq *vgic_irq_blk_at(struct vgic_irq_blk *blk, int i)
+{
+    return i < 16 ? &blk->lo[i] : &blk->hi[i - 16];
+}
+
 static void vgic_irq_enable(int intid)
 {
     if (is_sgi_ppi(intid) || is_spi(intid)) {
@@ -100,6 +298,68 @@ static void vgic_irq_disable(int intid)
     }
 }
 
+/* the vcpu an interrupt is delivered to, @vcpu itself for one of its private ones */
+static struct vcpu *vgic_irq_vcpu(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid)
+{
+    u8 mask = vgic_irq_rd(irq, target);
+    int id = mask ? __builtin_ctz(mask) : 0;
+
+    if (!is_spi(intid)) {
+        return vcpu;
+    }
+    return id < vcpu->vm->nvcpu ? vcpu->vm->vcpus[id] : vcpu->vm->vcpus[0];
+}
+
+/*
+ * Route passthrough @irq to the pcpu of the vcpu it targets now. Called with
+ * the vgic lock held, or while the VM is created. vgic_vcpu_load() moves the
+ * route along when the vcpu changes pcpu.
+ */
+static void vgic_hw_route(struct vm *vm, struct vgic_irq *irq)
+{
+    struct vgic_route *r = &g_vgic_route[irq->pintid - 32];
+    struct vcpu *vcpu = vgic_irq_vcpu(vm->vcpus[0], irq, irq->pintid);
+
+    __atomic_store_n(&r->vcpu, vcpu, __ATOMIC_RELEASE);
+    gic_set_target_by_affinity(irq->pintid, vcpu->pcpu);
+}
+
+static void vgic_irq_deliver(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid);
+static void vgic_irq_unpend(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid);
+static void vgic_irq_activate(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid, bool active);
+static u8 vgic_irq_state(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid);
+
+/*
+ * Make the physical enable of @intid follow irq->enabled. No lock: another
+ * vcpu may flip the bit meanwhile, so redo until the value applied last is
+ * still the current one. An emulated interrupt has no physical side, one
+ * that was raised while disabled is delivered now. The PPIs of a vcpu not
+ * loaded here are banked on another pcpu, vgic_vcpu_load() applies them.
+ */
+static void vgic_irq_enable_sync(struct vcpu *vcpu, struct vgic_irq *irq, int intid)
+{
+    u8 en;
+
+    if (!vgic_irq_rd(irq, hw)) {
+        if (vgic_irq_rd(irq, enabled) && (vgic_irq_rd(irq, state) & VGIC_IRQ_PENDING)) {
+            vgic_irq_deliver(vcpu, irq, intid);
+        }
+        return;
+    }
+    if (is_ppi(irq->pintid) && !vgic_loaded(vcpu)) {
+        return;
+    }
+    do {
+        en = vgic_irq_rd(irq, enabled);
+        if (en) {
+            vgic_irq_enable(irq->pintid);
+        } else {
+            vgic_irq_disable(irq->pintid);
+        }
+        dsb(sy);
+    } while (vgic_irq_rd(irq, enabled) != en);
+}
+
 static int vgicd_mmio_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio)
 {
     int ret = 0;
@@ -112,27 +372,13 @@ static int vgicd_mmio_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_
     switch (offset) {
         case GICD_CTLR:
         {
-            spin_lock(&g_vgic_lock);
             u64 ctlr = 0;
-            ctlr = (vgic->enable_grp1ns) ? GICD_CTLR_G1NS_EN : 0;
+            ctlr = __atomic_load_n(&vgic->enable_grp1ns, __ATOMIC_ACQUIRE) ? GICD_CTLR_G1NS_EN : 0;
             ctlr |= GICD_CTLR_ARE_NS | GICD_CTLR_G1NS_EN;
-            spin_unlock(&g_vgic_lock);
             *val = ctlr;
             LOG_INFO("[vgicd_mmio_read] read GICD_CTLR, val=0x%x\n", *val);
             break;
         }
-        case GICD_TYPER:
-            *val = (u64)gicd_r(GICD_TYPER);
-            LOG_INFO("[vgicd_mmio_read] read GICD_TYPER, val=0x%x\n", *val);
-            break;
-        case GICD_IIDR:
-            *val = (u64)gicd_r(GICD_IIDR);
-            LOG_INFO("[vgicd_mmio_read] read GICD_IIDR, val=0x%x\n", *val);
-            break;
-        case GICD_TYPER2:
-            *val = (u64)gicd_r(GICD_TYPER2);
-            LOG_INFO("[vgicd_mmio_read] read GICD_TYPER2, val=0x%x\n", *val);
-            break;
         case GICD_IGROUPR(0) ... GICD_IGROUPR(31):
             //【TODO】
             // 目前hyper针对VM读取GICD_IGROUPR<n>的操作不做处理, 默认所有VM的irq都是group1的
@@ -142,93 +388,26 @@ static int vgicd_mmio_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_
             LOG_INFO("[vgicd_mmio_read] read GICD_IGROUPR<%d>, val=0x%x\n",
                      (offset - GICD_IGROUPR(0)) / sizeof(u32), *val);
             break;
-        case GICD_ISENABLER(0) ... GICD_ISENABLER(31):
-        {
-            /* intid: 是GICD_ISENABLER<n>所代表中断号范围的起始中断号 */
-            intid = (offset - GICD_ISENABLER(0)) / sizeof(u32) * 32;
-            spin_lock(&g_vgic_lock);
-            for (int i = 0; i < 32; i++) {
-                vgic_irq = vgic_irq_get(vcpu, intid + i);
-                if (vgic_irq->enabled == 1) {
-                    val64 |= (1 << i);
-                }
-            }
-            spin_unlock(&g_vgic_lock);
-            *val = val64;
-            LOG_INFO("[vgicd_mmio_read] read GICD_ISENABLER<%d>, val=0x%x\n", 
-                     (offset - GICD_ISENABLER(0)) / sizeof(u32), *val);
-            break;
-        }
-        case GICD_ICENABLER(0) ... GICD_ICENABLER(31):
-            /* intid: GICD_ICENABLER<n>所代表中断号范围的起始中断号
-             *
-             * [Clear_enable_bit]
-             * - 0b0: If read, indicates that forwarding of the corresponding interrupt is disabled.
-             * - 0b1: If read, indicates that forwarding of the corresponding interrupt is enabled.
-             */
-            intid = (offset - GICD_ICENABLER(0)) / sizeof(u32) * 32;
-            spin_lock(&g_vgic_lock);
-            for (int i = 0; i < 32; i++) {
-                vgic_irq = vgic_irq_get(vcpu, intid + i);
-                if (vgic_irq->enabled == 0) {
-                    val64 |= (0 << i);
-                } else {
-                    val64 |= (1 << i);
-                }
-            }
-            spin_unlock(&g_vgic_lock);
-            *val = val64;
-            LOG_INFO("[vgicd_mmio_read] read GICD_ICENABLER<%d>, val=0x%x\n",
-                     (offset - GICD_ICENABLER(0)) / sizeof(u32), *val);
-            break;
-        // TODO: 这里VM对GICD_ISPENDR/ICPENDR/ISACTIVER/ICACTIVER的读操作, 这些寄存器的信息
-        //       应该记录在vgic_irq中, 但是目前还没有实现。我理解这些寄存器的值, 不是直接从真实
-        //       的GIC硬件中读取的, 而是从hyper维护的vgic_irq中获取
-        case GICD_ISPENDR(0) ... GICD_ISPENDR(31):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! read GICD_ISPENDR<%d> unsupported yet\n",
-                     (offset - GICD_ISPENDR(0)) / sizeof(u32));
-            break;
-        case GICD_ICPENDR(0) ... GICD_ICPENDR(31):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! read GICD_ICPENDR<%d> unsupported yet\n",
-                     (offset - GICD_ICPENDR(0)) / sizeof(u32));
-            break;
-        case GICD_ISACTIVER(0) ... GICD_ISACTIVER(31):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! read GICD_ISACTIVER<%d> unsupported yet\n",
-                     (offset - GICD_ISACTIVER(0)) / sizeof(u32));
-            break;
-        case GICD_ICACTIVER(0) ... GICD_ICACTIVER(31):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! read GICD_ICACTIVER<%d> unsupported yet\n",
-                     (offset - GICD_ICACTIVER(0)) / sizeof(u32));
-            break;
         case GICD_IPRIORITYR(0) ... GICD_IPRIORITYR(254):
             intid = (offset - GICD_IPRIORITYR(0)) / sizeof(u32) * 4;
-            spin_lock(&g_vgic_lock);
             for (int i = 0; i < 4; ++i) {
                 vgic_irq = vgic_irq_get(vcpu, intid + i);
-                val64 |= ((u32)vgic_irq->priority) << (i * 8);
+                val64 |= ((u32)vgic_irq_rd(vgic_irq, priority)) << (i * 8);
             }
-            spin_unlock(&g_vgic_lock);
             *val = val64;
             LOG_INFO("[vgicd_mmio_read] read GICD_IPRIORITYR<%d>, val=0x%x\n",
                      (offset - GICD_IPRIORITYR(0)) / sizeof(u32), *val);
             break;
         case GICD_ITARGETSR(0) ... GICD_ITARGETSR(254):
             intid = (offset - GICD_ITARGETSR(0)) / sizeof(u32) * 4;
-            spin_lock(&g_vgic_lock);
             for (int i = 0; i < 4; ++i) {
                 vgic_irq = vgic_irq_get(vcpu, intid + i);
-                val64 |= ((u32)vgic_irq->target) << (i * 8);
+                val64 |= ((u32)vgic_irq_rd(vgic_irq, target)) << (i * 8);
             }
-            spin_unlock(&g_vgic_lock);
             *val = val64;
             LOG_INFO("[vgicd_mmio_read] read GICD_ITARGETSR<%d>, val=0x%x\n",
                      (offset - GICD_ITARGETSR(0)) / sizeof(u32), *val);
             break;
-        case GICD_ICFGR(0) ... GICD_ICFGR(63):
-            /* Control whether interrupt is edge-triggered or level-sensitive */
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! read GICD_ICFGR<%d> not supported yet\n",
-                     (offset - GICD_ICFGR(0)) / sizeof(u32));
-            break;
         case GICD_IROUTER(32) ... GICD_IROUTER(1019):
             LOG_INFO("[vgicd_mmio_read] WARNING!!! read GICD_IROUTER<%d> not supported yet\n",
                      (offset - GICD_IROUTER(32)) / sizeof(u32));
@@ -253,7 +432,8 @@ static int vgicd_mmio_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_
     LOG_INFO("[vgicd_mmio_write]: offset=0x%x, val=0x%x\n", offset, val);
     switch (offset) {
         case GICD_CTLR:
-            vgic->enable_grp1ns = (val & GICD_CTLR_G1NS_EN) ? true : false;
+            __atomic_store_n(&vgic->enable_grp1ns, (val & GICD_CTLR_G1NS_EN) ? true : false,
+                             __ATOMIC_RELEASE);
             break;
         case GICD_TYPER:
         case GICD_IIDR:
@@ -265,88 +445,47 @@ static int vgicd_mmio_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_
                      (offset - GICD_IGROUPR(0)) / sizeof(u32), val);
             /* TODO: 这里hyper的处理默认所有VM中断都是group1的, 这里VM的写操作不作处理, 直接返回 */
             break;
-        case GICD_ISENABLER(0) ... GICD_ISENABLER(31):
-            LOG_INFO("[vgicd_mmio_write] write GICD_ISENABLER<%d>, val=0x%x\n",
-                     (offset - GICD_ISENABLER(0)) / sizeof(u32), val);
-            /*
-             * intid: GICD_ISENABLER<n>代表中断号范围的起始中断号, 该变量的值由offset计算得到的n决定
-             */
-            intid = (offset - GICD_ISENABLER(0)) / sizeof(u32) * 32;
-            spin_lock(&g_vgic_lock);
-            for (int i = 0; i < 32; i++) {
-                vgic_irq = vgic_irq_get(vcpu, intid + i);
-                if ((val >> i) & 0x1) {
-                    vgic_irq->enabled = 1;
-                    LOG_INFO("[vgicd_mmio_write] write GICD_ISENABLER to enable irq %d\n", intid + i);
-                    vgic_irq_enable(intid + i);
-                }
-            }
-            spin_unlock(&g_vgic_lock);
-            break;
-        case GICD_ICENABLER(0) ... GICD_ICENABLER(31):
-            LOG_INFO("[vgicd_mmio_write] write GICD_ICENABLER<%d>, val=0x%x\n",
-                     (offset - GICD_ICENABLER(0)) / sizeof(u32), val);
-            intid = (offset - GICD_ICENABLER(0)) / sizeof(u32) * 32;
-            spin_lock(&g_vgic_lock);
-            for (int i = 0; i < 32; i++) {
-                vgic_irq = vgic_irq_get(vcpu, intid + i);
-                if ((val >> i) & 0x1) {
-                    vgic_irq->enabled = 0;
-                    vgic_irq_disable(intid + i);
-                }
-            }
-            spin_unlock(&g_vgic_lock);
-            break;
-        case GICD_ISPENDR(0) ... GICD_ISPENDR(31):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! write GICD_ISPENDR<%d> unsupported yet\n",
-                     (offset - GICD_ISPENDR(0)) / sizeof(u32));
-            break;
-        case GICD_ICPENDR(0) ... GICD_ICPENDR(31):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! write GICD_ICPENDR<%d> unsupported yet\n",
-                     (offset - GICD_ICPENDR(0)) / sizeof(u32));
-            break;
-        case GICD_ISACTIVER(0) ... GICD_ISACTIVER(31):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! write GICD_ISACTIVER<%d> unsupported yet\n",
-                     (offset - GICD_ISACTIVER(0)) / sizeof(u32));
-            break;
-        case GICD_ICACTIVER(0) ... GICD_ICACTIVER(31):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! write GICD_ICACTIVER<%d> unsupported yet\n",
-                     (offset - GICD_ICACTIVER(0)) / sizeof(u32));
-            break;
         case GICD_IPRIORITYR(0) ... GICD_IPRIORITYR(254):
             LOG_INFO("[vgicd_mmio_write] write GICD_IPRIORITYR<%d>, val=0x%x\n",
                      (offset - GICD_IPRIORITYR(0)) / sizeof(u32), val);
             intid = (offset - GICD_IPRIORITYR(0)) / sizeof(u32) * 4;
             for (int i = 0; i < 4; ++i) {
                 vgic_irq = vgic_irq_get(vcpu, intid + i);
-                vgic_irq->priority = (val >> (i * 8)) & 0xff;
+                vgic_irq_wr(vgic_irq, priority, (val >> (i * 8)) & 0xff);
             }
             break;
         case GICD_ITARGETSR(0) ... GICD_ITARGETSR(254):
             LOG_INFO("[vgicd_mmio_write] write GICD_ITARGETSR<%d>, val=0x%x\n",
                      (offset - GICD_ITARGETSR(0)) / sizeof(u32), val);
             intid = (offset - GICD_ITARGETSR(0)) / sizeof(u32) * 4;
-            spin_lock(&g_vgic_lock);
+            vgic_lock(vgic);
             for (int i = 0; i < 4; ++i) {
                 vgic_irq = vgic_irq_get(vcpu, intid + i);
-                vgic_irq->target = (u8)((val >> (i * 8)) & 0xff);
+                vgic_irq_wr(vgic_irq, target, (u8)((val >> (i * 8)) & 0xff));
                 if (is_spi(intid + i)) {
-                    gic_set_target_by_pe_field(intid + i, vgic_irq->target);
+                    /* an emulated SPI is routed by vgic_irq_deliver() alone */
+                    if (vgic_irq_rd(vgic_irq, hw)) {
+                        vgic_hw_route(vcpu->vm, vgic_irq);
+                    }
                 } else {
-                    spin_unlock(&g_vgic_lock);
+                    vgic_unlock(vgic);
                     panic("[vgicd_mmio_write] invalid intid=%d\n", intid + i);
                 }
             }
-            spin_unlock(&g_vgic_lock);
-            break;
-        case GICD_ICFGR(0) ... GICD_ICFGR(63):
-            LOG_INFO("[vgicd_mmio_read] WARNING!!! write GICD_ICFGR<%d> not supported yet\n",
-                     (offset - GICD_ICFGR(0)) / sizeof(u32));
+            vgic_unlock(vgic);
             break;
         case GICD_IROUTER(32) ... GICD_IROUTER(1019):
             LOG_INFO("[vgicd_mmio_write] write GICD_IROUTER<%d> val = 0x%x\n",
                      (offset - 0x6000) / 8, val);
-            gic_set_target_by_affinity((offset - 0x6000) / 8, val);
+            intid = (offset - 0x6000) / 8;
+            vgic_irq = vgic_irq_get(vcpu, intid);
+            /* vcpu n is Aff0 n, IRM (any vcpu) is taken as vcpu 0 */
+            vgic_irq_wr(vgic_irq, target, (val & 0xff) < 8 ? 1 << (val & 0xff) : 0);
+            if (vgic_irq_rd(vgic_irq, hw)) {
+                vgic_lock(vgic);
+                vgic_hw_route(vcpu->vm, vgic_irq);
+                vgic_unlock(vgic);
+            }
             break;
         default:
             LOG_WARN("[vgicd_mmio_write]: unknown offset 0x%x\n", offset);
@@ -403,64 +542,18 @@ static int vgicr_mmio_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_
             LOG_INFO("[vgicr_mmio_read] read GICR_IGROUPR0, val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
                      *val, offset, gicr_idx, gicr_off);
             break;
-        case GICR_ISENABLER0:
-        case GICR_ICENABLER0:
-            for (int i = 0; i < 32; ++i) {
-                vgic_irq = vgic_irq_get(vcpu, i);
-                if (vgic_irq->enabled == 1) {
-                    val64 |= 1 << i;
-                }
-            }
-            *val = val64;
-            LOG_INFO("[vgicr_mmio_read] read %s, val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     (offset == GICR_ISENABLER0 ? "GICR_ISENABLER0" : "GICR_ICENABLER0"),
-                     *val, offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ISPENDR0:
-            *val = 0;
-            LOG_INFO("[vgicr_mmio_read] WARNING!!! read GICR_ISPENDR0 unsupported yet"
-                     "(offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ICPENDR0:
-            *val = 0;
-            LOG_INFO("[vgicr_mmio_read] WARNING!!! read GICR_ICPENDR0 unsupported yet"
-                     "(offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ISACTIVER0:
-            *val = 0;
-            LOG_INFO("[vgicr_mmio_read] WARNING!!! read GICR_ISACTIVER0 unsupported yet"
-                     "(offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ICACTIVER0:
-            *val = 0;
-            LOG_INFO("[vgicr_mmio_read] WARNING!!! read GICR_ICACTIVER0 unsupported yet"
-                     "(offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     offset, gicr_idx, gicr_off);
-            break;
         case GICR_IPRIORITYR(0) ... GICR_IPRIORITYR(7):
             /* GICR_IPRIORITYR0-GICR_IPRIORITYR3 store the priority of SGIs.
              * GICR_IPRIORITYR4-GICR_IPRIORITYR7 store the priority of PPIs. */
             intid = (offset - GICR_IPRIORITYR(0)) / sizeof(u32) * 4;
             for(int i = 0; i < 4; i++) {
                 vgic_irq = vgic_irq_get(vcpu, intid + i);
-                val64 |= vgic_irq->priority << (i * 8);
+                val64 |= vgic_irq_rd(vgic_irq, priority) << (i * 8);
             }
             *val = val64;
             LOG_INFO("[vgicr_mmio_read] read GICR_IPRIORITYR<%d>, val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
                      (offset - GICR_IPRIORITYR(0)) / sizeof(u32), *val, offset, gicr_idx, gicr_off);
             break;
-        case GICR_ICFGR0:
-            /* SGIs are always edge-triggered */
-            for (int i = 0; i < 16; ++i) {
-                val64 |= (0b10 << i);
-            }
-            *val = val64;
-            LOG_INFO("[vgicr_mmio_read] read GICR_ICFGR0, val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     *val, offset, gicr_idx, gicr_off);
-            break;
         default:
             LOG_INFO("[vgicr_mmio_read]: unknown/unsupported offset 0x%x, gicr_idx=%d, gicr_off=0x%x\n",
                      offset, gicr_idx, gicr_off);
@@ -512,64 +605,17 @@ static int vgicr_mmio_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_
             LOG_INFO("[vgicr_mmio_write] write GICR_IGROUPR0, val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
                      val, offset, gicr_idx, gicr_off);
             break;
-        case GICR_ISENABLER0:
-            for (int i = 0; i < 32; ++i) {
-                vgic_irq = vgic_irq_get(vcpu, i);
-                if ((val >> i) & 0x1) {
-                    vgic_irq->enabled = 1;
-                    vgic_irq_enable(i);
-                }
-            }
-            LOG_INFO("[vgicr_mmio_write] write GICR_ISENABLER0, val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     val, offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ICENABLER0:
-            for (int i = 0; i < 32; ++i) {
-                vgic_irq = vgic_irq_get(vcpu, i);
-                if ((val >> i) & 0x1) {
-                    vgic_irq->enabled = 0;
-                    vgic_irq_disable(i);
-                }
-            }
-            LOG_INFO("[vgicr_mmio_write] write GICR_ICENABLER0, val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     val, offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ISPENDR0:
-            LOG_INFO("[vgicr_mmio_write] WARNING!!! write GICR_ISPENDR0 unsupported yet, val=0x%x "
-                     "(offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     val, offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ICPENDR0:
-            LOG_INFO("[vgicr_mmio_write] WARNING!!! write GICR_ICPENDR0 unsupported yet, val=0x%x "
-                     "(offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     val, offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ISACTIVER0:
-            LOG_INFO("[vgicr_mmio_write] WARNING!!! write GICR_ISACTIVER0 unsupported yet, val=0x%x "
-                     "(offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     val, offset, gicr_idx, gicr_off);
-            break;
-        case GICR_ICACTIVER0:
-            LOG_INFO("[vgicr_mmio_write] WARNING!!! write GICR_ICACTIVER0 unsupported yet, val=0x%x "
-                     "(offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     val, offset, gicr_idx, gicr_off);
-            break;
         case GICR_IPRIORITYR(0) ... GICR_IPRIORITYR(7):
             /* GICR_IPRIORITYR0-GICR_IPRIORITYR3 store the priority of SGIs.
              * GICR_IPRIORITYR4-GICR_IPRIORITYR7 store the priority of PPIs. */
             intid = (offset - GICR_IPRIORITYR(0)) / sizeof(u32) * 4;
             for(int i = 0; i < 4; i++) {
                 vgic_irq = vgic_irq_get(vcpu, intid + i);
-                vgic_irq->priority = (val >> (i * 8)) & 0xff;
+                vgic_irq_wr(vgic_irq, priority, (val >> (i * 8)) & 0xff);
             }
             LOG_INFO("[vgicr_mmio_write] write GICR_IPRIORITYR<%d>, val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
                      (offset - GICR_IPRIORITYR(0)) / sizeof(u32), val, offset, gicr_idx, gicr_off);
             break;
-        case GICR_ICFGR0:
-            /* SGIs are always edge-triggered */
-            LOG_INFO("[vgicr_mmio_write] write GICR_ICFGR0 val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
-                     val, offset, gicr_idx, gicr_off);
-            break;
         case GICR_IGRPMODR0:
             LOG_INFO("[vgicr_mmio_write] write GICR_ICFGR0 val=0x%x (offset=0x%x, gicr_idx=%d, gicr_off=0x%x)\n",
                      val, offset, gicr_idx, gicr_off);
@@ -584,81 +630,1048 @@ static int vgicr_mmio_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_
     return ret;
 }
 
-struct vgic *new_vgic(struct vm *vm)
+/*
+ * Sub-handlers of the enable registers, the registers a guest touches at
+ * runtime. They are dispatched directly by mmio_emulate() (see mmio.h) and
+ * skip the big switch of vgicd/vgicr_mmio_read/write.
+ */
+
+/* GICD_TYPER/IIDR/TYPER2: constant, served on the fast exit path */
+static int vgicd_id_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio)
 {
-    struct vgic *vgic = vgic_alloc();
-    if (NULL == vgic) {
-        panic("[new_vgic] no mem");
-        return NULL;
-    }
+    *val = (u64)gicd_r(offset);
+    return 0;
+}
 
-    vgic->max_spi_intid = gic_max_spi();
-    vgic->spi_nums = vgic->max_spi_intid - 31;
-    vgic->enable_grp1ns = 0;
-    vgic->spis = (struct vgic_irq *)alloc_page();
+/* GICD_ISENABLER<n> and GICD_ICENABLER<n> read the same enable bits */
+static int vgicd_enabler_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio)
+{
+    /* intid: 是GICD_I[SC]ENABLER<n>所代表中断号范围的起始中断号 */
+    int intid = (offset % (GICD_ICENABLER(0) - GICD_ISENABLER(0))) / sizeof(u32) * 32;
+    struct vgic_irq_blk blk = vgic_irq_blk_get(vcpu, intid);
+    u64 val64 = 0;
 
-    s2_pt_trap(vm, GICDBASE, GICDSIZE, vgicd_mmio_read, vgicd_mmio_write);
-    s2_pt_trap(vm, GICRBASE, GICRSIZE, vgicr_mmio_read, vgicr_mmio_write);
+    for (int i = 0; i < 32; i++) {
+        if (vgic_irq_rd(vgic_irq_blk_at(&blk, i), enabled)) {
+            val64 |= (1 << i);
+        }
+    }
+    *val = val64 & vgic_guest_mask(intid);
+    return 0;
+}
 
-    return vgic;
+static int vgicd_enabler_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio)
+{
+    int enable = offset < GICD_ICENABLER(0);
+    int intid = (offset % (GICD_ICENABLER(0) - GICD_ISENABLER(0))) / sizeof(u32) * 32;
+    struct vgic_irq_blk blk = vgic_irq_blk_get(vcpu, intid);
+
+    val &= vgic_guest_mask(intid);
+    for (int i = 0; i < 32; i++) {
+        if ((val >> i) & 0x1) {
+            struct vgic_irq *irq = vgic_irq_blk_at(&blk, i);
+            vgic_irq_wr(irq, enabled, enable);
+            vgic_irq_enable_sync(vcpu, irq, intid + i);
+        }
+    }
+    return 0;
 }
 
-struct vgic_cpu *new_vgic_cpu(int vcpuid)
+/* vcpu owning the redistributor frame at @offset, NULL if out of range */
+static struct vcpu *vgicr_vcpu(struct vcpu *vcpu, u64 offset)
 {
-    struct vgic_cpu *vgic_cpu = vgic_cpu_alloc();
-    if (NULL == vgic_cpu) {
+    u32 gicr_idx = offset / GICRSTRIDE;
+
+    if (gicr_idx > vcpu->vm->nvcpu - 1) {
+        LOG_ERR("[vgicr_vcpu] ERROR: invalid gicr_idx=%d, nvcpu=%d, offset=0x%x\n",
+               gicr_idx, vcpu->vm->nvcpu, offset);
         return NULL;
     }
+    return vcpu->vm->vcpus[gicr_idx];
+}
 
-    vgic_cpu->used_lr = 0;
-    for (int i = 0; i < GIC_NSGI; ++i) {
-        vgic_cpu->sgis[i].enabled = 1;
-        vgic_cpu->sgis[i].target = vcpuid;
+/* GICR_ISENABLER0 and GICR_ICENABLER0 read the same enable bits */
+static int vgicr_enabler_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio)
+{
+    u64 val64 = 0;
+
+    vcpu = vgicr_vcpu(vcpu, offset);
+    if (NULL == vcpu) {
+        return -1;
     }
-    
-    for (int i = 0; i < GIC_NPPI; ++i) {
-        vgic_cpu->ppis[i].enabled = 0;
-        vgic_cpu->ppis[i].target = vcpuid;
+    struct vgic_irq_blk blk = vgic_irq_blk_get(vcpu, 0);
+    for (int i = 0; i < 32; ++i) {
+        if (vgic_irq_rd(vgic_irq_blk_at(&blk, i), enabled)) {
+            val64 |= 1 << i;
+        }
     }
+    *val = val64 & vgic_guest_mask(0);
+    return 0;
+}
 
-    return vgic_cpu;
+static int vgicr_enabler_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio)
+{
+    int enable = (offset % GICRSTRIDE) == GICR_ISENABLER0;
+
+    vcpu = vgicr_vcpu(vcpu, offset);
+    if (NULL == vcpu) {
+        return -1;
+    }
+    struct vgic_irq_blk blk = vgic_irq_blk_get(vcpu, 0);
+    val &= vgic_guest_mask(0);
+    for (int i = 0; i < 32; ++i) {
+        if ((val >> i) & 0x1) {
+            struct vgic_irq *irq = vgic_irq_blk_at(&blk, i);
+            vgic_irq_wr(irq, enabled, enable);
+            vgic_irq_enable_sync(vcpu, irq, i);
+        }
+    }
+    return 0;
 }
 
-int vgic_inject_virq(struct vcpu *vcpu, u32 pirq, u32 virq, int group)
+/* I[SC]PENDR and I[SC]ACTIVER, in the order of their GICD/GICR frames */
+#define VGIC_ISPEND     0
+#define VGIC_ICPEND     1
+#define VGIC_ISACTIVE   2
+#define VGIC_ICACTIVE   3
+#define VGIC_STATE_REGS (GICD_ICPENDR(0) - GICD_ISPENDR(0))
+
+/*
+ * The physical PPIs are banked per pcpu: only those of the loaded vcpu can be
+ * reached, never the SGIs nor the PPIs of the hypervisor.
+ */
+static u32 vgicr_hw_mask(struct vcpu *vcpu)
 {
-    struct vgic_cpu *vgic = vcpu->vgic;
+    if (!vgic_loaded(vcpu)) {
+        return 0;
+    }
+    return 0xffff0000 & ~VGIC_HYP_PPI_MASK;
+}
 
-    u64 lr_val = gic_make_lr(pirq, virq, group);
+/* the physical register of @kind, from GICD_ISPENDR<n> or GICR_ISPENDR0 on, holding hw @irq */
+static bool vgic_hw_state_reg(struct vcpu *vcpu, struct vgic_irq *irq, int kind, u32 *reg)
+{
+    u32 pintid = irq->pintid;
 
-    int n = vgic_lr_alloc(vgic);
-    if (n < 0) {
-        /* TODO: 缓存该物理中断 */
-        LOG_ERR("[vgic_inject_virq]: WARNING!!! failed to inject virq\n");
-        return -1;
+    if (is_spi(pintid)) {
+        *reg = GICD_ISPENDR(pintid / 32) + kind * VGIC_STATE_REGS;
+        return true;
     }
+    *reg = GICR_ISPENDR0 + kind * VGIC_STATE_REGS;
+    return (vgicr_hw_mask(vcpu) >> pintid) & 0x1;
+}
 
-    gic_write_lr(n, lr_val);
+static bool vgic_hw_state(struct vcpu *vcpu, struct vgic_irq *irq, int kind)
+{
+    u32 reg;
+
+    if (!vgic_hw_state_reg(vcpu, irq, kind, &reg)) {
+        return false;
+    }
+    if (is_spi(irq->pintid)) {
+        return (gicd_r(reg) >> (irq->pintid % 32)) & 0x1;
+    }
+    return (gicr_r32(cpuid(), reg) >> irq->pintid) & 0x1;
+}
 
-    // LOG_INFO("[vgic_inject_virq]: pirq=%d, virq=%d, group=%d, lr<%d>=0x%x, pcpu=%d\n",
-    //        pirq, virq, group, n, gic_read_lr(n), cpuid());
+/* the set and clear registers only act on the bits written as 1 */
+static void vgic_hw_state_write(struct vcpu *vcpu, struct vgic_irq *irq, int kind)
+{
+    u32 reg;
 
-    return 0;
+    if (!vgic_hw_state_reg(vcpu, irq, kind, &reg)) {
+        return;
+    }
+    if (is_spi(irq->pintid)) {
+        gicd_w(reg, 1U << (irq->pintid % 32));
+    } else {
+        gicr_w32(cpuid(), reg, 1U << irq->pintid);
+    }
 }
 
-void vgic_restore_state(struct vgic_cpu *vgic)
+/* a state register of @kind for the 32 irqs from @intid */
+static u32 vgic_state_read(struct vcpu *vcpu, int intid, int kind)
 {
-    return;
+    u8 bit = kind < VGIC_ISACTIVE ? VGIC_IRQ_PENDING : VGIC_IRQ_ACTIVE;
+    struct vgic_irq_blk blk = vgic_irq_blk_get(vcpu, intid);
+    u32 val = 0;
+
+    for (int i = 0; i < 32; ++i) {
+        struct vgic_irq *irq = vgic_irq_blk_at(&blk, i);
+        if (vgic_irq_rd(irq, hw)) {
+            val |= (u32)vgic_hw_state(vcpu, irq, kind) << i;
+        } else if (vgic_irq_state(vcpu, irq, intid + i) & bit) {
+            val |= 1U << i;
+        }
+    }
+    return val & vgic_guest_mask(intid);
+}
+
+static void vgic_state_write(struct vcpu *vcpu, int intid, int kind, u32 val)
+{
+    struct vgic_irq_blk blk = vgic_irq_blk_get(vcpu, intid);
+
+    val &= vgic_guest_mask(intid);
+    for (int i = 0; i < 32; ++i) {
+        if (!((val >> i) & 0x1)) {
+            continue;
+        }
+        struct vgic_irq *irq = vgic_irq_blk_at(&blk, i);
+        if (vgic_irq_rd(irq, hw)) {
+            vgic_hw_state_write(vcpu, irq, kind);
+            continue;
+        }
+        switch (kind) {
+            case VGIC_ISPEND:
+                __atomic_or_fetch(&irq->state, VGIC_IRQ_PENDING, __ATOMIC_ACQ_REL);
+                if (vgic_irq_rd(irq, enabled)) {
+                    vgic_irq_deliver(vcpu, irq, intid + i);
+                }
+                break;
+            case VGIC_ICPEND:
+                vgic_irq_unpend(vcpu, irq, intid + i);
+                break;
+            default:
+                vgic_irq_activate(vcpu, irq, intid + i, kind == VGIC_ISACTIVE);
+                break;
+        }
+    }
+}
+
+/* GICD_ISPENDR<n> ... GICD_ICACTIVER<n>, block 0 is RAZ/WI with affinity routing */
+static int vgicd_state_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio)
+{
+    int kind = (offset - GICD_ISPENDR(0)) / VGIC_STATE_REGS;
+    int intid = (offset % VGIC_STATE_REGS) / sizeof(u32) * 32;
+
+    *val = intid ? vgic_state_read(vcpu, intid, kind) : 0;
+    return 0;
+}
+
+static int vgicd_state_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio)
+{
+    int kind = (offset - GICD_ISPENDR(0)) / VGIC_STATE_REGS;
+    int intid = (offset % VGIC_STATE_REGS) / sizeof(u32) * 32;
+
+    if (intid) {
+        vgic_state_write(vcpu, intid, kind, val);
+    }
+    return 0;
+}
+
+/* GICR_ISPENDR0 ... GICR_ICACTIVER0 */
+static int vgicr_state_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio)
+{
+    u32 reg = offset % GICRSTRIDE;
+
+    vcpu = vgicr_vcpu(vcpu, offset);
+    if (NULL == vcpu) {
+        return -1;
+    }
+    *val = vgic_state_read(vcpu, 0, (reg - GICR_ISPENDR0) / VGIC_STATE_REGS);
+    return 0;
+}
+
+static int vgicr_state_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio)
+{
+    u32 reg = offset % GICRSTRIDE;
+
+    vcpu = vgicr_vcpu(vcpu, offset);
+    if (NULL == vcpu) {
+        return -1;
+    }
+    vgic_state_write(vcpu, 0, (reg - GICR_ISPENDR0) / VGIC_STATE_REGS, val);
+    return 0;
+}
+
+/* ICFGR: 2 bits for each of the 16 irqs from @intid, 0b10 edge-triggered, 0b00 level-sensitive */
+static u32 vgic_cfg_read(struct vcpu *vcpu, int intid)
+{
+    u32 val = 0;
+
+    for (int i = 0; i < 16; ++i) {
+        struct vgic_irq *irq = vgic_irq_get(vcpu, intid + i);
+        u32 pintid = irq->pintid;
+        if (!vgic_irq_rd(irq, hw)) {
+            val |= vgic_irq_rd(irq, level) ? 0 : 0x2U << (i * 2);
+        } else if (is_spi(pintid)) {
+            val |= ((gicd_r(GICD_ICFGR(pintid / 16)) >> (pintid % 16 * 2)) & 0x3) << (i * 2);
+        } else {
+            val |= ((gicr_r32(cpuid(), GICR_ICFGR0 + pintid / 16 * 4) >> (pintid % 16 * 2)) & 0x3) << (i * 2);
+        }
+    }
+    return val;
+}
+
+/*
+ * The emulated irqs take their trigger from @val, a passthrough SPI has its
+ * physical one set. The physical config of the PPIs is the hypervisor's.
+ */
+static void vgic_cfg_write(struct vcpu *vcpu, int intid, u32 val)
+{
+    /* SGIs are always edge-triggered */
+    for (int i = is_sgi(intid) ? GIC_NSGI : 0; i < 16; ++i) {
+        struct vgic_irq *irq = vgic_irq_get(vcpu, intid + i);
+        u32 cfg = (val >> (i * 2)) & 0x3;
+        u32 pintid = irq->pintid;
+        if (!vgic_irq_rd(irq, hw)) {
+            vgic_irq_wr(irq, level, !(cfg & 0x2));
+        } else if (is_spi(pintid)) {
+            /* the other fields of the register may belong to other VMs */
+            spin_lock(&g_vgic_gicd_lock);
+            u32 reg = gicd_r(GICD_ICFGR(pintid / 16)) & ~(0x3U << (pintid % 16 * 2));
+            gicd_w(GICD_ICFGR(pintid / 16), reg | (cfg << (pintid % 16 * 2)));
+            spin_unlock(&g_vgic_gicd_lock);
+        }
+    }
+}
+
+/* GICD_ICFGR<n>, ICFGR0/1 are RAZ/WI with affinity routing */
+static int vgicd_cfg_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio)
+{
+    int intid = (offset - GICD_ICFGR(0)) / sizeof(u32) * 16;
+
+    *val = is_spi(intid) ? vgic_cfg_read(vcpu, intid) : 0;
+    return 0;
+}
+
+static int vgicd_cfg_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio)
+{
+    int intid = (offset - GICD_ICFGR(0)) / sizeof(u32) * 16;
+
+    if (is_spi(intid)) {
+        vgic_cfg_write(vcpu, intid, val);
+    }
+    return 0;
+}
+
+/* GICR_ICFGR0/1 */
+static int vgicr_cfg_read(struct vcpu *vcpu, u64 offset, u64 *val, struct mmio_access *mmio)
+{
+    u32 reg = offset % GICRSTRIDE;
+
+    vcpu = vgicr_vcpu(vcpu, offset);
+    if (NULL == vcpu) {
+        return -1;
+    }
+    *val = vgic_cfg_read(vcpu, (reg - GICR_ICFGR0) / sizeof(u32) * 16);
+    return 0;
+}
+
+static int vgicr_cfg_write(struct vcpu *vcpu, u64 offset, u64 val, struct mmio_access *mmio)
+{
+    u32 reg = offset % GICRSTRIDE;
+
+    vcpu = vgicr_vcpu(vcpu, offset);
+    if (NULL == vcpu) {
+        return -1;
+    }
+    vgic_cfg_write(vcpu, (reg - GICR_ICFGR0) / sizeof(u32) * 16, val);
+    return 0;
+}
+
+static const struct mmio_reg vgicd_regs[] = {
+    { GICD_TYPER, GICD_TYPER2 + 4 - GICD_TYPER, vgicd_id_read, NULL, MMIO_REG_FAST },
+    { GICD_ISENABLER(0), GICD_ICENABLER(31) + 4 - GICD_ISENABLER(0), vgicd_enabler_read, vgicd_enabler_write },
+    { GICD_ISPENDR(0), GICD_ICACTIVER(31) + 4 - GICD_ISPENDR(0), vgicd_state_read, vgicd_state_write },
+    { GICD_ICFGR(0), GICD_ICFGR(63) + 4 - GICD_ICFGR(0), vgicd_cfg_read, vgicd_cfg_write },
+};
+
+/* matched on the offset within one redistributor frame */
+static const struct mmio_reg vgicr_regs[] = {
+    { GICR_ISENABLER0, 4, vgicr_enabler_read, vgicr_enabler_write },
+    { GICR_ICENABLER0, 4, vgicr_enabler_read, vgicr_enabler_write },
+    { GICR_ISPENDR0, 4, vgicr_state_read, vgicr_state_write },
+    { GICR_ICPENDR0, 4, vgicr_state_read, vgicr_state_write },
+    { GICR_ISACTIVER0, 4, vgicr_state_read, vgicr_state_write },
+    { GICR_ICACTIVER0, 4, vgicr_state_read, vgicr_state_write },
+    { GICR_ICFGR0, GICR_ICFGR1 + 4 - GICR_ICFGR0, vgicr_cfg_read, vgicr_cfg_write },
+};
+
+struct vgic *new_vgic(struct vm *vm)
+{
+    struct vgic *vgic = vgic_alloc();
+    if (NULL == vgic) {
+        panic("[new_vgic] no mem");
+        return NULL;
+    }
+
+    vgic->max_spi_intid = gic_max_spi();
+    vgic->spi_nums = vgic->max_spi_intid - 31;
+    vgic->enable_grp1ns = 0;
+    vgic->lock_acquired = 0;
+    vgic->lock_contended = 0;
+    vgic->nhw = 0;
+    vgic->spis = (struct vgic_irq *)alloc_pages((VGIC_SPI_MAX * sizeof(struct vgic_irq) + PAGE_SIZE - 1) / PAGE_SIZE);
+    /* an SPI is emulated with nothing behind it until given to the VM, see
+     * vgic_irq_passthrough() and vgic_irq_emulated() */
+    memset(vgic->spis, 0, VGIC_SPI_MAX * sizeof(struct vgic_irq));
+
+    s2_pt_trap(vm, GICDBASE, GICDSIZE, vgicd_mmio_read, vgicd_mmio_write, NULL);
+    s2_pt_trap(vm, GICRBASE, GICRSIZE, vgicr_mmio_read, vgicr_mmio_write, NULL);
+    if (mmio_reg_subhandlers(vm, GICDBASE, vgicd_regs, sizeof(vgicd_regs) / sizeof(vgicd_regs[0]), 0) < 0 ||
+        mmio_reg_subhandlers(vm, GICRBASE, vgicr_regs, sizeof(vgicr_regs) / sizeof(vgicr_regs[0]), GICRSTRIDE) < 0) {
+        panic("[new_vgic]: can not attach the GICD/GICR registers, vm=%s\n", vm->name);
+    }
+
+    return vgic;
+}
+
+struct vgic_cpu *new_vgic_cpu(int vcpuid)
+{
+    struct vgic_cpu *vgic_cpu = vgic_cpu_alloc();
+    if (NULL == vgic_cpu) {
+        return NULL;
+    }
+
+    spinlock_init(&vgic_cpu->lock);
+    vgic_cpu->pcpu = -1;
+    vgic_cpu->loaded = 0;
+    vgic_cpu->used_lr = 0;
+    vgic_cpu->pendq_len = 0;
+    memset(vgic_cpu->sgis, 0, sizeof(vgic_cpu->sgis));
+    memset(vgic_cpu->ppis, 0, sizeof(vgic_cpu->ppis));
+    /* SGIs are emulated, the physical ones are the hypervisor's, see vgic_sgi1r_write() */
+    for (int i = 0; i < GIC_NSGI; ++i) {
+        vgic_cpu->sgis[i].enabled = 1;
+        vgic_cpu->sgis[i].target = vcpuid;
+    }
+    
+    for (int i = 0; i < GIC_NPPI; ++i) {
+        vgic_cpu->ppis[i].enabled = 0;
+        vgic_cpu->ppis[i].target = vcpuid;
+        vgic_cpu->ppis[i].hw = 1;
+        vgic_cpu->ppis[i].pintid = GIC_NSGI + i;
+    }
+
+    return vgic_cpu;
+}
+
+/*
+ * Queue @lr for @vcpu, behind the vIRQs of higher or equal priority.
+ * The physical interrupt of a HW LR stays active meanwhile, it can not fire
+ * again before the guest deactivates the vIRQ.
+ */
+static int vgic_pendq_push(struct vgic_cpu *vgic, u64 lr, u64 stamp)
+{
+    int i = vgic->pendq_len;
+
+    if (i == VGIC_PENDQ_MAX) {
+        return -1;
+    }
+    for (; i > 0 && ICH_LR_PRIO(vgic->pendq[i - 1].lr) > ICH_LR_PRIO(lr); --i) {
+        vgic->pendq[i] = vgic->pendq[i - 1];
+    }
+    vgic->pendq[i].lr = lr;
+    vgic->pendq[i].stamp = stamp;
+    vgic->pendq_len++;
+    return 0;
+}
+
+static void vgic_pendq_del(struct vgic_cpu *vgic, int idx)
+{
+    vgic->pendq_len--;
+    for (int i = idx; i < vgic->pendq_len; ++i) {
+        vgic->pendq[i] = vgic->pendq[i + 1];
+    }
+}
+
+static void vgic_pendq_pop(struct vgic_cpu *vgic)
+{
+    vgic_pendq_del(vgic, 0);
+}
+
+/* the pending-only LR of lowest priority below @prio, -1 if none */
+static int vgic_lr_victim(struct vcpu *vcpu, u8 prio)
+{
+    int victim = -1;
+    int i;
+
+    /* the priority is taken from the shadow, it never changes in the LR */
+    for_each_lr(i, vcpu->vgic->used_lr) {
+        u8 p = ICH_LR_PRIO(vcpu->gic.lr[i]);
+        if (p > prio && (victim < 0 || p > ICH_LR_PRIO(vcpu->gic.lr[victim])) &&
+            lr_is_pending(vgic_lr_read(vcpu, i))) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Move queued vIRQs into the LRs: into free ones first, then in place of a
+ * pending LR of lower priority (which goes back to the queue), so the
+ * highest priority vIRQs are always the ones the guest can see.
+ */
+static void vgic_lr_refill(struct vcpu *vcpu)
+{
+    struct vgic_cpu *vgic = vcpu->vgic;
+    u64 now = get_syscount();
+
+    __vgic_used_lr_update(vcpu);
+    while (vgic->pendq_len > 0) {
+        struct vgic_pend head = vgic->pendq[0];
+        int n = vgic_lr_find(vcpu, ICH_LR_VINTID(head.lr));
+
+        if (n >= 0) {
+            /* raised again from another pcpu while it was still in an LR */
+            u64 lr = vgic_lr_read(vcpu, n);
+            if (lr_is_active(lr)) {
+                vgic_lr_write(vcpu, n, (lr & ~ICH_LR_STATE(LR_MASK)) | ICH_LR_STATE(LR_PENDACT));
+            }
+            vgic_pendq_pop(vgic);
+            continue;
+        }
+        n = vgic_lr_alloc(vgic);
+
+        if (n < 0) {
+            n = vgic_lr_victim(vcpu, ICH_LR_PRIO(head.lr));
+            if (n < 0) {
+                break;
+            }
+            vgic_pendq_pop(vgic);
+            vgic_pendq_push(vgic, vgic_lr_read(vcpu, n), now);
+        } else {
+            vgic_pendq_pop(vgic);
+        }
+        vgic_lr_write(vcpu, n, head.lr);
+        exit_stat_add(&vcpu->stats.vgic[VGIC_PENDQ_REFILL], now - head.stamp);
+    }
+}
+
+/*
+ * Maintenance interrupts of the loaded @vcpu while vIRQs are queued:
+ * UIE fires once the guest has EOIed all but one LR; NPIE as soon as it has
+ * acknowledged every pending LR, only armed while one is pending, as with
+ * all LRs active nothing could be refilled and it would fire in a loop.
+ */
+static void vgic_hcr_update(struct vcpu *vcpu)
+{
+    u64 hcr = ICH_HCR_EN;
+    int i;
+
+    if (vcpu->vgic->pendq_len > 0) {
+        hcr |= ICH_HCR_UIE;
+        for_each_lr(i, vcpu->vgic->used_lr) {
+            if (lr_is_pending(vgic_lr_read(vcpu, i))) {
+                hcr |= ICH_HCR_NPIE;
+                break;
+            }
+        }
+    }
+    write_sysreg(ich_hcr_el2, hcr);
+}
+
+/*
+ * Put @lr_val into an LR of @vcpu, or queue it. @pirq is the physical
+ * interrupt of a HW LR, 0 for an emulated one. Called with vgic->lock held.
+ */
+static int vgic_lr_inject(struct vcpu *vcpu, u32 pirq, u64 lr_val)
+{
+    struct vgic_cpu *vgic = vcpu->vgic;
+    u32 virq = ICH_LR_VINTID(lr_val);
+    int i;
+
+    /* a vINTID must never sit in two LRs: merge into the one already holding it.
+     * Only a software LR (see vgic_vcpu_put()) can meet its interrupt again, the
+     * physical one is then not linked to any LR and is deactivated here. */
+    i = vgic_lr_find(vcpu, virq);
+    if (i >= 0) {
+        u64 lr = vgic_lr_read(vcpu, i);
+        if (!lr_is_inactive(lr)) {
+            if (lr_is_active(lr)) {
+                vgic_lr_write(vcpu, i, (lr & ~ICH_LR_STATE(LR_MASK)) | ICH_LR_STATE(LR_PENDACT));
+            }
+            if ((lr_val & ICH_LR_HW) && !(lr & ICH_LR_HW)) {
+                gic_deactive_irq(pirq);
+            }
+            return 0;
+        }
+    }
+    /* likewise for a vIRQ still waiting in the queue, it is pending already */
+    for (i = 0; i < vgic->pendq_len; ++i) {
+        u64 lr = vgic->pendq[i].lr;
+        if ((u32)ICH_LR_VINTID(lr) == virq) {
+            if ((lr_val & ICH_LR_HW) && !(lr & ICH_LR_HW)) {
+                gic_deactive_irq(pirq);
+            }
+            return 0;
+        }
+    }
+
+    /* the physical PPI belongs to this pcpu, a vcpu that is not loaded can not own it */
+    if (!vgic_loaded(vcpu) && is_ppi(pirq)) {
+        lr_val &= ~(ICH_LR_HW | ICH_LR_PINTID(0x1fff));
+        gic_deactive_irq(pirq);
+    }
+
+    int n = vgic_lr_alloc(vgic);
+    if (n >= 0) {
+        vgic_lr_write(vcpu, n, lr_val);
+        // LOG_INFO("[vgic_lr_inject]: pirq=%d, virq=%d, lr<%d>=0x%x, pcpu=%d\n",
+        //        pirq, virq, n, gic_read_lr(n), cpuid());
+        return 0;
+    }
+
+    /* no free LR: preempt a pending LR of lower priority, which waits in the queue instead */
+    n = vgic_lr_victim(vcpu, ICH_LR_PRIO(lr_val));
+    if (n >= 0) {
+        u64 lr = vgic_lr_read(vcpu, n);
+        vgic_lr_write(vcpu, n, lr_val);
+        lr_val = lr;
+    }
+    if (vgic_pendq_push(vgic, lr_val, get_syscount()) < 0) {
+        LOG_ERR("[vgic_lr_inject]: WARNING!!! LR queue full, drop virq %d\n",
+                (u32)ICH_LR_VINTID(lr_val));
+        if (lr_val & ICH_LR_HW) {
+            gic_deactive_irq((lr_val >> 32) & 0x1fff);
+        }
+        vcpu->stats.vgic_pendq_drop++;
+        return -1;
+    }
+    exit_stat_add(&vcpu->stats.vgic[VGIC_PENDQ_DEPTH], vgic->pendq_len);
+    if (vgic_loaded(vcpu)) {
+        vgic_hcr_update(vcpu);
+    }
+    return 0;
+}
+
+int vgic_inject_virq(struct vcpu *vcpu, u32 pirq, u32 virq, int group)
+{
+    struct vgic_irq *vgic_irq = vgic_irq_get(vcpu, virq);
+    u64 lr_val = gic_make_lr(pirq, virq, group) | ICH_LR_PRIORITY(vgic_irq_rd(vgic_irq, priority));
+    int ret;
+
+    spin_lock(&vcpu->vgic->lock);
+    ret = vgic_lr_inject(vcpu, pirq, lr_val);
+    spin_unlock(&vcpu->vgic->lock);
+    return ret;
+}
+
+/*
+ * The source of HW PPI @intid of the loaded @vcpu is known to be asserted,
+ * e.g. its virtual timer expired while it was out: inject it without waiting
+ * for the physical irq. The physical PPI is set active, as gic_guest_eoi()
+ * would have left it, the guest deactivates it through the LR.
+ */
+void vgic_hw_ppi_assert(struct vcpu *vcpu, u32 intid)
+{
+    struct vgic_irq *irq = vgic_irq_get(vcpu, intid);
+
+    /* not loaded here: the banked PPI is another vcpu's, the irq comes once it is */
+    if (!vgic_loaded(vcpu) || !vgic_irq_rd(irq, hw) || !vgic_irq_rd(irq, enabled)) {
+        return;
+    }
+    gicr_w32(cpuid(), GICR_ISACTIVER0, 1U << intid);
+    vgic_inject_virq(vcpu, intid, intid, 1);
+}
+
+/*
+ * @lr for @target, from any pcpu: straight into its LRs when it is the vcpu
+ * loaded here, else queued and its pcpu kicked, which moves the queue into
+ * the LRs on its next entry, see vgic_sync() and vgic_vcpu_load().
+ */
+static int vgic_lr_deliver(struct vcpu *target, u32 pirq, u64 lr)
+{
+    struct vgic_cpu *vgic = target->vgic;
+    int ret = 0;
+
+    spin_lock(&vgic->lock);
+    if (vgic_loaded(target)) {
+        __vgic_used_lr_update(target);
+        ret = vgic_lr_inject(target, pirq, lr);
+        spin_unlock(&vgic->lock);
+        return ret;
+    }
+    /* already queued: still pending, the physical irq of a HW LR can not be there twice */
+    if (!vgic_pendq_has(vgic, ICH_LR_VINTID(lr)) && vgic_pendq_push(vgic, lr, get_syscount()) < 0) {
+        LOG_ERR("[vgic_lr_deliver]: WARNING!!! LR queue full, drop virq %d\n", (u32)ICH_LR_VINTID(lr));
+        if (lr & ICH_LR_HW) {
+            gic_deactive_irq(pirq);
+        }
+        target->stats.vgic_pendq_drop++;
+        ret = -1;
+    }
+    spin_unlock(&vgic->lock);
+    sched_wakeup(target);
+    return ret;
+}
+
+/*
+ * Physical SPI @pirq, acknowledged and priority dropped on this pcpu: to the
+ * vcpu of the VM owning it, wherever that runs. -1 if no VM owns it.
+ */
+int vgic_spi_forward(u32 pirq)
+{
+    struct vgic_route *r = &g_vgic_route[pirq - 32];
+    struct vm *vm = __atomic_load_n(&r->vm, __ATOMIC_ACQUIRE);
+
+    if (NULL == vm) {
+        return -1;
+    }
+    struct vgic_irq *irq = &vm->vgic->spis[r->virq - 32];
+    u64 lr = gic_make_lr(pirq, r->virq, 1) | ICH_LR_PRIORITY(vgic_irq_rd(irq, priority));
+
+    vgic_lr_deliver(__atomic_load_n(&r->vcpu, __ATOMIC_ACQUIRE), pirq, lr);
+    return 0;
+}
+
+/*
+ * Give physical SPI @pirq to @vm as its SPI @virq, a physical SPI has one
+ * owner at most. It is delivered to vcpu 0 until the guest re-targets it.
+ */
+void vgic_irq_passthrough(struct vm *vm, u32 pirq, u32 virq)
+{
+    struct vgic *vgic = vm->vgic;
+    struct vgic_route *r = &g_vgic_route[pirq - 32];
+    struct vgic_irq *irq = &vgic->spis[virq - 32];
+
+    if (!is_spi(pirq) || !is_spi(virq) || vgic->nhw == VGIC_HW_MAX) {
+        panic("[vgic_irq_passthrough] invalid pirq=%d/virq=%d or too many, vm=%s\n",
+              pirq, virq, vm->name);
+    }
+    spin_lock(&g_vgic_route_lock);
+    if (NULL != r->vm) {
+        panic("[vgic_irq_passthrough] SPI %d already belongs to vm %s\n", pirq, r->vm->name);
+    }
+    r->virq = virq;
+    r->vcpu = vm->vcpus[0];
+    __atomic_store_n(&r->vm, vm, __ATOMIC_RELEASE);
+    spin_unlock(&g_vgic_route_lock);
+
+    irq->hw = 1;
+    irq->pintid = pirq;
+    irq->target = 1;
+    vgic->hw_pirq[vgic->nhw++] = pirq;
+    vgic_hw_route(vm, irq);
+}
+
+/* the passthrough SPIs delivered to @vcpu follow it to the pcpu it is loaded on now */
+static void vgic_route_sync(struct vcpu *vcpu)
+{
+    struct vgic *vgic = vcpu->vm->vgic;
+
+    vgic_lock(vgic);
+    for (int i = 0; i < vgic->nhw; ++i) {
+        u32 pirq = vgic->hw_pirq[i];
+        if (g_vgic_route[pirq - 32].vcpu == vcpu) {
+            gic_set_target_by_affinity(pirq, cpuid());
+        }
+    }
+    vgic_unlock(vgic);
+    vcpu->vgic->pcpu = cpuid();
+}
+
+/* Emulated interrupts: the state machine of struct vgic_irq, see vgic_lr_deliver() */
+static void vgic_irq_deliver(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid)
+{
+    struct vcpu *target = vgic_irq_vcpu(vcpu, irq, intid);
+
+    if (vgic_lr_deliver(target, 0, vgic_emul_lr(irq, intid)) < 0) {
+        __atomic_and_fetch(&irq->state, ~VGIC_IRQ_PENDING, __ATOMIC_ACQ_REL);
+    }
+}
+
+/* pending state of an emulated irq cleared, the LR of a loaded target goes with it */
+static void vgic_irq_unpend(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid)
+{
+    struct vcpu *target = vgic_irq_vcpu(vcpu, irq, intid);
+    struct vgic_cpu *vgic = target->vgic;
+
+    /* a level interrupt stays pending as long as its line is up */
+    if (vgic_irq_rd(irq, level) && vgic_irq_rd(irq, line)) {
+        return;
+    }
+    spin_lock(&vgic->lock);
+    __atomic_and_fetch(&irq->state, ~VGIC_IRQ_PENDING, __ATOMIC_ACQ_REL);
+    for (int i = 0; i < vgic->pendq_len; ++i) {
+        if ((u32)ICH_LR_VINTID(vgic->pendq[i].lr) == intid) {
+            vgic_pendq_del(vgic, i);
+            break;
+        }
+    }
+    /* the LRs of a remote vcpu are out of reach, the guest may see it once more */
+    if (vgic_loaded(target)) {
+        int n = vgic_lr_find(target, intid);
+        if (n >= 0) {
+            u64 lr = vgic_lr_read(target, n);
+            vgic_lr_write(target, n, lr & ~ICH_LR_STATE(LR_PENDING));
+        }
+    }
+    spin_unlock(&vgic->lock);
+}
+
+static void vgic_irq_activate(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid, bool active)
+{
+    struct vcpu *target = vgic_irq_vcpu(vcpu, irq, intid);
+    struct vgic_cpu *vgic = target->vgic;
+
+    spin_lock(&vgic->lock);
+    if (active) {
+        __atomic_or_fetch(&irq->state, VGIC_IRQ_ACTIVE, __ATOMIC_ACQ_REL);
+    } else {
+        __atomic_and_fetch(&irq->state, ~VGIC_IRQ_ACTIVE, __ATOMIC_ACQ_REL);
+    }
+    if (vgic_loaded(target)) {
+        int n = vgic_lr_find(target, intid);
+        if (n >= 0) {
+            u64 lr = vgic_lr_read(target, n);
+            lr = active ? lr | ICH_LR_STATE(LR_ACTIVE) : lr & ~ICH_LR_STATE(LR_ACTIVE);
+            vgic_lr_write(target, n, lr);
+        }
+    }
+    spin_unlock(&vgic->lock);
+}
+
+/* VGIC_IRQ_PENDING | VGIC_IRQ_ACTIVE of an emulated irq, from its LR if it can be read */
+static u8 vgic_irq_state(struct vcpu *vcpu, struct vgic_irq *irq, u32 intid)
+{
+    struct vcpu *target = vgic_irq_vcpu(vcpu, irq, intid);
+    struct vgic_cpu *vgic = target->vgic;
+    u8 state = vgic_irq_rd(irq, state);
+
+    if (!vgic_loaded(target)) {
+        return state;
+    }
+    spin_lock(&vgic->lock);
+    int n = vgic_lr_find(target, intid);
+    if (n >= 0) {
+        u64 lr = vgic_lr_read(target, n);
+        state = vgic_pendq_has(vgic, intid) ? VGIC_IRQ_PENDING : 0;
+        if (lr_is_pending(lr) || lr_is_pendact(lr)) {
+            state |= VGIC_IRQ_PENDING;
+        }
+        if (lr_is_active(lr) || lr_is_pendact(lr)) {
+            state |= VGIC_IRQ_ACTIVE;
+        }
+    }
+    spin_unlock(&vgic->lock);
+    return state;
+}
+
+/* SPI @intid of @vm is raised by a device model from now on, not by the physical GIC */
+void vgic_irq_emulated(struct vm *vm, u32 intid, bool level)
+{
+    struct vgic_irq *irq = &vm->vgic->spis[intid - 32];
+
+    if (!is_spi(intid) || vgic_irq_rd(irq, hw)) {
+        panic("[vgic_irq_emulated] invalid or passthrough intid=%d\n", intid);
+    }
+    vgic_irq_wr(irq, level, level);
+    vgic_irq_wr(irq, line, 0);
+    vgic_irq_wr(irq, state, 0);
+}
+
+/*
+ * An edge, or the line of a level interrupt going up. Callable from any
+ * pcpu; a disabled interrupt stays pending until the guest enables it.
+ */
+void vgic_irq_raise(struct vm *vm, u32 intid)
+{
+    struct vgic_irq *irq = &vm->vgic->spis[intid - 32];
+
+    if (vgic_irq_rd(irq, level)) {
+        vgic_irq_wr(irq, line, 1);
+        /* still pending since the line last went up, sampled again on its deactivation */
+        if (__atomic_fetch_or(&irq->state, VGIC_IRQ_PENDING, __ATOMIC_ACQ_REL) & VGIC_IRQ_PENDING) {
+            return;
+        }
+    } else {
+        __atomic_or_fetch(&irq->state, VGIC_IRQ_PENDING, __ATOMIC_ACQ_REL);
+    }
+    if (vgic_irq_rd(irq, enabled)) {
+        vgic_irq_deliver(vm->vcpus[0], irq, intid);
+    }
+}
+
+static void vgic_sgi_raise(struct vcpu *target, u32 intid)
+{
+    struct vgic_irq *irq = &target->vgic->sgis[intid];
+
+    __atomic_or_fetch(&irq->state, VGIC_IRQ_PENDING, __ATOMIC_ACQ_REL);
+    if (vgic_irq_rd(irq, enabled)) {
+        vgic_irq_deliver(target, irq, intid);
+    }
+}
+
+/*
+ * ICC_SGI1R_EL1 written by @vcpu. vcpu n has MPIDR_EL1.Aff0 == n and all
+ * other affinity levels 0. A target is looked up when the SGI is sent, so
+ * it reaches the vcpu wherever it runs now: straight into the LRs if that
+ * is @vcpu itself, else queued with a kick of its pcpu, or a wakeup if it
+ * is halted.
+ */
+void vgic_sgi1r_write(struct vcpu *vcpu, u64 val)
+{
+    struct vm *vm = vcpu->vm;
+    u32 intid = ICC_SGI1R_INTID(val);
+    u32 aff0 = ICC_SGI1R_RS(val) * 16;
+    u16 targets = ICC_SGI1R_TargetList(val);
+
+    if (ICC_SGI1R_IRM(val)) {
+        for (int i = 0; i < vm->nvcpu; ++i) {
+            if (vm->vcpus[i] != vcpu) {
+                vgic_sgi_raise(vm->vcpus[i], intid);
+            }
+        }
+        return;
+    }
+    if (ICC_SGI1R_AFF1(val) || ICC_SGI1R_AFF2(val) || ICC_SGI1R_AFF3(val)) {
+        return;     /* no such vcpu */
+    }
+    for (; targets; targets &= targets - 1) {
+        u32 id = aff0 + __builtin_ctz(targets);
+        if (id < vm->nvcpu) {
+            vgic_sgi_raise(vm->vcpus[id], intid);
+        }
+    }
+}
+
+/* the line of a level interrupt going down, no effect on an edge one */
+void vgic_irq_lower(struct vm *vm, u32 intid)
+{
+    struct vgic_irq *irq = &vm->vgic->spis[intid - 32];
+
+    if (!vgic_irq_rd(irq, level)) {
+        return;
+    }
+    vgic_irq_wr(irq, line, 0);
+    vgic_irq_unpend(vm->vcpus[0], irq, intid);
+}
+
+/*
+ * ICH maintenance interrupt: the guest made room in the LRs of the loaded
+ * @vcpu, move the queued vIRQs in. Must run before the interrupt is
+ * deactivated, UIE/NPIE are level triggers.
+ */
+void vgic_maintenance(struct vcpu *vcpu)
+{
+    u64 misr;
+
+    read_sysreg(misr, ich_misr_el2);
+    /* e.g. the last vcpu from sched_idle(), put since: its LRs were retired */
+    if (NULL == vcpu || !vgic_loaded(vcpu)) {
+        write_sysreg(ich_hcr_el2, ICH_HCR_EN);
+        return;
+    }
+    if (!(misr & (ICH_MISR_EOI | ICH_MISR_U | ICH_MISR_NP))) {
+        return;     /* the condition went away since, e.g. a refill on another exit */
+    }
+    /* EOI: a level interrupt was deactivated, the refill retires its LR first */
+    spin_lock(&vcpu->vgic->lock);
+    vgic_lr_refill(vcpu);
+    vgic_hcr_update(vcpu);
+    spin_unlock(&vcpu->vgic->lock);
+}
+
+/* vIRQs were queued for the loaded @vcpu from another pcpu, see vgic_irq_deliver() */
+void vgic_sync(struct vcpu *vcpu)
+{
+    if (NULL == vcpu || !vgic_loaded(vcpu) || 0 == vcpu->vgic->pendq_len) {
+        return;
+    }
+    spin_lock(&vcpu->vgic->lock);
+    vgic_lr_refill(vcpu);
+    vgic_hcr_update(vcpu);
+    spin_unlock(&vcpu->vgic->lock);
+}
+
+void vgic_restore_state(struct vgic_cpu *vgic)
+{
+    return;
+}
+
+/* true if a virtual interrupt is pending for @vcpu, loaded or not */
+bool vgic_has_pending(struct vcpu *vcpu)
+{
+    if (vcpu->vgic->pendq_len > 0) {
+        return true;
+    }
+    if (vgic_loaded(vcpu)) {
+        return gic_has_pending_lr();
+    }
+    for (int i = 0; i < g_gic_lr_max; ++i) {
+        if (lr_is_pending(vcpu->gic.lr[i]) || lr_is_pendact(vcpu->gic.lr[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Save the virtual cpu interface of the loaded @vcpu. A PPI is banked per pcpu
+ * and the next vcpu must be able to take it, so a PPI linked to an LR is
+ * deactivated and the LR turned into a pure virtual one.
+ */
+void vgic_vcpu_put(struct vcpu *vcpu)
+{
+    struct gic_state *gic = &vcpu->gic;
+    struct vgic_cpu *vgic = vcpu->vgic;
+
+    spin_lock(&vgic->lock);
+    gic_save_state(gic);
+    /* an LR deactivated with ICH_LR_EOI would raise its maintenance irq for the next vcpu */
+    __vgic_used_lr_update(vcpu);
+    for (int i = 0; i < g_gic_lr_max; ++i) {
+        u64 lr = gic->lr[i];
+        u32 pintid = (lr >> 32) & 0x1fff;
+        if ((lr & ICH_LR_HW) && !lr_is_inactive(lr) && is_ppi(pintid)) {
+            gic_deactive_irq(pintid);
+            gic->lr[i] = lr & ~(ICH_LR_HW | ICH_LR_PINTID(0x1fff));
+        }
+    }
+    /* the same for the PPIs still queued */
+    for (int i = 0; i < vgic->pendq_len; ++i) {
+        u64 lr = vgic->pendq[i].lr;
+        u32 pintid = (lr >> 32) & 0x1fff;
+        if ((lr & ICH_LR_HW) && is_ppi(pintid)) {
+            gic_deactive_irq(pintid);
+            vgic->pendq[i].lr = lr & ~(ICH_LR_HW | ICH_LR_PINTID(0x1fff));
+        }
+    }
+    vgic->loaded = 0;
+    /* no maintenance interrupts for a vcpu that is not here */
+    write_sysreg(ich_hcr_el2, ICH_HCR_EN);
+    spin_unlock(&vgic->lock);
+}
+
+/* load the virtual cpu interface of @vcpu and the PPI enables it configured */
+void vgic_vcpu_load(struct vcpu *vcpu)
+{
+    u32 en = 0;
+
+    if (vcpu->vgic->pcpu != cpuid()) {
+        vgic_route_sync(vcpu);
+    }
+
+    /* LRs the guest freed before it was put can take queued vIRQs now */
+    spin_lock(&vcpu->vgic->lock);
+    vgic_lr_refill(vcpu);
+    gic_restore_state(&vcpu->gic);
+    vcpu->vgic->loaded = 1;
+    vgic_hcr_update(vcpu);
+    spin_unlock(&vcpu->vgic->lock);
+
+    for (int i = 0; i < GIC_NPPI; ++i) {
+        if (vgic_irq_rd(&vcpu->vgic->ppis[i], enabled)) {
+            en |= 1U << (GIC_NSGI + i);
+        }
+    }
+    en &= ~VGIC_HYP_PPI_MASK;
+    gicr_w32(cpuid(), GICR_ICENABLER0, ~en & 0xffff0000 & ~VGIC_HYP_PPI_MASK);
+    gicr_w32(cpuid(), GICR_ISENABLER0, en);
 }
 
 void vgic_init(void)
 {
-    spinlock_init(&g_vgic_lock);
     spinlock_init(&g_vgic_cpu_lock);
+    spinlock_init(&g_vgic_route_lock);
+    spinlock_init(&g_vgic_gicd_lock);
     for (int i = 0; i < VM_MAX; ++i) {
         g_vgic[i].used = 0;
         spinlock_init(&g_vgic[i].lock);
     }
-    for (int i = 0; i < VCPU_MAX; ++i) {
+    for (int i = 0; i < VCPU_POOL_MAX; ++i) {
         g_vgic_cpu[i].used = 0;
     }
 }
\ No newline at end of file
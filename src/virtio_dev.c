@@ -5,57 +5,178 @@
 #include "ramdisk.h"
 #include "mmu.h"
 #include "vm.h"
+#include "vgic.h"
+#include "iothread.h"
+#include "lib.h"
 #include "debug.h"
 
-#define DESC_IDX_BLK_REQ        0
-#define DESC_IDX_BUFFER         1
-#define DESC_IDX_REQ_STATUS     2
+/* features the device offers, the ones the driver took */
+#define VIRTIO_BLK_FEATURES     ((1UL << VIRTIO_RING_F_INDIRECT_DESC) | (1UL << VIRTIO_RING_F_EVENT_IDX) | \
+                                 (1UL << VIRTIO_BLK_F_MQ))
 
-static u64 guest_pagesz = 0;
-static u64 g_queue_sel = 0;
+/* print the notify/interrupt ratios every this many requests */
+#define VIRTIO_STAT_PERIOD      1024
 
-struct virt_queue g_vq = {0};
+/* the virtio-mmio slots of a VM, the context of its region */
+struct virtio_mmio_bus {
+    struct virtio_dev   *slots[VIRTIO_MMIO_SLOTS];
+    int                 used;
+};
 
-static u64 virtio_guest_to_host(u64 ipa)
+static struct virtio_mmio_bus g_virtio_buses[VM_MAX];
+static struct virtio_dev g_virtio_devs[VIRTIO_DEV_MAX];
+static spinlock_t g_virtio_lock = SPINLOCK_INITVAL;
+
+/* the queues are spread over the pcpus from IO_PCPU on, in creation order */
+static int g_io_next;
+
+static int vq_io_pcpu(void)
 {
-    struct vcpu *vcpu = cur_vcpu();
-    u64 *pgt = vcpu->vm->stage2_pt;
+    if (IO_PCPU < 0) {
+        return -1;
+    }
+    return (IO_PCPU + g_io_next++) % PCPU_NUM;
+}
 
-    return ipa2pa(pgt, ipa);
+/* the worker runs on another pcpu than the vcpu that notified: no cur_vcpu() */
+static u64 virtio_guest_to_host(struct vm *vm, u64 ipa)
+{
+    return ipa2pa(vm->stage2_pt, ipa);
 }
 
-static void vq_ring_init(u64 ipa)
+/* PA of the ring at [ipa, ipa+size), 0 unless it is RAM and host contiguous */
+static u64 virtio_ring_map(struct vm *vm, u64 ipa, u64 size, u64 align)
 {
-    spinlock_init(&g_vq.virtq_lock);
+    u64 pa = virtio_guest_to_host(vm, ipa);
 
-    g_vq.vring_ipa = ipa;
-    g_vq.vring_pa = virtio_guest_to_host(ipa);
-    LOG_INFO("g_vq.vring_ipa=%p, g_vq.vring_pa=%p\n", g_vq.vring_ipa, g_vq.vring_pa);
+    if (0 == pa || (ipa & (align - 1)) || vm_mem_type(vm, ipa) == VM_MEM_DEVICE ||
+        virtio_guest_to_host(vm, ipa + size - 1) != pa + size - 1) {
+        return 0;
+    }
+    return pa;
+}
 
-    g_vq.avail = (struct virtq_avail *)(g_vq.vring_pa + g_vq.vring_num * sizeof(struct virtq_desc));
-    g_vq.desc = (struct virtq_desc *)g_vq.vring_pa;
-    g_vq.used = (struct virtq_used *) (g_vq.vring_pa + PAGE_SIZE);
+/*
+ * QUEUE_READY: the driver placed the three rings where it liked, each one
+ * on its own. Returns -1, the queue staying off, if they are not usable.
+ */
+static int vq_ring_init(struct virt_queue *vq)
+{
+    struct vm *vm = vq->dev->vm;
+    u64 num = vq->vring_num;
+    u64 desc, avail, used;
+
+    if (num == 0 || num > vq->dev->ops->queue_num_max || (num & (num - 1))) {
+        return -1;
+    }
+    desc = virtio_ring_map(vm, vq->desc_ipa, VRING_DESC_SIZE(num), 16);
+    avail = virtio_ring_map(vm, vq->avail_ipa, VRING_AVAIL_SIZE(num), 2);
+    used = virtio_ring_map(vm, vq->used_ipa, VRING_USED_SIZE(num), 4);
+    if (0 == desc || 0 == avail || 0 == used) {
+        return -1;
+    }
+    LOG_INFO("vq[%d]: num=%d, desc=%p, avail=%p, used=%p\n",
+             vq->index, num, vq->desc_ipa, vq->avail_ipa, vq->used_ipa);
+
+    vq->desc = (struct virtq_desc *)desc;
+    vq->avail = (struct virtq_avail *)avail;
+    vq->used = (struct virtq_used *)used;
+    vq->avail_idx = 0;
+    vq->vm = vm;
+    return 0;
 }
 
 /* Notify FE that virtio request has been processed. */
-static void virtio_signal_vq(void)
+static void virtio_signal_vq(struct virt_queue *vq)
+{
+    struct virtio_dev *dev = vq->dev;
+
+    __atomic_or_fetch(&dev->intr_status, VIRTIO_MMIO_INT_VRING, __ATOMIC_ACQ_REL);
+    vgic_irq_raise(dev->vm, dev->irq);
+}
+
+static inline bool vq_has_feature(struct virt_queue *vq, int feature)
+{
+    return !!(vq->dev->driver_features & (1UL << feature));
+}
+
+static inline bool vq_event_idx(struct virt_queue *vq)
+{
+    return vq_has_feature(vq, VIRTIO_RING_F_EVENT_IDX);
+}
+
+/* the event fields sit right after the rings, whose size the guest chose */
+static inline u16 *vq_used_event(struct virt_queue *vq)
+{
+    return &vq->avail->ring[vq->vring_num];
+}
+
+static inline u16 *vq_avail_event(struct virt_queue *vq)
 {
-    gic_set_pending_irq(VIRTIO0_IRQ);
+    return (u16 *)&vq->used->ring[vq->vring_num];
 }
 
-static void vqueue_set_used_elem(u16 desc_idx, u16 len)
+/* make the used ring, up to avail_event, visible to the guest */
+static void vq_sync_used(struct virt_queue *vq)
 {
-    g_vq.used->ring[g_vq.used->idx % g_vq.vring_num].id = (u32)desc_idx;
-    g_vq.used->ring[g_vq.used->idx % g_vq.vring_num].len = (u32)len;
+    vm_sync_to_guest(vq->vm, vq->used_ipa, (u64)vq->used, VRING_USED_SIZE(vq->vring_num));
+}
+
+/* read what the guest wrote: descriptor table and avail ring with used_event */
+static void vq_sync_avail(struct virt_queue *vq)
+{
+    vm_sync_from_guest(vq->vm, vq->desc_ipa, (u64)vq->desc, VRING_DESC_SIZE(vq->vring_num));
+    vm_sync_from_guest(vq->vm, vq->avail_ipa, (u64)vq->avail, VRING_AVAIL_SIZE(vq->vring_num));
+}
+
+static void vqueue_set_used_elem(struct virt_queue *vq, u16 desc_idx, u32 len)
+{
+    vq->used->ring[vq->used->idx % vq->vring_num].id = (u32)desc_idx;
+    vq->used->ring[vq->used->idx % vq->vring_num].len = (u32)len;
 
     __sync_synchronize();
-    g_vq.used->idx += 1;
+    vq->used->idx += 1;
     __sync_synchronize();
+
+    vq_sync_used(vq);
 }
 
-static bool virtq_available()
+/*
+ * Notifications stay off while the worker drains the ring: with EVENT_IDX
+ * avail_event lags behind until the ring is empty, else NO_NOTIFY is set.
+ */
+static void vq_notify_enable(struct virt_queue *vq, bool enable)
 {
-    return g_vq.avail_idx != g_vq.avail->idx;
+    if (vq_event_idx(vq)) {
+        if (enable) {
+            *vq_avail_event(vq) = vq->avail_idx;
+        }
+    } else if (enable) {
+        vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+    } else {
+        vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+    }
+    __sync_synchronize();
+    vq_sync_used(vq);
+}
+
+/* the guest wants to hear about the used entries from @old_used on */
+static bool vq_need_interrupt(struct virt_queue *vq, u16 old_used)
+{
+    u16 new_used = vq->used->idx;
+
+    if (new_used == old_used) {
+        return false;
+    }
+    if (vq_event_idx(vq)) {
+        return vring_need_event(*vq_used_event(vq), new_used, old_used);
+    }
+    return !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+}
+
+static bool virtq_available(struct virt_queue *vq)
+{
+    return vq->avail_idx != vq->avail->idx;
 }
 
 static inline bool virt_desc_test_flag(struct virtq_desc *desc, u16 flags)
@@ -63,134 +184,438 @@ static inline bool virt_desc_test_flag(struct virtq_desc *desc, u16 flags)
     return !!(desc->flags & flags);
 }
 
-static u16 next_desc(struct virtq_desc *desc, u16 i, u16 max)
+static int virtio_read_guest(struct vm *vm, u64 ipa, void *dst, u64 size)
 {
-    u16 next = 0;
-    if (!virt_desc_test_flag(&desc[i], VRING_DESC_F_NEXT)) {
-        return max;
+    while (size > 0) {
+        u64 n = PAGE_SIZE - (ipa & (PAGE_SIZE - 1));
+        if (n > size) {
+            n = size;
+        }
+        u64 pa = virtio_guest_to_host(vm, ipa);
+        if (0 == pa || vm_mem_type(vm, ipa) == VM_MEM_DEVICE) {
+            return -1;
+        }
+        vm_sync_from_guest(vm, ipa, pa, n);
+        memcpy(dst, (void *)pa, n);
+        ipa += n;
+        dst = (u8 *)dst + n;
+        size -= n;
     }
-    next = desc[i].next;
+    return 0;
+}
 
-    return (next < max) ? next : max;
+/* the reverse of virtio_read_guest() */
+static int virtio_write_guest(struct vm *vm, u64 ipa, const void *src, u64 size)
+{
+    while (size > 0) {
+        u64 n = PAGE_SIZE - (ipa & (PAGE_SIZE - 1));
+        if (n > size) {
+            n = size;
+        }
+        u64 pa = virtio_guest_to_host(vm, ipa);
+        if (0 == pa || vm_mem_type(vm, ipa) == VM_MEM_DEVICE) {
+            return -1;
+        }
+        memcpy((void *)pa, src, n);
+        vm_sync_to_guest(vm, ipa, pa, n);
+        ipa += n;
+        src = (const u8 *)src + n;
+        size -= n;
+    }
+    return 0;
 }
 
-static u16 virtio_blk_process_desc(u16 desc_idx)
+/*
+ * Descriptor chain of a request, walked in place: in the ring's table, or in
+ * the indirect table the head points to, read from the guest one descriptor
+ * at a time. Nothing is copied to the stack, the chain may be of any length.
+ */
+struct vq_chain {
+    u64     table;      /* IPA of the indirect table, 0 for the ring's desc[] */
+    u16     num;        /* descriptors in the table */
+    u16     next;       /* index of the next one, num at the end */
+    u16     count;      /* walked so far, a chain looping back is cut */
+};
+
+static int vq_chain_init(struct virt_queue *vq, struct vq_chain *c, u16 head)
 {
-    u16 idx = 0;
-    u16 max = 0;
-    u16 desc_len = 0;
-    u16 is_write = 0;
-    u64 buf_addr = 0;
-    u64 blk_num = 0;
-    int ret = -1;
-    struct virtio_blk_req *virt_blk_req = NULL;
-    struct virtq_desc desc[g_vq.vring_num];
+    struct virtq_desc *d;
 
-    idx = desc_idx;
-    max = g_vq.vring_num;
-    do {
-        // LOG_INFO("[virtio_blk_process_desc]: idx = %d\n", idx);
-        desc[desc_len] = g_vq.desc[idx];
-        ++desc_len;
-        idx = next_desc(g_vq.desc, idx, max);
-    } while (idx != max);
-    
-    // LOG_INFO("[virtio_blk_process_desc]: desc_len = %d\n", desc_len);
-    
-    if (desc_len != 3) {
-        LOG_ERR("[virtio_blk_process_desc]: ERROR!!! Invalid desc_len(%d)\n", desc_len);
-        return desc_len;
+    if (head >= vq->vring_num) {
+        return -1;
+    }
+    d = &vq->desc[head];
+    c->count = 0;
+    if (!virt_desc_test_flag(d, VRING_DESC_F_INDIRECT)) {
+        c->table = 0;
+        c->num = vq->vring_num;
+        c->next = head;
+        return 0;
     }
 
-    /* process blk req */
-    virt_blk_req = (struct virtio_blk_req*)virtio_guest_to_host(desc[DESC_IDX_BLK_REQ].addr);
-    blk_num = virt_blk_req->sector / (BLOCK_SIZE / 512);
-    is_write = (virt_blk_req->type == VIRTIO_BLK_T_OUT) ? 1 : 0;
+    if (!vq_has_feature(vq, VIRTIO_RING_F_INDIRECT_DESC) ||
+        d->len == 0 || d->len % sizeof(struct virtq_desc) || d->len / sizeof(struct virtq_desc) > 0xffff) {
+        return -1;
+    }
+    c->table = d->addr;
+    c->num = d->len / sizeof(struct virtq_desc);
+    c->next = 0;
+    return 0;
+}
 
-    buf_addr = virtio_guest_to_host(desc[DESC_IDX_BUFFER].addr);
+/* the next descriptor into @d: 1, 0 at the end of the chain, -1 if it is malformed */
+static int vq_chain_next(struct virt_queue *vq, struct vq_chain *c, struct virtq_desc *d)
+{
+    if (c->next >= c->num) {
+        return 0;
+    }
+    if (++c->count > c->num) {
+        return -1;
+    }
 
-    LOG_INFO("[virtio_blk_process_desc]: %s blockno(%d) %s ramdisk\n",
-             is_write ? "write": "read", blk_num, is_write ? "to" : "from");
-    ret = ramdisk_rw(blk_num, buf_addr, is_write);
+    if (c->table) {
+        /* the table is the guest's word, it may be unaligned and cross a page */
+        u64 ipa = c->table + (u64)c->next * sizeof(struct virtq_desc);
+        if (virtio_read_guest(vq->vm, ipa, d, sizeof(*d)) < 0) {
+            return -1;
+        }
+        /* an indirect table can not point to another one */
+        if (virt_desc_test_flag(d, VRING_DESC_F_INDIRECT)) {
+            return -1;
+        }
+    } else {
+        *d = vq->desc[c->next];
+    }
 
-    /* setup process result */
-    u8 *status_pa = (u8*)virtio_guest_to_host(desc[DESC_IDX_REQ_STATUS].addr);
-    if (ret == 0) {
-        *status_pa = 0;
+    if (!virt_desc_test_flag(d, VRING_DESC_F_NEXT)) {
+        c->next = c->num;
+    } else if (d->next < c->num) {
+        c->next = d->next;
     } else {
-        *status_pa = 0xee;  /* indicate process virtio req failed */
+        return -1;
     }
+    return 1;
+}
 
-    return desc_len;
+/* [ipa, ipa+len) of the guest <-> @disk from byte @offset, page by page */
+static int virtio_blk_transfer(struct vm *vm, struct ramdisk *disk, u64 ipa, u64 len,
+                               u64 offset, bool is_write)
+{
+    while (len > 0) {
+        u64 n = PAGE_SIZE - (ipa & (PAGE_SIZE - 1));
+        if (n > len) {
+            n = len;
+        }
+        u64 pa = virtio_guest_to_host(vm, ipa);
+        if (0 == pa || vm_mem_type(vm, ipa) == VM_MEM_DEVICE) {
+            return -1;
+        }
+        if (is_write) {
+            vm_sync_from_guest(vm, ipa, pa, n);
+        }
+        if (ramdisk_access(disk, offset, pa, n, is_write) < 0) {
+            return -1;
+        }
+        if (!is_write) {
+            vm_sync_to_guest(vm, ipa, pa, n);
+        }
+        ipa += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
 }
 
-static void virtio_blk_req_handler(void)
+/*
+ * Serve the request whose chain starts at @head. The chain is one byte
+ * stream the driver may cut into descriptors anywhere: the header is its
+ * first 16 bytes, the status its last byte, the data everything between.
+ * Returns the number of bytes written to the guest, the used ring's len.
+ */
+static u32 virtio_blk_handle_req(struct virt_queue *vq, u16 head)
 {
+    struct vm *vm = vq->vm;
+    struct virtio_blk_req req;
+    struct vq_chain chain;
+    struct virtq_desc d, last = {0};
+    u64 total = 0, pos = 0, data_end, offset = 0;
+    u32 written = 0;
+    u8 status = VIRTIO_BLK_S_OK;
+    bool is_write = false, has_data = false;
+    int ret;
+
+    /* the length of the stream and the descriptor holding its last byte */
+    if (vq_chain_init(vq, &chain, head) < 0) {
+        goto bad_chain;
+    }
+    while ((ret = vq_chain_next(vq, &chain, &d)) > 0) {
+        total += d.len;
+        if (d.len > 0) {
+            last = d;
+        }
+    }
+    if (ret < 0 || total < sizeof(req) + 1 || !virt_desc_test_flag(&last, VRING_DESC_F_WRITE)) {
+        goto bad_chain;
+    }
+    data_end = total - 1;
+
+    vq_chain_init(vq, &chain, head);
+    while ((ret = vq_chain_next(vq, &chain, &d)) > 0) {
+        u64 end = pos + d.len;
+        bool dev_writes = virt_desc_test_flag(&d, VRING_DESC_F_WRITE);
+
+        /* header bytes, they all come before the first data byte */
+        if (pos < sizeof(req)) {
+            u64 n = (end < sizeof(req) ? end : sizeof(req)) - pos;
+            if (dev_writes || virtio_read_guest(vm, d.addr, (u8 *)&req + pos, n) < 0) {
+                goto bad_chain;
+            }
+            if (pos + n == sizeof(req)) {
+                is_write = (req.type == VIRTIO_BLK_T_OUT);
+                has_data = (req.type == VIRTIO_BLK_T_IN || req.type == VIRTIO_BLK_T_OUT);
+                if (!has_data && req.type != VIRTIO_BLK_T_FLUSH) {
+                    status = VIRTIO_BLK_S_UNSUPP;
+                }
+                offset = req.sector * VIRTIO_BLK_SECTOR_SIZE;
+            }
+        }
+
+        /* data bytes [start, stop) of the stream in this descriptor */
+        u64 start = pos > sizeof(req) ? pos : sizeof(req);
+        u64 stop = end < data_end ? end : data_end;
+        if (start < stop && status == VIRTIO_BLK_S_OK) {
+            if (!has_data || is_write == dev_writes ||
+                virtio_blk_transfer(vm, &vq->dev->disk, d.addr + (start - pos), stop - start,
+                                    offset + (start - sizeof(req)), is_write) < 0) {
+                status = VIRTIO_BLK_S_IOERR;
+            } else if (!is_write) {
+                written += stop - start;
+            }
+        }
+        pos = end;
+    }
+    /* the chain changed under us since the first walk */
+    if (ret < 0 || pos != total) {
+        goto bad_chain;
+    }
+
+    LOG_INFO("[virtio_blk_handle_req]: %s sector(%d) len(%d) %s ramdisk, status %d\n",
+             is_write ? "write" : "read", req.sector, data_end - sizeof(req),
+             is_write ? "to" : "from", status);
+
+    if (virtio_write_guest(vm, last.addr + last.len - 1, &status, sizeof(status)) < 0) {
+        goto bad_chain;
+    }
+
+    /* only the data read into the guest and the status, not the whole writable part */
+    return written + sizeof(u8);
+
+bad_chain:
+    LOG_ERR("[virtio_blk_handle_req]: ERROR!!! malformed chain at desc[%d]\n", head);
+    return 0;
+}
+
+/* the io_work of @vq: serve everything the guest made available */
+static void virtio_queue_handler(void *arg)
+{
+    struct virt_queue *vq = arg;
+    const struct virtio_dev_ops *ops = vq->dev->ops;
     u16 desc_idx = 0;
-    u16 desc_len = 0;
-    LOG_INFO("[virtio_blk_req_handler]: g_vq.avail_idx=%d, g_vq.avail->idx=%d\n",
-           g_vq.avail_idx, g_vq.avail->idx);
+    u16 old_used;
+    u32 len = 0;
+    bool irq;
+
+    spin_lock(&vq->virtq_lock);
+    /* reset after the doorbell */
+    if (NULL == vq->vm) {
+        spin_unlock(&vq->virtq_lock);
+        return;
+    }
+    LOG_INFO("[virtio_queue_handler]: vq->avail_idx=%d, vq->avail->idx=%d\n",
+           vq->avail_idx, vq->avail->idx);
+
+    old_used = vq->used->idx;
+    vq_notify_enable(vq, false);
+    for (;;) {
+        /* descriptor table and avail ring are written by the guest */
+        vq_sync_avail(vq);
+        while (virtq_available(vq)) {
+            /* fetch VM's virtio request */
+            desc_idx = vq->avail->ring[vq->avail_idx % vq->vring_num];
+            LOG_INFO("## [virtio_queue_handler]: ready to process desc[%d]\n", desc_idx);
+
+            /* do real block request job */
+            len = ops->handle_req(vq, desc_idx);
+
+            /* update vring's used[], recording already processed desc elements */
+            vqueue_set_used_elem(vq, desc_idx, len);
+
+            ++vq->avail_idx;
+            if (++vq->nr_req % VIRTIO_STAT_PERIOD == 0) {
+                LOG_INFO("[%s]: vm=%s queue %d: %d requests, %d notifies, %d interrupts\n",
+                         ops->name, vq->vm->name, vq->index, vq->nr_req, vq->nr_notify, vq->nr_irq);
+            }
+        }
+
+        /* the guest may have added one before it saw notifications back on */
+        vq_notify_enable(vq, true);
+        vq_sync_avail(vq);
+        if (!virtq_available(vq)) {
+            break;
+        }
+        vq_notify_enable(vq, false);
+    }
+
+    irq = vq_need_interrupt(vq, old_used);
+    if (irq) {
+        ++vq->nr_irq;
+    }
+    spin_unlock(&vq->virtq_lock);
+
+    /* the used entries are there, now we inject irq to wakeup VM unless it declined */
+    if (irq) {
+        virtio_signal_vq(vq);
+    }
+}
+
+/* every disk starts as its own copy of the fs image, nothing is shared between VMs */
+static int virtio_blk_init(struct virtio_dev *dev)
+{
+    return ramdisk_create(&dev->disk);
+}
+
+/* device configuration space, byte @offset of struct virtio_blk_config */
+static u64 virtio_blk_config_read(struct virtio_dev *dev, u64 offset, u64 size)
+{
+    struct virtio_blk_config cfg = {
+        .capacity   = dev->disk.size / VIRTIO_BLK_SECTOR_SIZE,
+        .num_queues = dev->ops->nqueues,
+    };
+    u64 val = 0;
+
+    if (offset + size > sizeof(cfg)) {
+        return 0;
+    }
+    memcpy(&val, (u8 *)&cfg + offset, size);
+    return val;
+}
+
+static const struct virtio_dev_ops virtio_blk_ops = {
+    .name           = "virtio-blk",
+    .device_id      = VIRTIO_ID_BLOCK,
+    .features       = VIRTIO_BLK_FEATURES,
+    .nqueues        = VIRTIO_BLK_NQ,
+    .queue_num_max  = 256,
+    .init           = virtio_blk_init,
+    .handle_req     = virtio_blk_handle_req,
+    .config_read    = virtio_blk_config_read,
+};
+
+/* the device types a VM may be given */
+static const struct virtio_dev_ops *g_virtio_types[] = {
+    &virtio_blk_ops,
+};
+
+/* device of the slot @offset falls in, NULL if the slot is empty */
+static struct virtio_dev *virtio_mmio_dev(struct mmio_access *mmio, u64 offset)
+{
+    struct virtio_mmio_bus *bus = mmio->ctx;
+    return bus->slots[offset / VIRTIO_MMIO_STRIDE];
+}
 
-    spin_lock(&g_vq.virtq_lock);
-    while (virtq_available()) {
-        /* fetch VM's virtio request */
-        desc_idx = g_vq.avail->ring[g_vq.avail_idx % g_vq.vring_num];
-        LOG_INFO("## [virtio_blk_req_handler]: ready to process desc[%d]\n", desc_idx);
-        
-        /* do real block request job */
-        desc_len = virtio_blk_process_desc(desc_idx);
+/* the queue QUEUE_SEL points to, NULL if there is none */
+static struct virt_queue *virtio_sel_vq(struct virtio_dev *dev)
+{
+    if (dev->queue_sel >= dev->ops->nqueues) {
+        return NULL;
+    }
+    return &dev->vqs[dev->queue_sel];
+}
 
-        /* update vring's used[], recording already processed desc elements */
-        vqueue_set_used_elem(desc_idx, desc_len);
+/* what the device offers: its type's features, in virtio 1.x mode only */
+static inline u64 virtio_dev_features(struct virtio_dev *dev)
+{
+    return dev->ops->features | (1UL << VIRTIO_F_VERSION_1);
+}
 
-        ++g_vq.avail_idx;
+/* STATUS = 0: back to the state the VM was created with, the queues off */
+static void virtio_dev_reset(struct virtio_dev *dev)
+{
+    for (int q = 0; q < dev->ops->nqueues; ++q) {
+        struct virt_queue *vq = &dev->vqs[q];
+        spin_lock(&vq->virtq_lock);
+        vq->vm = NULL;
+        vq->vring_num = 0;
+        vq->desc_ipa = vq->avail_ipa = vq->used_ipa = 0;
+        vq->avail_idx = 0;
+        spin_unlock(&vq->virtq_lock);
     }
-    spin_unlock(&g_vq.virtq_lock);
+    dev->driver_features = 0;
+    dev->device_features_sel = dev->driver_features_sel = 0;
+    dev->queue_sel = 0;
+    dev->status = 0;
+    __atomic_store_n(&dev->intr_status, 0, __ATOMIC_RELEASE);
+    vgic_irq_lower(dev->vm, dev->irq);
+}
 
-    /* all available desc elements are processed, now we inject irq to wakeup VM */
-    virtio_signal_vq();
+/* the 32-bit half @high of the 64-bit ring address @addr is @val */
+static inline void virtio_set_addr_half(u64 *addr, u64 val, bool high)
+{
+    if (high) {
+        *addr = (*addr & 0xffffffffUL) | (val << 32);
+    } else {
+        *addr = (*addr & ~0xffffffffUL) | (val & 0xffffffffUL);
+    }
 }
 
 static int virtio_mmio_read(struct vcpu *vcpu, u64 offset,
                            u64 *val, struct mmio_access *mmio)
 {
+    struct virtio_dev *dev = virtio_mmio_dev(mmio, offset);
+    struct virt_queue *vq;
+
     LOG_INFO("[virtio_mmio_read]: offset=%p, ipa=%p, vm's pc=%p\n",
            offset, mmio->ipa, mmio->pc);
 
+    *val = 0;
+    /* an empty slot reads as device id 0 and ignores the rest */
+    if (NULL == dev) {
+        return 0;
+    }
+
+    offset %= VIRTIO_MMIO_STRIDE;
     switch (offset) {
-        case VIRTIO_MMIO_MAGIC_VALUE:  // 0x74726976
-            *val = 0x74726976;
-            break;
-        case VIRTIO_MMIO_VERSION:      // version; 1 is legacy
-            *val = 1;
-            break;
-        case VIRTIO_MMIO_DEVICE_ID:  // device type; 1 is net, 2 is disk
-            *val = 2;
-            break;
-        case VIRTIO_MMIO_VENDOR_ID: // 0x554d4551
-            *val = 0x554d4551;
-            break;
-        case VIRTIO_MMIO_DEVICE_FEATURES:
-            *val = 0;
+        case VIRTIO_MMIO_DEVICE_FEATURES:   // the 32-bit word DEVICE_FEATURES_SEL points to
+            if (dev->device_features_sel < 2) {
+                *val = (u32)(virtio_dev_features(dev) >> (32 * dev->device_features_sel));
+            }
             break;
         case VIRTIO_MMIO_QUEUE_NUM_MAX:  // max size of current queue, read-only
-            *val = 64;
-            break;
-        case VIRTIO_MMIO_QUEUE_PFN: // physical page number for queue, read/write
-
+            *val = virtio_sel_vq(dev) ? dev->ops->queue_num_max : 0;
             break;
         case VIRTIO_MMIO_QUEUE_READY: // ready bit
-
+            vq = virtio_sel_vq(dev);
+            *val = (vq && vq->vm) ? 1 : 0;
             break;
         case VIRTIO_MMIO_INTERRUPT_STATUS:  // read-only
-
+            *val = __atomic_load_n(&dev->intr_status, __ATOMIC_ACQUIRE);
             break;
         case VIRTIO_MMIO_STATUS:     // read/write
-            
+            *val = dev->status;
+            break;
+        case VIRTIO_MMIO_CONFIG_GENERATION: // the configuration never changes
+            *val = 0;
             break;
         default:
-            panic("[virtio_mmio_read] Invalid/Unsupported offset(%p), ipa=%p, vm=%s, vcpuid=%d, vm's pc=%p\n",
-                  offset, mmio->ipa, vcpu->vm->name, vcpu->cpuid, mmio->pc);
+            if (offset >= VIRTIO_MMIO_CONFIG) {
+                *val = dev->ops->config_read(dev, offset - VIRTIO_MMIO_CONFIG, 1UL << mmio->iss_sas);
+                break;
+            }
+            /* a guest bug, not ours: read as zero */
+            LOG_WARN("[virtio_mmio_read]: invalid/unsupported offset(%p), ipa=%p, vm=%s, vcpuid=%d, vm's pc=%p\n",
+                     offset, mmio->ipa, vcpu->vm->name, vcpu->cpuid, mmio->pc);
+            *val = 0;
+            break;
     }
 
     return 0;
@@ -199,57 +624,253 @@ static int virtio_mmio_read(struct vcpu *vcpu, u64 offset,
 static int virtio_mmio_write(struct vcpu *vcpu, u64 offset,
                             u64 val, struct mmio_access *mmio)
 {
+    struct virtio_dev *dev = virtio_mmio_dev(mmio, offset);
+    struct virt_queue *vq;
+    u64 word;
+
     LOG_INFO("[virtio_mmio_write]: offset=%p, ipa=%p, vm's pc=%p\n",
              offset, mmio->ipa, mmio->pc);
 
+    if (NULL == dev) {
+        return 0;
+    }
+
+    offset %= VIRTIO_MMIO_STRIDE;
+    vq = virtio_sel_vq(dev);
     switch (offset) {
-        case VIRTIO_MMIO_DRIVER_FEATURES:
-            LOG_INFO("[virtio_mmio_write]: VIRTIO_MMIO_DRIVER_FEATURES feature=%p\n", val);
+        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+            dev->device_features_sel = val;
             break;
-        case VIRTIO_MMIO_GUEST_PAGE_SIZE: // page size for PFN, write-only
-            LOG_INFO("[virtio_mmio_write]: VIRTIO_MMIO_GUEST_PAGE_SIZE guest_pagesz=%p\n", val);
-            if (val != PAGE_SIZE) {
-                panic("[virtio_mmio_write]: invalid page size(%p)\n", val);
+        case VIRTIO_MMIO_DRIVER_FEATURES:   // the 32-bit word DRIVER_FEATURES_SEL points to
+            LOG_INFO("[virtio_mmio_write]: VIRTIO_MMIO_DRIVER_FEATURES[%d] feature=%p\n",
+                     dev->driver_features_sel, val);
+            if (dev->driver_features_sel < 2) {
+                word = 0xffffffffUL << (32 * dev->driver_features_sel);
+                dev->driver_features = (dev->driver_features & ~word) |
+                                       ((val << (32 * dev->driver_features_sel)) & word & virtio_dev_features(dev));
             }
-            guest_pagesz = val;
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            dev->driver_features_sel = val;
             break;
         case VIRTIO_MMIO_QUEUE_SEL: // select queue, write-only
             LOG_INFO("[virtio_mmio_write]: VIRTIO_MMIO_QUEUE_SEL queue_sel=%p\n", val);
-            g_queue_sel = val;
+            dev->queue_sel = val;
             break;
         case VIRTIO_MMIO_QUEUE_NUM:	 // size of current queue, write-only
             LOG_INFO("[virtio_mmio_write]: VIRTIO_MMIO_QUEUE_NUM queue_num=%p\n", val);
-            g_vq.vring_num = val;
+            if (vq && NULL == vq->vm) {
+                vq->vring_num = val;
+            }
             break;
-        case VIRTIO_MMIO_QUEUE_ALIGN: // used ring alignment, write-only
-        
+        case VIRTIO_MMIO_QUEUE_DESC_LOW:
+        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+            if (vq && NULL == vq->vm) {
+                virtio_set_addr_half(&vq->desc_ipa, val, offset == VIRTIO_MMIO_QUEUE_DESC_HIGH);
+            }
             break;
-        case VIRTIO_MMIO_QUEUE_PFN:	 // physical page number for queue, read/write
-            LOG_INFO("[virtio_mmio_write]: VIRTIO_MMIO_QUEUE_PFN queue_pfn's gpa=%p(pfn=%d)\n",
-                    val << 12, val);
-            vq_ring_init(val << 12);
+        case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+        case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+            if (vq && NULL == vq->vm) {
+                virtio_set_addr_half(&vq->avail_ipa, val, offset == VIRTIO_MMIO_QUEUE_DRIVER_HIGH);
+            }
             break;
-        case VIRTIO_MMIO_QUEUE_READY: // ready bit
-
+        case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+        case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+            if (vq && NULL == vq->vm) {
+                virtio_set_addr_half(&vq->used_ipa, val, offset == VIRTIO_MMIO_QUEUE_DEVICE_HIGH);
+            }
             break;
-        case VIRTIO_MMIO_QUEUE_NOTIFY: // write-only
-            LOG_INFO("[virtio_mmio_write]: VIRTIO_MMIO_QUEUE_NOTIFY\n");
-            virtio_blk_req_handler();
+        case VIRTIO_MMIO_QUEUE_READY: // ready bit
+            if (NULL == vq) {
+                break;
+            }
+            spin_lock(&vq->virtq_lock);
+            if (0 == val) {
+                vq->vm = NULL;
+            } else if (NULL == vq->vm && vq_ring_init(vq) < 0) {
+                LOG_WARN("[virtio_mmio_write]: vm=%s queue %d: unusable rings, num=%d\n",
+                         dev->vm->name, vq->index, vq->vring_num);
+            }
+            spin_unlock(&vq->virtq_lock);
             break;
         case VIRTIO_MMIO_INTERRUPT_ACK: // write-only
-
+            if (0 == __atomic_and_fetch(&dev->intr_status, ~(u32)val, __ATOMIC_ACQ_REL)) {
+                vgic_irq_lower(dev->vm, dev->irq);
+                /* a request completed on another pcpu between the two */
+                if (__atomic_load_n(&dev->intr_status, __ATOMIC_ACQUIRE)) {
+                    vgic_irq_raise(dev->vm, dev->irq);
+                }
+            }
             break;
         case VIRTIO_MMIO_STATUS:		 // read/write
             LOG_INFO("[virtio_mmio_write]: VIRTIO_MMIO_STATUS val=%p\n", val);
+            if (0 == val) {
+                virtio_dev_reset(dev);
+                break;
+            }
+            /* no legacy mode: FEATURES_OK does not stick without VERSION_1 */
+            if ((val & VIRTIO_CONFIG_S_FEATURES_OK) &&
+                !(dev->driver_features & (1UL << VIRTIO_F_VERSION_1))) {
+                val &= ~VIRTIO_CONFIG_S_FEATURES_OK;
+            }
+            dev->status = val;
             break;
         default:
-            panic("[virtio_mmio_write]: Invalid/Unsupported offset(%p), ipa=%p, vm=%s, vcpuid=%d, vm's pc=%p\n",
-                  offset, mmio->ipa, vcpu->vm->name, vcpu->cpuid, mmio->pc);
+            /* a guest bug, not ours: the write is ignored */
+            LOG_WARN("[virtio_mmio_write]: invalid/unsupported offset(%p), ipa=%p, vm=%s, vcpuid=%d, vm's pc=%p\n",
+                     offset, mmio->ipa, vcpu->vm->name, vcpu->cpuid, mmio->pc);
+            break;
+    }
+    return 0;
+}
+
+/*
+ * VIRTIO_MMIO_QUEUE_NOTIFY(write-only): the doorbell of queue @val, one per
+ * request batch. The requests are served by the queue's I/O worker, the vcpu
+ * goes on at once and learns about the completion from the device's irq.
+ */
+static int virtio_mmio_notify(struct vcpu *vcpu, u64 offset,
+                              u64 val, struct mmio_access *mmio)
+{
+    struct virtio_dev *dev = virtio_mmio_dev(mmio, offset);
+    struct virt_queue *vq;
+
+    if (NULL == dev || val >= dev->ops->nqueues || NULL == dev->vqs[val].vm) {
+        LOG_WARN("[virtio_mmio_notify]: queue %d not set up, vm=%s\n", val, vcpu->vm->name);
+        return 0;
     }
+    vq = &dev->vqs[val];
+    __atomic_add_fetch(&vq->nr_notify, 1, __ATOMIC_RELAXED);
+    io_work_post(&vq->work);
     return 0;
 }
 
-void virtio_mmio_init(struct vm *vm)
+/* constant identification registers, served on the fast exit path */
+static int virtio_mmio_id_read(struct vcpu *vcpu, u64 offset,
+                               u64 *val, struct mmio_access *mmio)
 {
-    s2_pt_trap(vm, VIRTIO0, VIRTIO0_SIZE, virtio_mmio_read, virtio_mmio_write);
-}
\ No newline at end of file
+    struct virtio_dev *dev = virtio_mmio_dev(mmio, offset);
+
+    switch (offset % VIRTIO_MMIO_STRIDE) {
+        case VIRTIO_MMIO_MAGIC_VALUE:  // 0x74726976
+            *val = 0x74726976;
+            break;
+        case VIRTIO_MMIO_VERSION:      // version; 1 is legacy, 2 is virtio 1.x
+            *val = 2;
+            break;
+        case VIRTIO_MMIO_DEVICE_ID:  // device type; 1 is net, 2 is disk, 0 is none
+            *val = dev ? dev->ops->device_id : 0;
+            break;
+        case VIRTIO_MMIO_VENDOR_ID: // 0x554d4551
+            *val = 0x554d4551;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/* matched on the offset within a slot */
+static const struct mmio_reg virtio_mmio_regs[] = {
+    { VIRTIO_MMIO_MAGIC_VALUE, VIRTIO_MMIO_VENDOR_ID + 4, virtio_mmio_id_read, NULL, MMIO_REG_FAST },
+    { VIRTIO_MMIO_QUEUE_NOTIFY, 4, NULL, virtio_mmio_notify },
+};
+
+static const struct virtio_dev_ops *virtio_type_lookup(u32 device_id)
+{
+    for (int i = 0; i < sizeof(g_virtio_types) / sizeof(g_virtio_types[0]); ++i) {
+        if (g_virtio_types[i]->device_id == device_id) {
+            return g_virtio_types[i];
+        }
+    }
+    return NULL;
+}
+
+static struct virtio_dev *virtio_dev_create(struct vm *vm, u32 slot, const struct virtio_dev_ops *ops)
+{
+    struct virtio_dev *dev = NULL;
+
+    spin_lock(&g_virtio_lock);
+    for (int i = 0; i < VIRTIO_DEV_MAX; ++i) {
+        if (g_virtio_devs[i].used == 0) {
+            dev = &g_virtio_devs[i];
+            memset(dev, 0, sizeof(*dev));
+            dev->used = 1;
+            break;
+        }
+    }
+    spin_unlock(&g_virtio_lock);
+    if (NULL == dev) {
+        return NULL;
+    }
+
+    dev->vm = vm;
+    dev->slot = slot;
+    dev->irq = VIRTIO0_IRQ + slot;
+    dev->ops = ops;
+    if (ops->init && ops->init(dev) < 0) {
+        spin_lock(&g_virtio_lock);
+        dev->used = 0;
+        spin_unlock(&g_virtio_lock);
+        return NULL;
+    }
+    for (int q = 0; q < ops->nqueues; ++q) {
+        struct virt_queue *vq = &dev->vqs[q];
+        vq->index = q;
+        vq->dev = dev;
+        spinlock_init(&vq->virtq_lock);
+        io_work_init(&vq->work, virtio_queue_handler, vq, vq_io_pcpu());
+    }
+
+    vgic_irq_emulated(vm, dev->irq, true);
+    LOG_INFO("[virtio_dev_create]: vm=%s slot %d: %s, irq %d\n", vm->name, slot, ops->name, dev->irq);
+    return dev;
+}
+
+/*
+ * The virtio-mmio bus of @vm: all VIRTIO_MMIO_SLOTS slots are one MMIO
+ * region whose context is the bus, @devs are put in their slots.
+ */
+void virtio_mmio_init(struct vm *vm, struct vm_virtio *devs, int ndevs)
+{
+    struct virtio_mmio_bus *bus = NULL;
+
+    if (0 == ndevs) {
+        return;
+    }
+
+    spin_lock(&g_virtio_lock);
+    for (int i = 0; i < VM_MAX; ++i) {
+        if (g_virtio_buses[i].used == 0) {
+            bus = &g_virtio_buses[i];
+            memset(bus, 0, sizeof(*bus));
+            bus->used = 1;
+            break;
+        }
+    }
+    spin_unlock(&g_virtio_lock);
+    if (NULL == bus) {
+        panic("[virtio_mmio_init]: no virtio-mmio bus left for vm %s\n", vm->name);
+    }
+
+    for (int i = 0; i < ndevs; ++i) {
+        const struct virtio_dev_ops *ops = virtio_type_lookup(devs[i].device_id);
+        if (devs[i].slot >= VIRTIO_MMIO_SLOTS || NULL == ops || bus->slots[devs[i].slot]) {
+            panic("[virtio_mmio_init]: invalid device(id=%d) in slot %d, vm=%s\n",
+                  devs[i].device_id, devs[i].slot, vm->name);
+        }
+        bus->slots[devs[i].slot] = virtio_dev_create(vm, devs[i].slot, ops);
+        if (NULL == bus->slots[devs[i].slot]) {
+            panic("[virtio_mmio_init]: can not create %s in slot %d, vm=%s\n",
+                  ops->name, devs[i].slot, vm->name);
+        }
+    }
+
+    s2_pt_trap(vm, VIRTIO0, VIRTIO_MMIO_SLOTS * VIRTIO_MMIO_STRIDE,
+               virtio_mmio_read, virtio_mmio_write, bus);
+    if (mmio_reg_subhandlers(vm, VIRTIO0, virtio_mmio_regs,
+                             sizeof(virtio_mmio_regs) / sizeof(virtio_mmio_regs[0]), VIRTIO_MMIO_STRIDE) < 0) {
+        panic("[virtio_mmio_init]: can not attach the virtio-mmio registers, vm=%s\n", vm->name);
+    }
+}
@@ -1,16 +1,112 @@
 #include "vm.h"
 #include "lib.h"
 #include "vcpu.h"
+#include "sched.h"
 #include "vgic.h"
 #include "mmio.h"
 #include "guest.h"
 #include "mmu.h"
 #include "virtio.h"
 #include "page_alloc.h"
+#include "cache.h"
+#include "sysreg.h"
+#include "timer.h"
+#include "aarch64.h"
+#include "spinlock.h"
 #include "debug.h"
 
 struct vm g_vms[VM_MAX];
 
+/*
+ * VMID allocator.
+ * vm->vmid carries the generation in its upper bits. When the VMID space is
+ * exhausted a new generation starts: VMIDs of existing VMs are kept (their
+ * vcpus may be running with them on other cpus), every other VMID is
+ * released and all stage1/stage2 TLB entries are flushed once.
+ * VMID 0 is reserved (no VM, boot time benchmarks).
+ */
+#define VMID_MASK           ((1UL << VMID_BITS) - 1)
+#define VMID_GEN(vmid)      ((vmid) & ~VMID_MASK)
+#define VMID_FIRST_GEN      (1UL << VMID_BITS)
+
+static spinlock_t g_vmid_lock = SPINLOCK_INITVAL;
+static u64 g_vmid_gen = VMID_FIRST_GEN;
+static u64 g_vmid_map[(1UL << VMID_BITS) / 64];     /* VMIDs used in g_vmid_gen */
+
+static void vmid_rollover(void)
+{
+    g_vmid_gen += VMID_FIRST_GEN;
+    memset(g_vmid_map, 0, sizeof(g_vmid_map));
+    g_vmid_map[0] = 1;
+
+    for (int i = 0; i < VM_MAX; ++i) {
+        u64 vmid = g_vms[i].vmid & VMID_MASK;
+        if (g_vms[i].used && vmid != 0) {
+            g_vmid_map[vmid / 64] |= 1UL << (vmid % 64);
+            g_vms[i].vmid = g_vmid_gen | vmid;
+        }
+    }
+
+    dsb(ishst);
+    tlbi_all_vmid_is();
+    dsb(ish);
+    isb();
+    LOG_INFO("[vmid] rollover, generation %d\n", g_vmid_gen >> VMID_BITS);
+}
+
+/* a VMID of the current generation for @vm, called with g_vmid_lock held */
+static u64 vmid_alloc(struct vm *vm)
+{
+    for (int pass = 0; pass < 2; ++pass) {
+        for (u64 vmid = 1; vmid <= VMID_MASK; ++vmid) {
+            if (!(g_vmid_map[vmid / 64] & (1UL << (vmid % 64)))) {
+                g_vmid_map[vmid / 64] |= 1UL << (vmid % 64);
+                return g_vmid_gen | vmid;
+            }
+        }
+        vmid_rollover();
+        /* the rollover kept the old VMID of @vm as well, no second one */
+        if (0 != (vm->vmid & VMID_MASK)) {
+            return vm->vmid;
+        }
+    }
+    panic("[vmid_alloc] no free vmid");
+    return 0;
+}
+
+/* VTTBR_EL2 value of @vm, (re)allocating its VMID if it is of an old generation */
+u64 vm_vttbr(struct vm *vm)
+{
+    u64 vmid = __atomic_load_n(&vm->vmid, __ATOMIC_ACQUIRE);
+
+    if (VMID_GEN(vmid) != __atomic_load_n(&g_vmid_gen, __ATOMIC_ACQUIRE)) {
+        spin_lock(&g_vmid_lock);
+        if (VMID_GEN(vm->vmid) != g_vmid_gen) {
+            __atomic_store_n(&vm->vmid, vmid_alloc(vm), __ATOMIC_RELEASE);
+        }
+        vmid = vm->vmid;
+        spin_unlock(&g_vmid_lock);
+    }
+
+    return VTTBR_VMID(vmid) | PTE_PA(vm->stage2_pt);
+}
+
+/* Invalidate @vm's stage2 TLB entries of [ipa, ipa+size) on all cpus */
+void vm_tlb_flush_range(struct vm *vm, u64 ipa, u64 size)
+{
+    u64 old_vttbr;
+    read_sysreg(old_vttbr, vttbr_el2);
+
+    /* TLBI operates on the VMID in VTTBR_EL2 */
+    write_sysreg(vttbr_el2, vm_vttbr(vm));
+    isb();
+
+    s2_tlb_flush_range(ipa, size);
+
+    write_sysreg(vttbr_el2, old_vttbr);
+    isb();
+}
+
 static struct vm *allocvm() {
     for (int i = 0; i < VM_MAX; ++i) {
         if (g_vms[i].used == 0) {
@@ -23,19 +119,134 @@ static struct vm *allocvm() {
 
 void s2_pt_trap(struct vm *vm, u64 ipa, u64 size,
                 int (*read_handler)(struct vcpu *, u64, u64 *, struct mmio_access *),
-                int (*write_handler)(struct vcpu *, u64, u64, struct mmio_access *))
+                int (*write_handler)(struct vcpu *, u64, u64, struct mmio_access *),
+                void *ctx)
 {
     u64 *stage2_pt = vm->stage2_pt;
     if (pagewalk(stage2_pt, ipa, 0) != NULL) {
+        u64 old_vttbr;
+        read_sysreg(old_vttbr, vttbr_el2);
+        /* split_block() and the flush before the pages are freed act on the loaded VMID */
+        write_sysreg(vttbr_el2, vm_vttbr(vm));
+        isb();
         pageunmap(stage2_pt, ipa, size);
+        write_sysreg(vttbr_el2, old_vttbr);
+        isb();
     }
 
-    int ret = mmio_reg_handler(vm, ipa, size, read_handler, write_handler);
+    int ret = mmio_reg_handler(vm, ipa, size, read_handler, write_handler, ctx);
     if (ret < 0) {
         panic("mmio_reg_handler failed");
     }
+}
+
+enum vm_mem_type vm_mem_type(struct vm *vm, u64 ipa)
+{
+    /* later regions override earlier ones, regions[0] is the whole RAM */
+    for (int i = vm->nregions - 1; i >= 0; --i) {
+        struct vm_region *r = &vm->regions[i];
+        if (r->ipa <= ipa && ipa < r->ipa + r->size) {
+            return r->type;
+        }
+    }
+    return VM_MEM_DEVICE;
+}
+
+static u64 vm_s2_attr(struct vm *vm, u64 ipa)
+{
+    switch (vm_mem_type(vm, ipa)) {
+        case VM_MEM_NORMAL:
+            return S2PTE_NORMAL;
+        case VM_MEM_UNCACHED:
+            return S2PTE_UNCACHED;
+        case VM_MEM_DEVICE:
+        default:
+            return S2PTE_DEVICE;
+    }
+}
+
+static void vm_add_region(struct vm *vm, u64 ipa, u64 size, enum vm_mem_type type)
+{
+    if (vm->nregions >= VM_REGION_MAX) {
+        panic("[vm_add_region] too many regions");
+    }
+    vm->regions[vm->nregions].ipa = ipa;
+    vm->regions[vm->nregions].size = size;
+    vm->regions[vm->nregions].type = type;
+    vm->nregions++;
+}
+
+/*
+ * The hypervisor accesses guest RAM through its cacheable EL2 identity
+ * mapping. For VM_MEM_NORMAL regions both views are write-back inner
+ * shareable and hardware keeps them coherent. For uncached regions, whenever
+ * the hypervisor acts as a DMA master on guest memory (virtio rings, ramdisk
+ * copies) the two views have to be made coherent by hand.
+ */
+
+/* Make the guest's writes to [pa, pa+size) visible to the hypervisor */
+void vm_sync_from_guest(struct vm *vm, u64 ipa, u64 pa, u64 size)
+{
+    if (vm_mem_type(vm, ipa) == VM_MEM_NORMAL) {
+        return;
+    }
+    dcache_inval_range(pa, size);
+}
+
+/* Make the hypervisor's writes to [pa, pa+size) visible to the guest */
+void vm_sync_to_guest(struct vm *vm, u64 ipa, u64 pa, u64 size)
+{
+    if (vm_mem_type(vm, ipa) == VM_MEM_NORMAL) {
+        return;
+    }
+    dcache_flush_range(pa, size);
+}
+
+/* no region other than RAM overrides any part of [ipa, ipa+size) */
+static int vm_region_uniform(struct vm *vm, u64 ipa, u64 size)
+{
+    for (int i = 1; i < vm->nregions; ++i) {
+        struct vm_region *r = &vm->regions[i];
+        if (r->ipa < ipa + size && ipa < r->ipa + r->size) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    tlb_flush();
+/* map guest RAM, page by page only where a region overrides the RAM attribute */
+static void vm_map_ram(struct vm *vm, u64 ipa, u64 pa, u64 size)
+{
+    if (vm_region_uniform(vm, ipa, size)) {
+        pagemap(vm->stage2_pt, ipa, pa, size, vm_s2_attr(vm, ipa) | S2PTE_RW);
+        return;
+    }
+    for (u64 off = 0; off < size; off += PAGE_SIZE) {
+        pagemap(vm->stage2_pt, ipa + off, pa + off, PAGE_SIZE,
+                vm_s2_attr(vm, ipa + off) | S2PTE_RW);
+    }
+}
+
+/* copy @size bytes to guest RAM at @ipa, page by page; -1 if a page is unmapped */
+int vm_copy_to_guest(struct vm *vm, u64 ipa, const void *src, u64 size)
+{
+    while (size > 0) {
+        u64 n = PAGE_SIZE - (ipa & (PAGE_SIZE - 1));
+        if (n > size) {
+            n = size;
+        }
+        u64 pa = ipa2pa(vm->stage2_pt, ipa);
+        if (0 == pa || vm_mem_type(vm, ipa) == VM_MEM_DEVICE) {
+            return -1;
+        }
+        memcpy((void *)pa, src, n);
+        vm_sync_to_guest(vm, ipa, pa, n);
+
+        ipa += n;
+        src = (const char *)src + n;
+        size -= n;
+    }
+    return 0;
 }
 
 extern char _binary_guest_xv6_start[];
@@ -73,16 +284,34 @@ void create_vm(struct vmconfig *vmcfg)
     vm->nvcpu = vmcfg->nvcpu;
     strcpy(vm->name, guest_img->name);
 
+    vm->nregions = 0;
+    vm_add_region(vm, vmcfg->entrypoint, vmcfg->ram_size, VM_MEM_NORMAL);
+    for (int i = 0; i < vmcfg->nregions; ++i) {
+        vm_add_region(vm, vmcfg->regions[i].ipa, vmcfg->regions[i].size, vmcfg->regions[i].type);
+    }
+
+    /* the guest's virtual counter starts at 0 */
+    vm->cntvoff = get_syscount();
+
     vm->vcpus[0] = new_vcpu(vm, 0, vmcfg->entrypoint);
 
     for (int i = 1; i < vmcfg->nvcpu; ++i) {
         vm->vcpus[i] = new_vcpu(vm, i, 0);
     }
 
+    for (int i = 0; i < vmcfg->nvcpu; ++i) {
+        if (NULL == vm->vcpus[i]) {
+            panic("[create_vm] no vcpu");
+        }
+        sched_vcpu_attach(vm->vcpus[i], vmcfg->cpu_affinity, vmcfg->sched_weight);
+    }
+
     vm->stage2_pt = (u64 *)alloc_page();
     if (NULL == vm->stage2_pt) {
         panic("[create_vm] no mem");
     }
+    memset(vm->stage2_pt, 0, PAGE_SIZE);
+    vm->vmid = 0;   /* generation 0 is never current, allocated on first use */
 
     u64 p, size, ipa, pa;
 
@@ -93,74 +322,83 @@ void create_vm(struct vmconfig *vmcfg)
      */
 
     u64 guest_filesz = guest_img->end - guest_img->start;
-    u64 page_num = 0;
+    u64 chunk_num = 0;
+    u64 map_start = get_syscount();
+    struct pagemap_stat stat = g_pagemap_stat;
 
     LOG_INFO("\n=====================  READY TO COPY GUEST IMAGE and Map GuestOS's stage2 table  =====================>\n\n");
     LOG_INFO("guest_img at RAM pa=%p, guest_img->size(memsize)=%p, guest_img's filesize=%p\n\n",
             guest_img->start, guest_img->size, guest_filesz);
 
-    /* create stage2 page table for guest os image */
-    LOG_INFO("map guest_img's file size content:\n");
-    for (p = 0; p < guest_filesz; p += PAGE_SIZE) {
-        void *page = (void *)alloc_page();
-        if (NULL == page) {
-            panic("[create_vm] no mem 2");
+    /*
+     * Guest RAM is allocated in 2MB aligned contiguous chunks so that pagemap()
+     * can use stage2 block descriptors: far fewer table walks at boot and far
+     * fewer TLB entries at runtime. 4KB pages are only used for an unaligned
+     * head/tail or when no free 2MB chunk is left.
+     */
+    for (p = 0; p < vmcfg->ram_size; p += size) {
+        ipa = vmcfg->entrypoint + p;
+        size = PAGE_SIZE;
+        if (ipa % BLOCK_SIZE_L2 == 0 && vmcfg->ram_size - p >= BLOCK_SIZE_L2) {
+            size = BLOCK_SIZE_L2;
         }
-        ++page_num;
 
-        if (guest_filesz - p < PAGE_SIZE) {
-            size = guest_filesz - p;
-        } else {
+        pa = alloc_pages_aligned(size / PAGE_SIZE, size / PAGE_SIZE);
+        if (-1ULL == pa && size != PAGE_SIZE) {
             size = PAGE_SIZE;
+            pa = alloc_page();
+        }
+        if (-1ULL == pa) {
+            panic("[create_vm] no mem for guest ram");
         }
-        memcpy(page, (char *)guest_img->start + p, size);
+        ++chunk_num;
 
-        ipa = vmcfg->entrypoint + p;
-        pa = (u64)page;
-        LOG_INFO("--- IPA: %p, PA: %p\n", ipa, (u64)pa);
-        pagemap(vm->stage2_pt, ipa, pa, PAGE_SIZE, S2PTE_NORMAL | S2PTE_RW);
-    }
-    LOG_INFO("\nmap remaining mem size content:\n");
-    for (; p < guest_img->size; p += PAGE_SIZE) {
-        void *page = (void *)alloc_page();
-        if (NULL == page) {
-            panic("[create_vm] no mem 3");
+        /* copy guest image's file content, zero its bss */
+        if (p < guest_img->size) {
+            u64 n = (guest_img->size - p < size) ? guest_img->size - p : size;
+            memset((void *)pa, 0, n);
+            if (p < guest_filesz) {
+                memcpy((void *)pa, (char *)guest_img->start + p,
+                       (guest_filesz - p < n) ? guest_filesz - p : n);
+            }
+            /* guest boots with its MMU off (non-cacheable), always push the image to PoC */
+            dcache_flush_range(pa, n);
         }
-        ++page_num;
-        memset(page, 0, PAGE_SIZE);
-        ipa = vmcfg->entrypoint + p;
-        pa = (u64)page;
-        LOG_INFO("--- IPA: %p, PA: %p\n", ipa, (u64)pa);
-        pagemap(vm->stage2_pt, ipa, pa, PAGE_SIZE, S2PTE_NORMAL | S2PTE_RW);
+
+        LOG_INFO("--- IPA: %p, PA: %p, size: %p\n", ipa, pa, size);
+        vm_map_ram(vm, ipa, pa, size);
     }
-    LOG_INFO("guest image's total page num = %d (%d KB)\n", page_num, page_num*4);
+    icache_inval_all();
+
+    LOG_INFO("guest ram: %d chunks, %dMB, stage2 built in %d us\n", chunk_num,
+             vmcfg->ram_size / 1024 / 1024, count_to_time_ns(get_syscount() - map_start) / 1000);
+    LOG_INFO("stage2: %d walks, %d tables, %d 1GB blocks, %d 2MB blocks, %d 4KB pages\n",
+             g_pagemap_stat.walks - stat.walks, g_pagemap_stat.tables - stat.tables,
+             g_pagemap_stat.blocks[1] - stat.blocks[1], g_pagemap_stat.blocks[2] - stat.blocks[2],
+             g_pagemap_stat.pages - stat.pages);
     LOG_INFO("=====================================================================================\n\n");
 
-    page_num = 0;
-    LOG_INFO("\n=======================  Map Guest OS's RAM(size=%p)  ========================\n", vmcfg->ram_size);
-    /* create stage2 page table for guest os's RAM */
-    for (; p < vmcfg->ram_size; p += PAGE_SIZE) {
-        void *page = (void *)alloc_page();
-        if (NULL == page) {
-            panic("[create_vm] no mem 3");
+    /* create stage2 page table for guestos's pass through peripherals */
+    for (int i = 1; i < vm->nregions; ++i) {
+        struct vm_region *r = &vm->regions[i];
+        if (r->type != VM_MEM_DEVICE) {
+            continue;
         }
-        ++page_num;
-
-        ipa = vmcfg->entrypoint + p;
-        pa = (u64)page;
-        // LOG_TRACE("--- IPA: %p, PA: %p\n", ipa, (u64)pa);
-        pagemap(vm->stage2_pt, ipa, pa, PAGE_SIZE, S2PTE_NORMAL | S2PTE_RW);
+        LOG_INFO("\n======================  Map Guest OS's device(pa=ipa=%p, size=%p)  ======================>\n\n",
+                 r->ipa, r->size);
+        pagemap(vm->stage2_pt, r->ipa, r->ipa, r->size, S2PTE_DEVICE | S2PTE_RW);
     }
-    LOG_INFO("ram's total page num = %d (%dKB, %dMB)\n", page_num, page_num*4, page_num*4/1024);
-    LOG_INFO("=====================================================================================\n\n");
 
-    LOG_INFO("\n======================  Map Guest OS's Uart(pa=ipa=%p)  ======================>\n\n", UARTBASE);
-    /* create stage2 page table for guestos's peripheral */
-    pagemap(vm->stage2_pt, UARTBASE, UARTBASE,PAGE_SIZE, S2PTE_DEVICE|S2PTE_RW);
+    /* before the device models, they claim the SPIs they raise */
+    vm->vgic = new_vgic(vm);
+    for (int i = 0; i < vmcfg->nirqs; ++i) {
+        vgic_irq_passthrough(vm, vmcfg->irqs[i].pirq, vmcfg->irqs[i].virq);
+    }
 
-    virtio_mmio_init(vm);
+    virtio_mmio_init(vm, vmcfg->virtio, vmcfg->nvirtio);
 
-    vm->vgic = new_vgic(vm);
+    /* all MMIO regions are registered, vcpus read the table lock-free */
+    mmio_seal(vm);
 
     vcpu_ready(vm->vcpus[0]);
 }
\ No newline at end of file